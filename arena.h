@@ -0,0 +1,228 @@
+#ifndef SNP_ARENA_H_
+#define SNP_ARENA_H_
+
+#include <memory_resource>
+#include <new>
+#include <stdint.h>
+#include "memory.h"
+
+namespace snp {
+  // Region for objects that die together, e.g. those of one request. allocate bumps a
+  // pointer through blocks taken from Memory, the objects have no header and are never
+  // freed on their own. reset makes all blocks available again without touching the
+  // objects, the destructor or release gives them back to Memory.
+  // Not thread-safe: one Arena per thread or request.
+  class Arena
+  {
+    public:
+      static const size_t BLOCK_SIZE_DEFAULT = 64 * 1024;
+      // The alignment of malloc, used if none is given
+      static const size_t ALIGNMENT = 2 * sizeof(size_t);
+
+      explicit Arena(size_t block_size = BLOCK_SIZE_DEFAULT)
+        : block_size(block_size > 0 ? block_size : BLOCK_SIZE_DEFAULT) {}
+
+      ~Arena() { release(); }
+
+      Arena(const Arena&) = delete;
+      Arena &operator=(const Arena&) = delete;
+
+      // nullptr if alignment is not a power of two or Memory is out of memory
+      void *allocate(size_t size, size_t alignment = ALIGNMENT)
+      {
+        // Checked before the mask is built from it, so a bad alignment fails in every block
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+          return nullptr;
+
+        // Fast path: the object fits behind the last one in the current block
+        uintptr_t start = ((uintptr_t) top + alignment - 1) & ~(uintptr_t) (alignment - 1);
+        if (start >= (uintptr_t) top && start < (uintptr_t) end && size <= (uintptr_t) end - start)
+        {
+          top = (char*) start + size;
+          return (void*) start;
+        }
+
+        return allocateBlock(size, alignment);
+      }
+
+      // Everything allocated so far is gone, the blocks are used again from the first one on.
+      // The blocks of large objects are kept for the large objects of the next round, in
+      // the same order. Those the round before did not take again are given back here,
+      // one free each, so a program that repeats its requests frees nothing.
+      void reset()
+      {
+        releaseBlocks(spare);
+        spare = large;
+        large = nullptr;
+        large_last = nullptr;
+
+        current = blocks;
+        top = current != nullptr ? current->data : nullptr;
+        end = current != nullptr ? current->data + current->size : nullptr;
+        filled = 0;
+      }
+
+      // Everything allocated so far is gone and all blocks are given back
+      void release()
+      {
+        releaseBlocks(large);
+        releaseBlocks(spare);
+        releaseBlocks(blocks);
+
+        large_last = nullptr;
+        current = nullptr;
+        top = nullptr;
+        end = nullptr;
+        filled = 0;
+      }
+
+      // Bytes handed out since the last reset, with the padding for alignment
+      size_t used() const
+      {
+        return filled + (current != nullptr ? top - current->data : 0);
+      }
+
+      // Bytes of all blocks taken from Memory, without their headers
+      size_t footprint() const { return block_bytes; }
+
+    private:
+      typedef struct arena_block
+      {
+          struct arena_block *next;
+          size_t size; // bytes of data
+          char data[0]; // aligned like malloc: behind two words
+      } arena_block;
+
+      size_t block_size;
+      arena_block *blocks = nullptr; // in the order they are used after a reset
+      arena_block *current = nullptr; // the blocks in front of it are full
+      arena_block *large = nullptr; // blocks of a single large object, in the order they were taken
+      arena_block *large_last = nullptr;
+      arena_block *spare = nullptr; // large blocks from before the last reset
+      char *top = nullptr; // next free byte in the current block
+      char *end = nullptr;
+      size_t filled = 0; // bytes used in the blocks in front of the current one and the large ones
+      size_t block_bytes = 0;
+
+      void *allocateBlock(size_t size, size_t alignment)
+      {
+        // Prevent that size + alignment overflows
+        if (size > (size_t) -1 / 2 || alignment > (size_t) -1 / 4)
+          return nullptr;
+
+        size_t needed = size + alignment - 1;
+
+        // Large objects get a block of their own, the rest of the current block stays in use
+        if (needed > block_size / 4)
+        {
+          arena_block *block = largeBlock(needed);
+          if (block == nullptr)
+            return nullptr;
+
+          block->next = nullptr;
+          if (large_last != nullptr)
+            large_last->next = block;
+          else
+            large = block;
+          large_last = block;
+          filled += needed;
+
+          return (void*) (((uintptr_t) block->data + alignment - 1) & ~(uintptr_t) (alignment - 1));
+        }
+
+        // The next block kept from before the last reset, they all have block_size bytes,
+        // or a new one at the end
+        arena_block *next = current != nullptr ? current->next : blocks;
+        if (next == nullptr)
+        {
+          next = newBlock(block_size);
+          if (next == nullptr)
+            return nullptr;
+
+          next->next = nullptr;
+          if (current != nullptr)
+            current->next = next;
+          else
+            blocks = next;
+        }
+
+        if (current != nullptr)
+          filled += top - current->data;
+
+        current = next;
+        top = current->data;
+        end = current->data + current->size;
+
+        return allocate(size, alignment);
+      }
+
+      arena_block *newBlock(size_t size)
+      {
+        auto *block = (arena_block*) Memory::malloc(sizeof(arena_block) + size);
+        if (block == nullptr)
+          return nullptr;
+
+        block->size = size;
+        block_bytes += size;
+        return block;
+      }
+
+      // The next spare if it fits, else a new block. A spare that is too small is given
+      // back, so every spare is looked at only once.
+      arena_block *largeBlock(size_t size)
+      {
+        while (spare != nullptr)
+        {
+          arena_block *block = spare;
+          spare = block->next;
+          if (block->size >= size)
+            return block;
+
+          block_bytes -= block->size;
+          Memory::free(block);
+        }
+
+        return newBlock(size);
+      }
+
+      void releaseBlocks(arena_block *&list)
+      {
+        while (list != nullptr)
+        {
+          arena_block *next = list->next;
+          block_bytes -= list->size;
+          Memory::free(list);
+          list = next;
+        }
+      }
+  };
+
+  // Arena as the memory resource of the std::pmr containers. Deallocation does nothing,
+  // the memory is given back when the arena is reset or destroyed.
+  class ArenaResource : public std::pmr::memory_resource
+  {
+    public:
+      explicit ArenaResource(Arena &arena) : arena(arena) {}
+
+    private:
+      Arena &arena;
+
+      void *do_allocate(size_t bytes, size_t alignment) override
+      {
+        void *ptr = arena.allocate(bytes, alignment);
+        if (ptr == nullptr)
+          throw std::bad_alloc();
+        return ptr;
+      }
+
+      void do_deallocate(void *, size_t, size_t) override {}
+
+      bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+      {
+        auto *resource = dynamic_cast<const ArenaResource*>(&other);
+        return resource != nullptr && &resource->arena == &arena;
+      }
+  };
+}
+
+#endif /* SNP_ARENA_H_ */
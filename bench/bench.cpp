@@ -0,0 +1,508 @@
+/*
+ * bench.cpp
+ *
+ * Allocator workloads, each run in a child process of its own, against
+ * snp::Memory and against the malloc of the C library as a baseline:
+ *
+ *   larson      threads replace random chunks, every round they continue
+ *               with the chunks of the next thread and free those
+ *   threadtest  threads allocate a batch of chunks and free it again
+ *   fixed       random replacements in a set of 64 byte chunks
+ *   powerlaw    random replacements with sizes from a power law
+ *   realloc     buffers grow in small steps with realloc
+ *
+ * The allocator runs as is and in hardened mode (hard): one allocation in
+ * HARDENED_GUARD_RATE between guard pages and a quarantine of poisoned
+ * chunks of HARDENED_QUARANTINE bytes.
+ *
+ * For each run it prints the operations per second of all threads together,
+ * the latency percentiles of single malloc/free/realloc calls, the peak
+ * resident set size and the fragmentation: the resident memory the workload
+ * added divided by the bytes it had requested and not freed at the end.
+ *
+ * usage: bench [workload|all] [threads] [operations per thread]
+ */
+#include "../memory.h"
+#include "../tests/bench.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_THREADS 64
+
+// Latency histogram: exact below 8 ns, then 8 buckets per power of two
+#define HISTOGRAM_BUCKETS (62 * 8)
+
+// Live chunks per thread
+#define MAX_SLOTS 65536
+#define LARSON_SLOTS 20000
+#define LARSON_ROUNDS 10
+#define THREADTEST_BATCH 100
+#define FIXED_SLOTS 65536
+#define FIXED_SIZE 64
+#define POWERLAW_SLOTS 65536
+#define POWERLAW_MIN 16
+#define POWERLAW_MAX (1 << 20)
+#define POWERLAW_ALPHA 1.3
+#define REALLOC_BUFFERS 64
+#define REALLOC_MAX (64 * 1024)
+#define HARDENED_GUARD_RATE 1000
+#define HARDENED_QUARANTINE (1024 * 1024)
+
+typedef struct allocator
+{
+  const char *name;
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void (*setup)(); // called in the child before the run, may be nullptr
+} allocator;
+
+typedef struct histogram
+{
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram;
+
+typedef struct worker
+{
+  int id;
+  unsigned int seed;
+  histogram latency;
+  uint64_t operations;
+  long live_bytes; // may get negative when freeing chunks of other threads
+  long live_at_end; // before the cleanup
+  double start;
+  double end;
+} worker;
+
+typedef struct result
+{
+  double operations_per_s;
+  uint64_t p50, p99, p999;
+  long peak_rss; // KiB
+  double fragmentation;
+} result;
+
+typedef struct workload
+{
+  const char *name;
+  void (*run)(worker *w);
+  void (*cleanup)(worker *w);
+} workload;
+
+static void hardened()
+{
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, HARDENED_GUARD_RATE);
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, HARDENED_QUARANTINE);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 1);
+}
+
+static allocator allocators[] = {
+  { "snp", snp::Memory::malloc, snp::Memory::free, snp::Memory::realloc, nullptr },
+  { "hard", snp::Memory::malloc, snp::Memory::free, snp::Memory::realloc, hardened },
+  { "glibc", ::malloc, ::free, ::realloc, nullptr },
+};
+
+// State of the run in the child process
+static allocator *alloc;
+static int thread_count;
+static long operation_count;
+static pthread_barrier_t barrier;
+static worker workers[MAX_THREADS];
+static long rss_before;
+static long rss_after;
+
+static void *slots[MAX_THREADS][MAX_SLOTS];
+static size_t slot_sizes[MAX_THREADS][MAX_SLOTS];
+
+static int bucket_of(uint64_t ns)
+{
+  if (ns < 8)
+    return ns;
+
+  int log2 = 63 - __builtin_clzll(ns);
+  int bucket = (log2 - 2) * 8 + ((ns >> (log2 - 3)) & 7);
+
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t bucket_start(int bucket)
+{
+  if (bucket < 8)
+    return bucket;
+
+  int log2 = bucket / 8 + 2;
+  return (uint64_t) (8 + bucket % 8) << (log2 - 3);
+}
+
+static uint64_t percentile(histogram *h, uint64_t total, double fraction)
+{
+  uint64_t rank = (uint64_t) (total * fraction);
+  uint64_t seen = 0;
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += h->counts[i];
+    if (seen > rank)
+      return bucket_start(i);
+  }
+
+  return bucket_start(HISTOGRAM_BUCKETS - 1);
+}
+
+// Wrappers that time the call and keep track of the live bytes
+
+static void *timed_malloc(worker *w, size_t size)
+{
+  uint64_t start = now_ns();
+  void *ptr = alloc->malloc(size);
+  w->latency.counts[bucket_of(now_ns() - start)]++;
+  w->operations++;
+
+  if (ptr == nullptr)
+  {
+    fprintf(stderr, "%s: malloc(%zu) failed\n", alloc->name, size);
+    exit(1);
+  }
+
+  // Touch every page like a program would
+  for (size_t i = 0; i < size; i += 4096)
+    ((char*) ptr)[i] = (char) w->id;
+  w->live_bytes += size;
+
+  return ptr;
+}
+
+static void timed_free(worker *w, void *ptr, size_t size)
+{
+  uint64_t start = now_ns();
+  alloc->free(ptr);
+  w->latency.counts[bucket_of(now_ns() - start)]++;
+  w->operations++;
+
+  w->live_bytes -= size;
+}
+
+static void *timed_realloc(worker *w, void *ptr, size_t old_size, size_t size)
+{
+  uint64_t start = now_ns();
+  void *new_ptr = alloc->realloc(ptr, size);
+  w->latency.counts[bucket_of(now_ns() - start)]++;
+  w->operations++;
+
+  if (new_ptr == nullptr)
+  {
+    fprintf(stderr, "%s: realloc(%zu) failed\n", alloc->name, size);
+    exit(1);
+  }
+
+  // Write to the new end of the buffer
+  ((char*) new_ptr)[size - 1] = (char) w->id;
+  w->live_bytes += size - old_size;
+
+  return new_ptr;
+}
+
+static void free_slots(int set, int count)
+{
+  // Not part of the measurement
+  for (int i = 0; i < count; i++)
+  {
+    alloc->free(slots[set][i]);
+    slots[set][i] = nullptr;
+    slot_sizes[set][i] = 0;
+  }
+}
+
+// Workloads
+
+static void larson(worker *w)
+{
+  long per_round = operation_count / 2 / LARSON_ROUNDS;
+
+  for (int i = 0; i < LARSON_SLOTS; i++)
+  {
+    slot_sizes[w->id][i] = rand_r(&w->seed) % 400 + 16;
+    slots[w->id][i] = timed_malloc(w, slot_sizes[w->id][i]);
+  }
+
+  for (int round = 0; round < LARSON_ROUNDS; round++)
+  {
+    // Continue with the chunks another thread allocated in the last round
+    pthread_barrier_wait(&barrier);
+    int set = (w->id + round) % thread_count;
+
+    for (long i = 0; i < per_round; i++)
+    {
+      int index = rand_r(&w->seed) % LARSON_SLOTS;
+      timed_free(w, slots[set][index], slot_sizes[set][index]);
+
+      slot_sizes[set][index] = rand_r(&w->seed) % 400 + 16;
+      slots[set][index] = timed_malloc(w, slot_sizes[set][index]);
+    }
+  }
+}
+
+static void larson_cleanup(worker *w)
+{
+  free_slots(w->id, LARSON_SLOTS);
+}
+
+static void threadtest(worker *w)
+{
+  void *batch[THREADTEST_BATCH];
+
+  for (long done = 0; done < operation_count; done += 2 * THREADTEST_BATCH)
+  {
+    for (int i = 0; i < THREADTEST_BATCH; i++)
+      batch[i] = timed_malloc(w, FIXED_SIZE);
+    for (int i = 0; i < THREADTEST_BATCH; i++)
+      timed_free(w, batch[i], FIXED_SIZE);
+  }
+}
+
+static void replace_slots(worker *w, int count, size_t (*size_of)(worker *w))
+{
+  for (int i = 0; i < count; i++)
+  {
+    slot_sizes[w->id][i] = size_of(w);
+    slots[w->id][i] = timed_malloc(w, slot_sizes[w->id][i]);
+  }
+
+  for (long i = 0; i < operation_count / 2; i++)
+  {
+    int index = rand_r(&w->seed) % count;
+    timed_free(w, slots[w->id][index], slot_sizes[w->id][index]);
+
+    slot_sizes[w->id][index] = size_of(w);
+    slots[w->id][index] = timed_malloc(w, slot_sizes[w->id][index]);
+  }
+}
+
+static size_t fixed_size(worker *)
+{
+  return FIXED_SIZE;
+}
+
+static size_t powerlaw_size(worker *w)
+{
+  // Pareto distribution: most requests are small, a few are very large
+  double u = (rand_r(&w->seed) + 1.0) / ((double) RAND_MAX + 2.0);
+  double size = POWERLAW_MIN / pow(u, 1 / POWERLAW_ALPHA);
+
+  return size < POWERLAW_MAX ? (size_t) size : POWERLAW_MAX;
+}
+
+static void fixed(worker *w)
+{
+  replace_slots(w, FIXED_SLOTS, fixed_size);
+}
+
+static void fixed_cleanup(worker *w)
+{
+  free_slots(w->id, FIXED_SLOTS);
+}
+
+static void powerlaw(worker *w)
+{
+  replace_slots(w, POWERLAW_SLOTS, powerlaw_size);
+}
+
+static void powerlaw_cleanup(worker *w)
+{
+  free_slots(w->id, POWERLAW_SLOTS);
+}
+
+static void realloc_growth(worker *w)
+{
+  for (long i = 0; i < operation_count; i++)
+  {
+    int index = rand_r(&w->seed) % REALLOC_BUFFERS;
+    size_t size = slot_sizes[w->id][index];
+    size_t step = rand_r(&w->seed) % 256 + 1;
+
+    // Start over with a small buffer once it is large
+    if (size + step > REALLOC_MAX)
+    {
+      timed_free(w, slots[w->id][index], size);
+      slots[w->id][index] = nullptr;
+      slot_sizes[w->id][index] = 0;
+      continue;
+    }
+
+    slots[w->id][index] = timed_realloc(w, slots[w->id][index], size, size + step);
+    slot_sizes[w->id][index] = size + step;
+  }
+}
+
+static void realloc_cleanup(worker *w)
+{
+  free_slots(w->id, REALLOC_BUFFERS);
+}
+
+static workload workloads[] = {
+  { "larson", larson, larson_cleanup },
+  { "threadtest", threadtest, nullptr },
+  { "fixed", fixed, fixed_cleanup },
+  { "powerlaw", powerlaw, powerlaw_cleanup },
+  { "realloc", realloc_growth, realloc_cleanup },
+};
+
+static workload *current;
+
+static void *run_worker(void *arg)
+{
+  worker *w = (worker*) arg;
+
+  // All threads exist, their stacks are not counted as allocated memory
+  if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    rss_before = resident_bytes();
+  pthread_barrier_wait(&barrier);
+
+  w->start = now_s();
+
+  current->run(w);
+
+  w->end = now_s();
+  w->live_at_end = w->live_bytes;
+
+  // Measure while everything is still allocated
+  if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    rss_after = resident_bytes();
+  pthread_barrier_wait(&barrier);
+
+  if (current->cleanup != nullptr)
+    current->cleanup(w);
+
+  return nullptr;
+}
+
+static result run(workload *load, allocator *allocator)
+{
+  pthread_t threads[MAX_THREADS];
+  result r = {};
+
+  current = load;
+  alloc = allocator;
+
+  if (allocator->setup != nullptr)
+    allocator->setup();
+
+  pthread_barrier_init(&barrier, nullptr, thread_count);
+
+  for (int i = 0; i < thread_count; i++)
+  {
+    workers[i].id = i;
+    workers[i].seed = i + 1;
+    pthread_create(&threads[i], nullptr, run_worker, &workers[i]);
+  }
+  for (int i = 0; i < thread_count; i++)
+    pthread_join(threads[i], nullptr);
+
+  // Merge the results of all threads
+  histogram latency = {};
+  uint64_t operations = 0;
+  long live_bytes = 0;
+  double start = workers[0].start, end = workers[0].end;
+
+  for (int i = 0; i < thread_count; i++)
+  {
+    for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+      latency.counts[j] += workers[i].latency.counts[j];
+    operations += workers[i].operations;
+    live_bytes += workers[i].live_at_end;
+    start = workers[i].start < start ? workers[i].start : start;
+    end = workers[i].end > end ? workers[i].end : end;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  r.operations_per_s = operations / (end - start);
+  r.p50 = percentile(&latency, operations, 0.5);
+  r.p99 = percentile(&latency, operations, 0.99);
+  r.p999 = percentile(&latency, operations, 0.999);
+  r.peak_rss = usage.ru_maxrss;
+  r.fragmentation = live_bytes > 0 ? (double) (rss_after - rss_before) / live_bytes : 0;
+
+  return r;
+}
+
+static void run_in_child(workload *load, allocator *allocator)
+{
+  // A process of its own, so the peak RSS and the heap belong to this run only
+  int fds[2];
+  if (pipe(fds) != 0)
+    exit(1);
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(fds[0]);
+    result r = run(load, allocator);
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+
+  result r;
+  bool ok = read(fds[0], &r, sizeof(r)) == sizeof(r);
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    printf("%-11s %-6s %7d   failed\n", load->name, allocator->name, thread_count);
+    return;
+  }
+
+  printf("%-11s %-6s %7d %12.0f %8lu %8lu %8lu %10.1f %10.2f\n",
+         load->name, allocator->name, thread_count, r.operations_per_s,
+         (unsigned long) r.p50, (unsigned long) r.p99, (unsigned long) r.p999,
+         r.peak_rss / 1024.0, r.fragmentation);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *name = argc > 1 ? argv[1] : "all";
+  thread_count = argc > 2 ? atoi(argv[2]) : 4;
+  operation_count = argc > 3 ? atol(argv[3]) : 1000000;
+
+  if (thread_count < 1 || thread_count > MAX_THREADS || operation_count < 1)
+  {
+    fprintf(stderr, "usage: %s [workload|all] [threads 1-%d] [operations per thread]\n", argv[0], MAX_THREADS);
+    return 1;
+  }
+
+  bool found = false;
+
+  printf("%-11s %-6s %7s %12s %8s %8s %8s %10s %10s\n", "workload", "malloc", "threads",
+         "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak MiB", "RSS/live");
+
+  for (workload &load : workloads)
+  {
+    if (strcmp(name, "all") != 0 && strcmp(name, load.name) != 0)
+      continue;
+    found = true;
+
+    for (allocator &allocator : allocators)
+      run_in_child(&load, &allocator);
+  }
+
+  if (!found)
+  {
+    fprintf(stderr, "unknown workload %s\n", name);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * replay.cpp
+ *
+ * Runs a trace written by snp::Memory::startTrace again, e.g. one taken with
+ *
+ *   SNPMALLOC_TRACE=/tmp/app LD_PRELOAD=./libsnpmalloc.so app
+ *
+ * against snp::Memory and against the malloc of the C library, each in a
+ * child process of its own. Every traced thread is replayed by a thread of
+ * its own (threads beyond MAX_THREADS share them), which makes its calls in
+ * their order as fast as it can and writes to every page it gets. A free or
+ * realloc of a chunk that another thread allocated waits until that thread
+ * has allocated it in the replay as well.
+ *
+ * A chunk is known in the trace by its address while it is allocated. The
+ * calls are ordered by the time a chunk was given up (the start of a call)
+ * and handed out (its end), which tells which allocation a free belongs to.
+ * Chunks that were allocated before the trace started are not freed.
+ *
+ * For each allocator it prints the time from the first to the last call,
+ * the calls per second and the mean time of a call, the peak resident set
+ * size and the fragmentation: the resident memory the replay added divided
+ * by the bytes that were allocated and not freed at the end of the trace.
+ *
+ * usage: replay trace
+ */
+#include "../memory.h"
+#include "../tests/bench.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unordered_map>
+#include <vector>
+
+#define MAX_THREADS 64
+
+typedef snp::Memory::TraceEvent TraceEvent;
+
+typedef struct allocator
+{
+  const char *name;
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void *(*calloc)(size_t count, size_t size);
+  void *(*memalign)(size_t alignment, size_t size);
+} allocator;
+
+// A traced call with the chunks it allocates and gives up numbered in the order they were allocated
+typedef struct call
+{
+  int type;
+  size_t size;
+  size_t alignment;
+  long object; // -1: none
+  long old_object; // -1: none, or allocated before the trace
+} call;
+
+// A chunk given up or handed out by an event
+typedef struct point
+{
+  uint64_t time;
+  int acquire; // 0: given up, those come first at the same time
+  size_t event;
+} point;
+
+typedef struct result
+{
+  double seconds;
+  double calls_per_s;
+  double ns_per_call;
+  long peak_rss; // KiB
+  double fragmentation;
+} result;
+
+static allocator allocators[] = {
+  { "snp", snp::Memory::malloc, snp::Memory::free, snp::Memory::realloc, snp::Memory::calloc, snp::Memory::memalign },
+  { "glibc", ::malloc, ::free, ::realloc, ::calloc, ::memalign },
+};
+
+// The trace, prepared before the children are forked
+static std::vector<call> calls;
+static std::vector<size_t> thread_calls[MAX_THREADS]; // indices into calls, in order
+static int thread_count;
+static long object_count;
+static long live_bytes; // allocated in the trace and not freed at its end
+
+// State of the replay in the child process
+static allocator *alloc;
+static void **objects;
+static char *allocated; // set once the chunk of the object exists
+static pthread_barrier_t barrier;
+static long rss_before;
+static long rss_after;
+static double starts[MAX_THREADS];
+static double ends[MAX_THREADS];
+static uint64_t call_ns[MAX_THREADS];
+
+static bool load(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr)
+  {
+    perror(path);
+    return false;
+  }
+
+  snp::Memory::TraceHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "SNPTRACE", 8) != 0 ||
+      header.version != snp::Memory::TRACE_VERSION || header.event_size != sizeof(TraceEvent))
+  {
+    fprintf(stderr, "%s is not a trace of this version\n", path);
+    fclose(file);
+    return false;
+  }
+
+  std::vector<TraceEvent> events;
+  TraceEvent event;
+  while (fread(&event, sizeof(event), 1, file) == 1)
+    events.push_back(event);
+  fclose(file);
+
+  // Which allocation each free belongs to: a chunk is given up at the start of a call
+  // and handed out at its end, so its address is free in between
+  std::vector<point> points;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    const TraceEvent &e = events[i];
+    if (e.type == snp::Memory::TRACE_FREE || (e.type == snp::Memory::TRACE_REALLOC && e.arg != 0))
+      points.push_back({ e.time, 0, i });
+    if (e.type != snp::Memory::TRACE_FREE && e.ptr != 0)
+      points.push_back({ e.time + e.duration, 1, i });
+  }
+  std::sort(points.begin(), points.end(), [](const point &a, const point &b) {
+    return a.time != b.time ? a.time < b.time : a.acquire != b.acquire ? a.acquire < b.acquire : a.event < b.event;
+  });
+
+  calls.resize(events.size());
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    calls[i].type = events[i].type;
+    calls[i].size = events[i].size;
+    calls[i].alignment = events[i].type == snp::Memory::TRACE_MEMALIGN ? events[i].arg : 0;
+    calls[i].object = -1;
+    calls[i].old_object = -1;
+  }
+
+  std::unordered_map<uint64_t, long> live;
+  std::vector<size_t> sizes;
+  for (const point &p : points)
+  {
+    const TraceEvent &e = events[p.event];
+    call &c = calls[p.event];
+
+    if (p.acquire)
+    {
+      c.object = object_count++;
+      sizes.push_back(e.size);
+      live[e.ptr] = c.object;
+      live_bytes += e.size;
+      continue;
+    }
+
+    auto found = live.find(e.type == snp::Memory::TRACE_FREE ? e.ptr : e.arg);
+    if (found == live.end())
+      continue;
+
+    c.old_object = found->second;
+    live_bytes -= sizes[found->second];
+    live.erase(found);
+  }
+
+  // The calls of each thread in the order they started
+  std::unordered_map<unsigned int, int> threads;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    auto found = threads.find(events[i].thread);
+    int thread = found != threads.end() ? found->second : (int) threads.size() % MAX_THREADS;
+    if (found == threads.end())
+      threads[events[i].thread] = thread;
+    thread_calls[thread].push_back(i);
+  }
+  thread_count = threads.size() < MAX_THREADS ? threads.size() : MAX_THREADS;
+
+  for (int i = 0; i < thread_count; i++)
+    std::stable_sort(thread_calls[i].begin(), thread_calls[i].end(),
+                     [&events](size_t a, size_t b) { return events[a].time < events[b].time; });
+
+  printf("%zu calls of %zu threads, %.1f MiB allocated in the trace and not freed\n\n",
+         events.size(), threads.size(), live_bytes / 1048576.0);
+
+  return true;
+}
+
+static void *replay_thread(void *arg)
+{
+  int id = (int) (size_t) arg;
+  size_t pagesize = getpagesize();
+  uint64_t ns = 0;
+
+  // All threads exist, their stacks are not counted as allocated memory
+  if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    rss_before = resident_bytes();
+  pthread_barrier_wait(&barrier);
+
+  starts[id] = now_s();
+
+  for (size_t index : thread_calls[id])
+  {
+    const call &c = calls[index];
+
+    void *old = nullptr;
+    if (c.old_object >= 0)
+    {
+      while (!__atomic_load_n(&allocated[c.old_object], __ATOMIC_ACQUIRE))
+        sched_yield();
+      old = objects[c.old_object];
+    }
+
+    // Chunks from before the trace are not freed
+    if (c.type == snp::Memory::TRACE_FREE && c.old_object < 0)
+      continue;
+
+    void *ptr = nullptr;
+    uint64_t start = now_ns();
+    switch (c.type)
+    {
+      case snp::Memory::TRACE_MALLOC:
+        ptr = alloc->malloc(c.size);
+        break;
+      case snp::Memory::TRACE_FREE:
+        alloc->free(old);
+        break;
+      case snp::Memory::TRACE_REALLOC:
+        ptr = alloc->realloc(old, c.size);
+        break;
+      case snp::Memory::TRACE_CALLOC:
+        ptr = alloc->calloc(1, c.size);
+        break;
+      case snp::Memory::TRACE_MEMALIGN:
+        ptr = alloc->memalign(c.alignment, c.size);
+        break;
+    }
+    ns += now_ns() - start;
+
+    if (c.object < 0)
+      continue;
+
+    // The program used the memory it got
+    if (ptr != nullptr)
+      for (size_t offset = 0; offset < c.size; offset += pagesize)
+        ((volatile char*) ptr)[offset] = 1;
+
+    objects[c.object] = ptr;
+    __atomic_store_n(&allocated[c.object], 1, __ATOMIC_RELEASE);
+  }
+
+  ends[id] = now_s();
+  call_ns[id] = ns;
+
+  // Measure while everything is still allocated
+  if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    rss_after = resident_bytes();
+  pthread_barrier_wait(&barrier);
+
+  return nullptr;
+}
+
+static result run(allocator *allocator)
+{
+  pthread_t threads[MAX_THREADS];
+  result r = {};
+
+  alloc = allocator;
+  objects = (void**) ::calloc(object_count + 1, sizeof(void*));
+  allocated = (char*) ::calloc(object_count + 1, 1);
+
+  pthread_barrier_init(&barrier, nullptr, thread_count);
+
+  for (int i = 0; i < thread_count; i++)
+    pthread_create(&threads[i], nullptr, replay_thread, (void*) (size_t) i);
+  for (int i = 0; i < thread_count; i++)
+    pthread_join(threads[i], nullptr);
+
+  double start = starts[0], end = ends[0];
+  uint64_t ns = 0;
+  for (int i = 0; i < thread_count; i++)
+  {
+    start = starts[i] < start ? starts[i] : start;
+    end = ends[i] > end ? ends[i] : end;
+    ns += call_ns[i];
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  r.seconds = end - start;
+  r.calls_per_s = calls.size() / (end - start);
+  r.ns_per_call = (double) ns / calls.size();
+  r.peak_rss = usage.ru_maxrss;
+  r.fragmentation = live_bytes > 0 ? (double) (rss_after - rss_before) / live_bytes : 0;
+
+  return r;
+}
+
+static void run_in_child(allocator *allocator)
+{
+  // A process of its own, so the peak RSS and the heap belong to this run only
+  int fds[2];
+  if (pipe(fds) != 0)
+    exit(1);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(fds[0]);
+    result r = run(allocator);
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+
+  result r;
+  bool ok = read(fds[0], &r, sizeof(r)) == sizeof(r);
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    printf("%-6s   failed\n", allocator->name);
+    return;
+  }
+
+  printf("%-6s %10.3f %12.0f %10.1f %10.1f %10.2f\n", allocator->name, r.seconds, r.calls_per_s,
+         r.ns_per_call, r.peak_rss / 1024.0, r.fragmentation);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s trace\n", argv[0]);
+    return 1;
+  }
+
+  if (!load(argv[1]))
+    return 1;
+
+  if (calls.empty())
+  {
+    fprintf(stderr, "%s has no calls\n", argv[1]);
+    return 1;
+  }
+
+  printf("%-6s %10s %12s %10s %10s %10s\n", "malloc", "seconds", "calls/s", "ns/call", "peak MiB", "RSS/live");
+
+  for (allocator &allocator : allocators)
+    run_in_child(&allocator);
+
+  return 0;
+}
@@ -0,0 +1,183 @@
+#ifndef SNP_CHUNK_H_
+#define SNP_CHUNK_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace snp {
+  // The chunks of a heap lie back to back. The header is a single word: the size of
+  // the whole chunk, a multiple of the alignment, with flags in the low bits. An available
+  // chunk also stores its size in its last word, so the chunk behind it finds its start.
+  // A header of size 0 behind the last chunk marks the end of the heap.
+  typedef struct heap_chunk
+  {
+      size_t size;
+      char data[0]; // array of variable size
+  } heap_chunk;
+
+  // Links of an available chunk in a list, stored in its unused data in front of the size at its end
+  typedef struct free_links
+  {
+      heap_chunk *prev;
+      heap_chunk *next;
+  } free_links;
+
+  // The boundary tags of the chunks, shared by the arenas of Memory and by Heap.
+  // Where the available chunks are kept is up to the heap: split and merge call
+  // insert and remove of its index for every chunk that becomes available or stops
+  // being so. Chunks too small for the links of an index are left out of it and are
+  // only reused once they are merged with a neighbor. On corruption the program exits.
+  struct Chunk
+  {
+      // The data of every chunk starts at a multiple of two words, as with glibc
+      static const size_t ALIGNMENT = 2 * sizeof(size_t);
+      static const size_t HEADER_SIZE = sizeof(heap_chunk);
+
+      // Flags in the low bits of heap_chunk::size, the third one is left to the heap
+      static const size_t AVAILABLE = 1;
+      static const size_t PREV_AVAILABLE = 2; // the previous chunk is available, its size is in the word in front of this chunk
+      static const size_t FLAGS = 7;
+
+      static size_t chunkSize(const heap_chunk *chunk) { return chunk->size & ~FLAGS; }
+      static size_t dataSize(const heap_chunk *chunk) { return chunkSize(chunk) - HEADER_SIZE; }
+      static heap_chunk *nextChunk(heap_chunk *chunk) { return (heap_chunk*) ((char*) chunk + chunkSize(chunk)); }
+      // Only valid if the previous chunk is available
+      static size_t &prevSize(heap_chunk *chunk) { return ((size_t*) chunk)[-1]; }
+      static heap_chunk *prevChunk(heap_chunk *chunk) { return (heap_chunk*) ((char*) chunk - prevSize(chunk)); }
+
+      // Data size of a chunk for a request: the chunk behind it has to have aligned data as well
+      static size_t dataSizeFor(size_t size)
+      {
+        return ((size + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) - HEADER_SIZE;
+      }
+
+      static void markAvailable(heap_chunk *chunk)
+      {
+        // The size at the end lets the next chunk find this one when they are merged
+        chunk->size |= AVAILABLE;
+        prevSize(nextChunk(chunk)) = chunkSize(chunk);
+        nextChunk(chunk)->size |= PREV_AVAILABLE;
+      }
+
+      static void markUsed(heap_chunk *chunk)
+      {
+        chunk->size &= ~AVAILABLE;
+        nextChunk(chunk)->size &= ~PREV_AVAILABLE;
+      }
+
+      // Cuts a chunk in use down to the data size for size. The rest becomes available.
+      template<class Index>
+      static void splitChunk(Index &index, heap_chunk *chunk, size_t size)
+      {
+        // The new chunk has to start where its data is aligned
+        size = dataSizeFor(size);
+
+        // Building a new chunk only makes sense if there is still space
+        // left for some data to store, so > than just HEADER_SIZE
+        if (dataSize(chunk) < size || dataSize(chunk) - size <= HEADER_SIZE)
+          return;
+
+        // The chunk is in use, so the new one behind it does not get PREV_AVAILABLE
+        auto *rest = (heap_chunk*) (chunk->data + size);
+        rest->size = dataSize(chunk) - size;
+        chunk->size = (HEADER_SIZE + size) | (chunk->size & FLAGS);
+
+        markAvailable(rest);
+        index.insert(rest);
+      }
+
+      template<class Index>
+      static void mergeNext(Index &index, heap_chunk *chunk)
+      {
+        heap_chunk *next = nextChunk(chunk);
+
+        // The end marker is never available
+        if (next->size & AVAILABLE)
+        {
+          index.remove(next);
+
+          // FIXME: chunk->size will overflow if the resulting sum is > (size_t)-1
+          chunk->size += chunkSize(next);
+        }
+      }
+
+      // Merges a chunk that is in no index with its available neighbors, which
+      // leave the index before they get resized. Returns the merged chunk.
+      template<class Index>
+      static heap_chunk *mergeChunk(Index &index, heap_chunk *chunk)
+      {
+        mergeNext(index, chunk);
+
+        // The size in front of the chunk tells where the previous one starts
+        if (chunk->size & PREV_AVAILABLE)
+        {
+          heap_chunk *prev = prevChunk(chunk);
+          index.remove(prev);
+
+          prev->size += chunkSize(chunk);
+          chunk = prev;
+        }
+
+        return chunk;
+      }
+
+      // Same checks as checkHeap, but only for the chunk and its direct neighbors
+      static void checkChunk(heap_chunk *start, heap_chunk *end, heap_chunk *chunk)
+      {
+        // The chunk has to end within the heap
+        if (chunk < start || chunkSize(chunk) < ALIGNMENT || chunkSize(chunk) > (size_t) ((char*) end - (char*) chunk))
+          exit(-1);
+
+        // Heap overflow: an overflow of this chunk ends up in the header of the next one
+        heap_chunk *next = nextChunk(chunk);
+        if (next != end && (chunkSize(next) < ALIGNMENT || chunkSize(next) > (size_t) ((char*) end - (char*) next)))
+          exit(-1);
+
+        // The next chunk has to know whether this one is available
+        if (!(chunk->size & AVAILABLE) != !(next->size & PREV_AVAILABLE))
+          exit(-1);
+
+        if (chunk->size & PREV_AVAILABLE)
+        {
+          // The size in front has to lead to an available chunk that ends exactly where this one starts
+          if (prevSize(chunk) < ALIGNMENT || prevSize(chunk) > (size_t) ((char*) chunk - (char*) start))
+            exit(-1);
+
+          heap_chunk *prev = prevChunk(chunk);
+          if (chunkSize(prev) != prevSize(chunk) || !(prev->size & AVAILABLE))
+            exit(-1);
+        }
+      }
+
+      // Walks over the chunks from start to the end marker, both nullptr for an empty heap
+      static void checkHeap(heap_chunk *start, heap_chunk *end)
+      {
+        heap_chunk *chunk = start;
+        bool prev_available = false;
+
+        while (chunk != end)
+        {
+          // Ensure that the chunk ends within the heap, so the walk ends exactly at the end marker
+          if (chunkSize(chunk) < ALIGNMENT || chunkSize(chunk) > (size_t) ((char*) end - (char*) chunk))
+            exit(-1);
+
+          // An available chunk has its size at the end as well
+          bool available = (chunk->size & AVAILABLE) != 0;
+          if (available && prevSize(nextChunk(chunk)) != chunkSize(chunk))
+            exit(-1);
+
+          // The flag has to match the previous chunk, and two available chunks in a row are always merged
+          if (prev_available != ((chunk->size & PREV_AVAILABLE) != 0) || (available && prev_available))
+            exit(-1);
+
+          prev_available = available;
+          chunk = nextChunk(chunk);
+        }
+
+        if (chunk != nullptr && (chunkSize(chunk) != 0 || prev_available != ((chunk->size & PREV_AVAILABLE) != 0)))
+          exit(-1);
+      }
+  };
+}
+
+#endif /* SNP_CHUNK_H_ */
@@ -0,0 +1,531 @@
+#ifndef SNP_HEAP_H_
+#define SNP_HEAP_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "chunk.h"
+
+namespace snp {
+  // Policies of Heap, picked at compile time. Each one is a small class whose
+  // functions are inlined, so a check or a lock that is not wanted costs nothing.
+
+  // Fit strategy: which available chunk serves a request. accept is called with the data
+  // size of each chunk that fits and is smaller than the ones before it, true ends the search.
+  struct FirstFit
+  {
+      static bool accept(size_t, size_t) { return true; }
+  };
+
+  struct BestFit
+  {
+      static bool accept(size_t data_size, size_t size) { return data_size == size; }
+  };
+
+  // Growth granularity: the heap grows and shrinks in multiples of unit(), a power of two.
+  // Memory rounds its heap growth with the same policy.
+  struct ExactGrowth
+  {
+      static size_t unit() { return 1; }
+  };
+
+  // Whole pages, so most allocations and frees do not need a system call
+  struct PageGrowth
+  {
+      static size_t unit() { return getpagesize(); }
+  };
+
+  // Integrity checks, like the hardening levels of Memory. On corruption the program exits.
+  // No checks at all, not even of the pointers given to free
+  struct NoCheck
+  {
+      static const bool local = false;
+      static const bool full = false;
+  };
+
+  // The chunk given to free or realloc and its direct neighbors
+  struct LocalCheck
+  {
+      static const bool local = true;
+      static const bool full = false;
+  };
+
+  // Local checks plus a walk over the entire heap on every operation
+  struct FullCheck
+  {
+      static const bool local = true;
+      static const bool full = true;
+  };
+
+  // Locking: none for heaps of a single thread
+  struct NoLock
+  {
+      void lock() {}
+      void unlock() {}
+  };
+
+  class MutexLock
+  {
+    public:
+      MutexLock() { pthread_mutex_init(&mutex, nullptr); }
+      ~MutexLock() { pthread_mutex_destroy(&mutex); }
+
+      void lock() { pthread_mutex_lock(&mutex); }
+      void unlock() { pthread_mutex_unlock(&mutex); }
+
+    private:
+      pthread_mutex_t mutex;
+  };
+
+  // Busy waiting, for short operations with few threads
+  class SpinLock
+  {
+    public:
+      void lock()
+      {
+        // Only try again when it looks free, so the owner keeps the cache line
+        while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE))
+          for (int spins = 0; __atomic_load_n(&locked, __ATOMIC_RELAXED); spins++)
+            if (spins >= 100)
+              sched_yield();
+      }
+
+      void unlock() { __atomic_store_n(&locked, 0, __ATOMIC_RELEASE); }
+
+    private:
+      int locked = 0;
+  };
+
+  // Backing source: grow returns the start of size more bytes right behind the ones
+  // taken before, nullptr if there are none. shrink gives back the last size bytes.
+
+  // The program break, as long as no one else moves it
+  class SbrkSource
+  {
+    public:
+      void *grow(size_t size)
+      {
+        if (size > (size_t) INTPTR_MAX || (top != nullptr && sbrk(0) != top))
+          return nullptr;
+
+        char *start = (char*) sbrk((intptr_t) size);
+        if (start == (char*) -1)
+          return nullptr;
+
+        top = start + size;
+        return start;
+      }
+
+      bool shrink(size_t size)
+      {
+        if (sbrk(0) != top || sbrk(-(intptr_t) size) == (void*) -1)
+          return false;
+
+        top -= size;
+        return true;
+      }
+
+    private:
+      char *top = nullptr;
+  };
+
+  // Address space reserved with mmap on first use. Pages are only backed once they are
+  // touched and are given back with madvise.
+  class MmapSource
+  {
+    public:
+      explicit MmapSource(size_t reserve = (size_t) 64 << 20) : reserve(reserve) {}
+      ~MmapSource()
+      {
+        if (start != nullptr)
+          munmap(start, reserve);
+      }
+
+      MmapSource(const MmapSource&) = delete;
+      MmapSource &operator=(const MmapSource&) = delete;
+
+      void *grow(size_t size)
+      {
+        if (start == nullptr)
+        {
+          void *region = mmap(nullptr, reserve, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+          if (region == MAP_FAILED)
+            return nullptr;
+
+          start = (char*) region;
+          top = start;
+        }
+
+        if (size > (size_t) (start + reserve - top))
+          return nullptr;
+
+        char *previous = top;
+        top += size;
+        return previous;
+      }
+
+      bool shrink(size_t size)
+      {
+        uintptr_t pagesize = getpagesize();
+        char *unused = (char*) (((uintptr_t) (top - size) + pagesize - 1) & ~(pagesize - 1));
+        if (unused < top)
+          madvise(unused, top - unused, MADV_DONTNEED);
+
+        top -= size;
+        return true;
+      }
+
+    private:
+      size_t reserve;
+      char *start = nullptr;
+      char *top = nullptr;
+  };
+
+  // A fixed buffer of the caller, e.g. for a tool that must not ask the OS for memory
+  class BufferSource
+  {
+    public:
+      BufferSource(void *buffer, size_t size) : top((char*) buffer), end((char*) buffer + size) {}
+
+      void *grow(size_t size)
+      {
+        if (size > (size_t) (end - top))
+          return nullptr;
+
+        char *previous = top;
+        top += size;
+        return previous;
+      }
+
+      bool shrink(size_t size)
+      {
+        top -= size;
+        return true;
+      }
+
+    private:
+      char *top;
+      char *end;
+  };
+
+  // A single heap of boundary-tagged chunks like an arena of Memory, without the thread
+  // caches, bins, slabs and mappings around it. The chunks are those of chunk.h, split,
+  // merged and checked by the same code as the arenas. The available chunks are kept in one list.
+  // The constructor arguments are passed on to the source, e.g. the buffer of a BufferSource.
+  template<class Fit = FirstFit, class Growth = PageGrowth, class Check = LocalCheck,
+           class Lock = MutexLock, class Source = MmapSource>
+  class Heap
+  {
+    public:
+      template<typename... Args>
+      explicit Heap(Args... args) : source(args...) {}
+
+      Heap(const Heap&) = delete;
+      Heap &operator=(const Heap&) = delete;
+
+      void *malloc(size_t size)
+      {
+        // Prevent that the chunk size overflows
+        if (size > (size_t) -1 / 2)
+          return nullptr;
+
+        size = Chunk::dataSizeFor(size);
+
+        heap_lock.lock();
+        if (Check::full)
+          checkHeap();
+
+        heap_chunk *chunk = findChunk(size);
+        if (chunk == nullptr)
+          chunk = growHeap(size);
+
+        if (chunk != nullptr)
+        {
+          Chunk::markUsed(chunk);
+          Chunk::splitChunk(available, chunk, size);
+        }
+
+        heap_lock.unlock();
+        return chunk != nullptr ? chunk->data : nullptr;
+      }
+
+      void free(void *ptr)
+      {
+        if (ptr == nullptr)
+          return;
+
+        heap_lock.lock();
+        if (Check::full)
+          checkHeap();
+
+        releaseChunk(getChunk(ptr));
+        heap_lock.unlock();
+      }
+
+      void *realloc(void *ptr, size_t size)
+      {
+        if (ptr == nullptr)
+          return malloc(size);
+        if (size > (size_t) -1 / 2)
+          return nullptr;
+
+        size_t data_size = Chunk::dataSizeFor(size);
+
+        heap_lock.lock();
+        if (Check::full)
+          checkHeap();
+
+        heap_chunk *chunk = getChunk(ptr);
+        size_t old_size = Chunk::dataSize(chunk);
+
+        // Take over the next chunk if it is available and the chunk shrinks or grows into it.
+        // When shrinking, the rest is merged with it that way.
+        heap_chunk *next = Chunk::nextChunk(chunk);
+        if ((next->size & Chunk::AVAILABLE) && data_size <= old_size + Chunk::chunkSize(next))
+        {
+          Chunk::mergeNext(available, chunk);
+          Chunk::markUsed(chunk);
+        }
+
+        bool fits = Chunk::dataSize(chunk) >= data_size;
+        if (fits)
+          Chunk::splitChunk(available, chunk, data_size);
+
+        heap_lock.unlock();
+
+        if (fits)
+          return ptr;
+
+        void *data = malloc(size);
+        if (data != nullptr)
+        {
+          memcpy(data, ptr, old_size);
+          free(ptr);
+        }
+        return data;
+      }
+
+      // Number of bytes that can be used at ptr, at least the requested size
+      size_t usableSize(void *ptr)
+      {
+        heap_lock.lock();
+        size_t size = Chunk::dataSize(getChunk(ptr));
+        heap_lock.unlock();
+        return size;
+      }
+
+      // Bytes taken from the source
+      size_t footprint()
+      {
+        heap_lock.lock();
+        size_t size = heap_top - heap_base;
+        heap_lock.unlock();
+        return size;
+      }
+
+      // Walks over the entire heap, whatever the Check policy, and exits on corruption
+      void checkIntegrity()
+      {
+        heap_lock.lock();
+        checkHeap();
+        heap_lock.unlock();
+      }
+
+    private:
+      // The index of the available chunks for the functions of Chunk: a list of those
+      // that can hold the links in front of the size at their end
+      typedef struct free_list
+      {
+          static const size_t LINKED_SIZE = sizeof(free_links) + sizeof(size_t);
+
+          heap_chunk *head;
+
+          static free_links *links(heap_chunk *chunk) { return (free_links*) chunk->data; }
+
+          void insert(heap_chunk *chunk)
+          {
+            if (Chunk::dataSize(chunk) < LINKED_SIZE)
+              return;
+
+            links(chunk)->prev = nullptr;
+            links(chunk)->next = head;
+            if (head != nullptr)
+              links(head)->prev = chunk;
+            head = chunk;
+          }
+
+          void remove(heap_chunk *chunk)
+          {
+            // Has never been inserted
+            if (Chunk::dataSize(chunk) < LINKED_SIZE)
+              return;
+
+            free_links *chunk_links = links(chunk);
+            if (chunk_links->prev != nullptr)
+              links(chunk_links->prev)->next = chunk_links->next;
+            else
+              head = chunk_links->next;
+            if (chunk_links->next != nullptr)
+              links(chunk_links->next)->prev = chunk_links->prev;
+          }
+      } free_list;
+
+      static const size_t HEADER_SIZE = Chunk::HEADER_SIZE;
+      static const size_t ALIGNMENT = Chunk::ALIGNMENT;
+
+      Source source;
+      Lock heap_lock;
+
+      char *heap_base = nullptr; // start of the memory taken from the source
+      char *heap_top = nullptr;
+      heap_chunk *heap_start = nullptr;
+      heap_chunk *heap_end = nullptr; // end marker behind the last chunk: a header of size 0
+      free_list available = {};
+
+      static size_t growthSize(size_t size)
+      {
+        size_t unit = Growth::unit();
+        return (size + unit - 1) & ~(unit - 1);
+      }
+
+      heap_chunk *findChunk(size_t size)
+      {
+        heap_chunk *found = nullptr;
+        for (heap_chunk *chunk = available.head; chunk != nullptr; chunk = free_list::links(chunk)->next)
+        {
+          size_t data_size = Chunk::dataSize(chunk);
+          if (data_size < size || (found != nullptr && data_size >= Chunk::dataSize(found)))
+            continue;
+
+          found = chunk;
+          if (Fit::accept(data_size, size))
+            break;
+        }
+
+        if (found == nullptr)
+          return nullptr;
+
+        if (Check::local)
+          Chunk::checkChunk(heap_start, heap_end, found);
+
+        available.remove(found);
+        return found;
+      }
+
+      heap_chunk *growHeap(size_t size)
+      {
+        heap_chunk *chunk;
+
+        // The chunk and the end marker behind it
+        size_t needed = HEADER_SIZE + size + HEADER_SIZE;
+
+        if (heap_end == nullptr)
+        {
+          // The first chunk starts at the first offset with aligned data
+          size_t increment = growthSize(needed + ALIGNMENT - 1);
+          char *memory = (char*) source.grow(increment);
+          if (memory == nullptr)
+            return nullptr;
+
+          heap_base = memory;
+          heap_top = memory + increment;
+          heap_start = (heap_chunk*) ((((uintptr_t) memory + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) - HEADER_SIZE);
+          chunk = heap_start;
+        }
+        else
+        {
+          // The chunk takes the place of the end marker, or of the available chunk in front of it,
+          // which is too small on its own or too small for the list
+          chunk = heap_end->size & Chunk::PREV_AVAILABLE ? Chunk::prevChunk(heap_end) : heap_end;
+
+          size_t present = heap_top - (char*) chunk;
+          if (needed > present)
+          {
+            size_t increment = growthSize(needed - present);
+            if (source.grow(increment) == nullptr)
+              return nullptr;
+
+            heap_top += increment;
+          }
+
+          if (chunk != heap_end)
+            available.remove(chunk);
+        }
+
+        // Bytes behind the end marker that are too few for another chunk stay there
+        chunk->size = (heap_top - HEADER_SIZE - (char*) chunk) & ~(ALIGNMENT - 1);
+        heap_end = Chunk::nextChunk(chunk);
+        heap_end->size = 0;
+        return chunk;
+      }
+
+      void releaseChunk(heap_chunk *chunk)
+      {
+        chunk = Chunk::mergeChunk(available, chunk);
+
+        // Give back the end of the heap in whole growth units. The end marker stays
+        // behind the chunk, which keeps the bytes that are fewer than a unit.
+        if (Chunk::nextChunk(chunk) == heap_end)
+        {
+          size_t amount = (heap_top - chunk->data) & ~(Growth::unit() - 1);
+
+          if (amount != 0 && source.shrink(amount))
+          {
+            // The previous chunk is in use, otherwise both would have been merged
+            heap_top -= amount;
+            chunk->size = (heap_top - HEADER_SIZE - (char*) chunk) & ~(ALIGNMENT - 1);
+            if (chunk->size == 0)
+            {
+              heap_end = chunk;
+              return;
+            }
+
+            heap_end = Chunk::nextChunk(chunk);
+            heap_end->size = 0;
+          }
+        }
+
+        Chunk::markAvailable(chunk);
+        available.insert(chunk);
+      }
+
+      heap_chunk *getChunk(void *ptr)
+      {
+        auto *chunk = (heap_chunk*) ((char*) ptr - HEADER_SIZE);
+        if (!Check::local)
+          return chunk;
+
+        // The pointer has to be the data of a chunk in use on this heap, not ptr + 5 or one freed before
+        if ((uintptr_t) ptr % ALIGNMENT != 0 || heap_start == nullptr || chunk < heap_start ||
+            chunk >= heap_end || (chunk->size & Chunk::AVAILABLE))
+          exit(-1);
+
+        Chunk::checkChunk(heap_start, heap_end, chunk);
+        return chunk;
+      }
+
+      void checkHeap()
+      {
+        Chunk::checkHeap(heap_start, heap_end);
+
+        if (heap_end != nullptr && heap_top - (char*) heap_end < (intptr_t) HEADER_SIZE)
+          exit(-1);
+
+        // Every chunk in the list is available and has room for the links
+        heap_chunk *prev = nullptr;
+        for (heap_chunk *chunk = available.head; chunk != nullptr; prev = chunk, chunk = free_list::links(chunk)->next)
+        {
+          if (chunk < heap_start || chunk >= heap_end || !(chunk->size & Chunk::AVAILABLE) ||
+              Chunk::dataSize(chunk) < free_list::LINKED_SIZE || free_list::links(chunk)->prev != prev)
+            exit(-1);
+        }
+      }
+  };
+}
+
+#endif /* SNP_HEAP_H_ */
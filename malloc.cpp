@@ -1,349 +1,2896 @@
+#include <cerrno>
+#include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sched.h>
+#include <sys/mman.h>
+#include "heap.h"
 #include "memory.h"
 
 #define HEAP_CHUNK_SIZE sizeof(heap_chunk)
-#define MEMCHECK_NUMBER 1073197
+#define FREE_LINKS(chunk) ((free_links*) (chunk)->data)
+#define FREE_NODE(chunk) ((free_node*) (chunk)->data)
+// Smallest data size of an available chunk that is binned or in the tree, the size at its end included
+#define INDEXED_SIZE(arena) ((arena)->fit == FIT_ADDRESS ? sizeof(free_node) + sizeof(size_t) : sizeof(free_links) + sizeof(size_t))
+
+// Flags in the low bits of heap_chunk::size, see chunk.h
+#define CHUNK_AVAILABLE snp::Chunk::AVAILABLE
+#define CHUNK_PREV_AVAILABLE snp::Chunk::PREV_AVAILABLE
+#define CHUNK_RELEASED 4 // the chunk is available and the whole pages inside it were given back
+#define CHUNK_FLAGS snp::Chunk::FLAGS
+
+#define CHUNK_SIZE(chunk) snp::Chunk::chunkSize(chunk)
+#define DATA_SIZE(chunk) snp::Chunk::dataSize(chunk)
+#define NEXT_CHUNK(chunk) snp::Chunk::nextChunk(chunk)
+// Only valid if the previous chunk is available
+#define PREV_SIZE(chunk) snp::Chunk::prevSize(chunk)
+#define PREV_CHUNK(chunk) snp::Chunk::prevChunk(chunk)
+// When an available chunk with whole pages inside became available, in ms
+#define FREE_TIME(chunk) (*(uint64_t*) ((chunk)->data + sizeof(free_node)))
+
+// The heap grows and shrinks in whole pages, see the Growth policies in heap.h
+typedef snp::PageGrowth HeapGrowth;
+
+// The data of every chunk starts at a multiple of two words, as with glibc
+#define MALLOC_ALIGNMENT snp::Chunk::ALIGNMENT
+// Data size of a chunk for a request: the chunk behind it has to have aligned data as well
+#define CHUNK_DATA_SIZE(size) snp::Chunk::dataSizeFor(size)
+
+// Offset of the data in a mapping, behind the header
+#define MMAP_DATA_OFFSET ((HEAP_CHUNK_SIZE + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1))
+#define MMAP_START(chunk) ((chunk)->data - MMAP_DATA_OFFSET)
+
+// Default size from which on requests are served by mmap instead of sbrk
+#define MMAP_THRESHOLD_DEFAULT (128 * 1024)
+
+// Default size of the first span arena 0 takes with sbrk, the next ones double up to GROW_SPAN_MAX
+#define GROW_SPAN_DEFAULT (64 * 1024)
+#define GROW_SPAN_MAX (8 * 1024 * 1024)
+
+// Default number of unused bytes at the end of an arena that are kept for the next growth
+#define TRIM_THRESHOLD_DEFAULT (128 * 1024)
+
+// Default time free pages are kept before they are given back, in ms
+#define RELEASE_DECAY_DEFAULT 1000
+// Operations between two reads of the clock for the release of free pages
+#define RELEASE_CHECK_INTERVAL 64
+
+// Default hardening level, see snp::Memory::Hardening.
+// Can be changed at run time with setOption(HARDENING_LEVEL, ...)
+#ifndef HARDENING
+#define HARDENING HARDENING_FULL
+#endif
+// Default number of operations between two full heap walks in HARDENING_SAMPLED
+#define HARDENING_SAMPLE_INTERVAL 1000
+
+// Hardened mode: freed chunks are filled with POISON_BYTE, a chunk in the quarantine holds
+// QUARANTINE_MARK in its first word. The mark depends on the address, so data that was copied
+// from a quarantined chunk does not look like one.
+#define POISON_BYTE 0xdb
+#define POISON_WORD ((uintptr_t) 0xdbdbdbdbdbdbdbdbULL)
+#define QUARANTINE_MARK(ptr) ((uintptr_t) (ptr) ^ (uintptr_t) 0x5bd1e995a3c2f1b7ULL)
+
+// Address space reserved for each arena except arena 0, which uses sbrk
+#define ARENA_REGION_SIZE (sizeof(void*) == 8 ? (size_t) 1 << 30 : (size_t) 64 << 20)
+
+// Queued remote frees after which the freeing thread tries to drain the queue itself
+#define REMOTE_FREE_LIMIT 256
+
+#define CACHE_MAX_DATA_SIZE ((CACHE_CLASS_COUNT - 1) * CACHE_CLASS_SIZE)
+
+// Allocations and frees a thread counts before it adds them to the totals
+#define STATS_FLUSH_INTERVAL 64
+
+// Treap priority of an available chunk, hashed from its address. The chunks lie back to
+// back, so the bits are mixed well enough that the tree stays balanced.
+static inline uint32_t treePriority(void *chunk)
+{
+  uint32_t hash = (uint32_t) ((uintptr_t) chunk / MALLOC_ALIGNMENT);
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+snp::Memory::heap_arena snp::Memory::arenas[MAX_ARENAS] = {};
+int snp::Memory::arena_count = 0;
+int snp::Memory::arena_by_cpu = 0;
+int snp::Memory::remote_free = 1;
+unsigned int snp::Memory::arena_next = 0;
+pthread_mutex_t snp::Memory::arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread snp::Memory::heap_arena* snp::Memory::thread_arena = nullptr;
+
+size_t snp::Memory::thread_cache_size = 64 * 1024;
+__thread snp::Memory::thread_cache snp::Memory::cache = {};
+pthread_mutex_t snp::Memory::mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t snp::Memory::mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+size_t snp::Memory::mmap_size = 0;
+size_t snp::Memory::mmap_count = 0;
+size_t snp::Memory::release_decay = RELEASE_DECAY_DEFAULT;
+size_t snp::Memory::grow_span = GROW_SPAN_DEFAULT;
+size_t snp::Memory::trim_threshold = TRIM_THRESHOLD_DEFAULT;
+
+__thread snp::Memory::thread_counts snp::Memory::counts = {};
+size_t snp::Memory::class_allocs[STATS_CLASS_COUNT] = {};
+size_t snp::Memory::class_frees[STATS_CLASS_COUNT] = {};
+
+int snp::Memory::hardening = HARDENING;
+int snp::Memory::fit_policy = FIT_BINS;
+size_t snp::Memory::hardening_interval = HARDENING_SAMPLE_INTERVAL;
+
+// Registered before main, so fork is safe as soon as there can be threads
+int snp::Memory::fork_handlers = pthread_atfork(forkPrepare, forkParent, forkChild);
+
+pthread_key_t snp::Memory::cache_key;
+pthread_once_t snp::Memory::cache_key_once = PTHREAD_ONCE_INIT;
+snp::Memory::thread_cache* snp::Memory::cache_threads = nullptr;
+pthread_mutex_t snp::Memory::cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t snp::Memory::guard_rate = 0;
+__thread size_t snp::Memory::guard_countdown = 0;
+snp::Memory::guard_mapping snp::Memory::guard_freed[GUARD_FREED_COUNT] = {};
+int snp::Memory::guard_freed_next = 0;
+size_t snp::Memory::quarantine_size = 0;
+int snp::Memory::poison_freed = 0;
+snp::Memory::quarantine_entry snp::Memory::quarantine[QUARANTINE_COUNT] = {};
+size_t snp::Memory::quarantine_start = 0;
+size_t snp::Memory::quarantine_count = 0;
+size_t snp::Memory::quarantine_bytes = 0;
+pthread_mutex_t snp::Memory::quarantine_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *snp::Memory::malloc(size_t size)
+{
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+    return traceAllocate(TRACE_MALLOC, size, 0);
+
+  void *ptr = allocate(size);
+  countAlloc(ptr);
+
+  return ptr;
+}
+
+void *snp::Memory::allocate(size_t size)
+{
+  void *ptr = nullptr;
+
+  // Hardened mode: every guard_rate-th allocation of this thread lies between guard pages
+  if (__builtin_expect(guard_rate != 0, 0) && guard_countdown-- == 0)
+  {
+    guard_countdown = guard_rate - 1;
+    if ((ptr = guardChunk(size)) != nullptr)
+      return ptr;
+  }
+
+  // Large chunks get their own mapping, so they can be given back immediately on free
+  if (mmap_threshold != 0 && size >= mmap_threshold)
+    return mapChunk(size);
+
+  // Fast path: reuse a chunk from the cache of this thread without locking
+  int index = cacheIndex(size);
+  if (index >= 0 && (ptr = cachePop(index)) != nullptr)
+    return ptr;
+
+  // Both refills below fill the cache under a lock. pthread_setspecific may allocate
+  // and get back here, so the thread is registered before any lock is taken.
+  cacheRegister();
+
+  // Tiny requests are served from slab runs without a chunk header
+  if (size <= slab_max_size && (ptr = slabAllocate(size, index)) != nullptr)
+    return ptr;
+
+  heap_arena *arena = lockArena();
+
+  checkOperation(arena);
+
+  remoteDrain(arena);
+
+  decayArena(arena);
+
+  if (index >= 0)
+    ptr = cacheRefill(arena, index);
+  else
+    ptr = allocateChunk(arena, size);
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  // The arena is out of space, the others may still have some
+  int count = __atomic_load_n(&arena_count, __ATOMIC_RELAXED);
+  for (int i = 0; ptr == nullptr && i < count; i++)
+  {
+    heap_arena *other = &arenas[i];
+    if (other == arena)
+      continue;
+
+    if (!__atomic_load_n(&other->initialized, __ATOMIC_ACQUIRE))
+      initArena(other);
+
+    arenaLock(other);
+    remoteDrain(other);
+    ptr = allocateChunk(other, size);
+    pthread_mutex_unlock(&other->mutex);
+  }
+
+  return ptr;
+}
+
+void snp::Memory::free(void *ptr)
+{
+  // If ptr is NULL, no operation should be performed (POSIX)
+  if (!ptr)
+    return;
+
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+  {
+    traceFree(ptr);
+    return;
+  }
+
+  if (isSlab(ptr))
+  {
+    size_t size = slabSize(ptr);
+
+    // Hardened mode: poisoned and held back before the slot can be used again
+    if (__builtin_expect(quarantine_size != 0 || poison_freed, 0) && quarantinePush(ptr, size))
+      return;
+
+    deallocateSlot(ptr, size);
+    return;
+  }
+
+  // Chunks outside of every arena can only come from mmap
+  auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+  heap_arena *arena = arenaOf(chunk);
+  if (arena == nullptr)
+  {
+    unmapChunk(chunk);
+    return;
+  }
+
+  chunk = getChunk(arena, ptr);
+  if (__builtin_expect(quarantine_size != 0 || poison_freed, 0) && quarantinePush(ptr, DATA_SIZE(chunk)))
+    return;
+
+  deallocateChunk(arena, chunk);
+}
+
+void snp::Memory::freeSized(void *ptr, size_t size)
+{
+  if (!ptr)
+    return;
+
+  // Traced as a free
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+  {
+    traceFree(ptr);
+    return;
+  }
+
+  if (isSlab(ptr))
+  {
+    // The slot size follows from the size as in slabAllocate, the run descriptor is not needed
+    size_t slot_size = size == 0 ? SLAB_CLASS_SIZE : (size + SLAB_CLASS_SIZE - 1) & ~(size_t) (SLAB_CLASS_SIZE - 1);
+    if (hardening != HARDENING_OFF && slabSize(ptr) != slot_size)
+      exit(-1);
+
+    if (__builtin_expect(quarantine_size != 0 || poison_freed, 0) && quarantinePush(ptr, slot_size))
+      return;
+
+    deallocateSlot(ptr, slot_size);
+    return;
+  }
+
+  auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+  heap_arena *arena = arenaOf(chunk);
+  if (arena == nullptr)
+  {
+    if (hardening != HARDENING_OFF && usableSize(ptr) < size)
+      exit(-1);
+
+    unmapChunk(chunk);
+    return;
+  }
+
+  // The pointer is checked on every level as with free, the header then serves both checks below
+  chunk = getChunk(arena, ptr);
+
+  // The chunk has to hold the size. It can be bigger: the rest may have been too small to split off.
+  if (hardening != HARDENING_OFF && DATA_SIZE(chunk) < size)
+    exit(-1);
+
+  // Hardened mode: the quarantine holds the usable size, not the size given
+  if (__builtin_expect(quarantine_size != 0 || poison_freed, 0) && quarantinePush(ptr, DATA_SIZE(chunk)))
+    return;
+
+  deallocateChunk(arena, chunk);
+}
+
+void snp::Memory::deallocateSlot(void *ptr, size_t size)
+{
+  countFree(ptr, size);
+
+  if (!cachePush(ptr, size))
+    slabFree(ptr);
+}
+
+void snp::Memory::deallocateChunk(heap_arena *arena, heap_chunk *chunk)
+{
+  // Fast path: keep the chunk in the cache of this thread without locking
+  countFree(chunk->data, DATA_SIZE(chunk));
+
+  if (cachePush(chunk->data, DATA_SIZE(chunk)))
+    return;
+
+  // Chunks of other arenas are queued for their arena without taking its lock
+  if (arena != thread_arena && remotePush(arena, chunk))
+    return;
+
+  // The chunk goes back to the arena that owns it, whichever thread frees it
+  arenaLock(arena);
+
+  //printStatistics("BEFORE free()");
+
+  checkOperation(arena);
+
+  remoteDrain(arena);
+
+  decayArena(arena);
+
+  releaseChunk(arena, chunk);
+
+  //printStatistics("AFTER free()");
+
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+size_t snp::Memory::mallocBatch(size_t size, size_t count, void **ptrs)
+{
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+    return traceMallocBatch(size, count, ptrs);
+
+  size_t done = 0;
+  void *ptr;
+
+  if (mmap_threshold != 0 && size >= mmap_threshold)
+  {
+    // Every large chunk gets its own mapping anyway
+    while (done < count && (ptr = mapChunk(size)) != nullptr)
+      ptrs[done++] = ptr;
+  }
+  else
+  {
+    // What the cache of this thread holds first, without locking
+    int index = cacheIndex(size);
+    while (index >= 0 && done < count && (ptr = cachePop(index)) != nullptr)
+      ptrs[done++] = ptr;
+
+    if (done < count && size <= slab_max_size)
+      done += slabAllocateBatch(size, count - done, ptrs + done);
+
+    if (done < count)
+    {
+      heap_arena *arena = lockArena();
+
+      checkOperation(arena);
+
+      remoteDrain(arena);
+
+      decayArena(arena);
+
+      done += allocateRun(arena, size, count - done, ptrs + done);
+
+      pthread_mutex_unlock(&arena->mutex);
+    }
+
+    // The arena is out of space, the others may still have some
+    while (done < count && (ptr = allocate(size)) != nullptr)
+      ptrs[done++] = ptr;
+  }
+
+  for (size_t i = 0; i < done; i++)
+    countAlloc(ptrs[i]);
+
+  for (size_t i = done; i < count; i++)
+    ptrs[i] = nullptr;
+
+  return done;
+}
+
+void snp::Memory::freeBatch(void **ptrs, size_t count)
+{
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+  {
+    traceFreeBatch(ptrs, count);
+    return;
+  }
+
+  // The counts may be flushed under the locks below, register first as in allocate
+  cacheRegister();
+
+  heap_arena *locked_arena = nullptr;
+  bool slab_locked = false;
+
+  // Chunks of the locked arena that were freed one after the other and lie next to each
+  // other in the heap: they are one chunk in use until the next one does not fit on
+  heap_chunk *pending = nullptr;
+
+  // Hardened mode: one by one through the quarantine
+  if (__builtin_expect(quarantine_size != 0 || poison_freed, 0))
+  {
+    for (size_t i = 0; i < count; i++)
+      free(ptrs[i]);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    void *ptr = ptrs[i];
+    if (!ptr)
+      continue;
+
+    if (isSlab(ptr))
+    {
+      // The slab lock comes before any arena lock
+      if (!slab_locked && locked_arena != nullptr)
+      {
+        if (pending != nullptr)
+          releaseChunk(locked_arena, pending);
+        pending = nullptr;
+
+        pthread_mutex_unlock(&locked_arena->mutex);
+        locked_arena = nullptr;
+      }
+      if (!slab_locked)
+        pthread_mutex_lock(&slab_mutex);
+      slab_locked = true;
+
+      countFree(ptr, slabSize(ptr));
+      slabFreeSlot(ptr);
+      continue;
+    }
+
+    // Chunks outside of every arena can only come from mmap
+    auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+    heap_arena *arena = arenaOf(chunk);
+    if (arena == nullptr)
+    {
+      unmapChunk(chunk);
+      continue;
+    }
+
+    if (pending != nullptr && arena == locked_arena && NEXT_CHUNK(pending) == chunk)
+    {
+      getChunk(arena, ptr);
+      if (hardening >= HARDENING_LOCAL)
+        checkChunkIntegrity(arena, chunk);
+
+      countFree(ptr, DATA_SIZE(chunk));
+
+      // The header inside the grown chunk is marked available, so a second free of it is caught
+      chunk->size |= CHUNK_AVAILABLE;
+      pending->size += CHUNK_SIZE(chunk);
+      arena->used_count--;
+      continue;
+    }
+
+    // The chunks before have to be available before the next one is checked, it may be one of them
+    if (pending != nullptr)
+      releaseChunk(locked_arena, pending);
+    pending = nullptr;
+
+    chunk = getChunk(arena, ptr);
+    countFree(ptr, DATA_SIZE(chunk));
+
+    // Chunks of other arenas are queued for their arena without taking its lock
+    if (arena != locked_arena && arena != thread_arena && remotePush(arena, chunk))
+      continue;
+
+    if (arena != locked_arena)
+    {
+      if (locked_arena != nullptr)
+        pthread_mutex_unlock(&locked_arena->mutex);
+      arenaLock(arena);
+      locked_arena = arena;
+
+      checkOperation(arena);
+
+      remoteDrain(arena);
+
+      decayArena(arena);
+    }
+
+    pending = chunk;
+  }
+
+  if (pending != nullptr)
+    releaseChunk(locked_arena, pending);
+
+  if (slab_locked)
+    pthread_mutex_unlock(&slab_mutex);
+  if (locked_arena != nullptr)
+    pthread_mutex_unlock(&locked_arena->mutex);
+}
+
+void *snp::Memory::realloc(void *ptr, size_t size)
+{
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+    return traceRealloc(ptr, size);
+
+  if (!ptr)
+    return malloc(size);
+
+  // Same as glibc: the chunk is freed and there is nothing to return
+  if (size == 0)
+  {
+    free(ptr);
+    return nullptr;
+  }
+
+  size_t old_size;
+
+  if (isSlab(ptr))
+  {
+    // The slot is big enough already
+    old_size = slabSize(ptr);
+    if (size <= old_size)
+      return ptr;
+  }
+  else
+  {
+    auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+    heap_arena *arena = arenaOf(chunk);
+
+    // Let the kernel move the pages of a mapped chunk instead of copying them
+    if (arena == nullptr && !isGuarded(chunk))
+      return remapChunk(chunk, size);
+
+    // A guarded chunk is copied, its data has to end at the guard page
+    if (arena == nullptr)
+    {
+      old_size = DATA_SIZE(chunk);
+    }
+    else
+    {
+      arenaLock(arena);
+
+      checkOperation(arena);
+
+      remoteDrain(arena);
+
+      decayArena(arena);
+
+      chunk = getChunk(arena, ptr);
+      old_size = DATA_SIZE(chunk);
+      bool resized = resizeChunk(arena, chunk, size);
+
+      pthread_mutex_unlock(&arena->mutex);
+
+      // The chunk may be in another size class now
+      if (resized)
+      {
+        countFree(ptr, old_size);
+        countAlloc(ptr);
+        return ptr;
+      }
+    }
+  }
+
+  // No space in place -> move the data, the old chunk stays valid if that fails
+  void *new_ptr = malloc(size);
+  if (new_ptr == nullptr)
+    return nullptr;
+
+  memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  free(ptr);
+
+  return new_ptr;
+}
+
+void *snp::Memory::calloc(size_t count, size_t size)
+{
+  // Prevent that count * size overflows
+  if (size != 0 && count > (size_t)-1 / size)
+  {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  size *= count;
+
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+    return traceAllocate(TRACE_CALLOC, size, 0);
+
+  // Mapped memory is always zero
+  if (mmap_threshold != 0 && size >= mmap_threshold)
+  {
+    void *ptr = mapChunk(size);
+    countAlloc(ptr);
+    return ptr;
+  }
+
+  // Cached chunks and slab slots have most likely been used before
+  if (cacheIndex(size) >= 0 || size <= slab_max_size)
+  {
+    void *ptr = malloc(size);
+    if (ptr != nullptr)
+      memset(ptr, 0, size);
+    return ptr;
+  }
+
+  heap_arena *arena = lockArena();
+
+  checkOperation(arena);
+
+  remoteDrain(arena);
+
+  decayArena(arena);
+
+  // Only set if the chunk comes from new memory or from pages that were given back
+  arena->zero_start = nullptr;
+  char *ptr = (char*) allocateChunk(arena, size);
+  char *zero_start = arena->zero_start;
+  char *zero_end = arena->zero_end;
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  if (ptr != nullptr)
+  {
+    countAlloc(ptr);
+  }
+  else
+  {
+    ptr = (char*) malloc(size);
+    zero_start = nullptr;
+  }
+  if (ptr == nullptr)
+    return nullptr;
+
+  // Only clear what is not known to be zero
+  char *end = ptr + size;
+  if (zero_start == nullptr || zero_start >= end || zero_end <= ptr)
+  {
+    memset(ptr, 0, size);
+  }
+  else
+  {
+    if (zero_start > ptr)
+      memset(ptr, 0, zero_start - ptr);
+    if (zero_end < end)
+      memset(zero_end, 0, end - zero_end);
+  }
+
+  return ptr;
+}
+
+void *snp::Memory::memalign(size_t alignment, size_t size)
+{
+  // Only powers of two are valid alignments
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+  {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  if (__builtin_expect(trace_fd >= 0, 0) && !trace_busy)
+    return traceAllocate(TRACE_MEMALIGN, size, alignment);
+
+  // Chunks are not aligned to anything, but many of them happen to be
+  void *ptr = allocate(size);
+  if (ptr == nullptr || (uintptr_t) ptr % alignment == 0)
+  {
+    countAlloc(ptr);
+    return ptr;
+  }
+
+  // A miss is no allocation of the program: its free is not counted either. Until the
+  // counts are flushed, the one of this thread may wrap around, the totals do not.
+  size_t miss_size = isSlab(ptr) ? slabSize(ptr) : DATA_SIZE((heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE));
+  free(ptr);
+  counts.frees[countClass(miss_size)]--;
+
+  // Prevent that the sum of size + alignment + HEAP_CHUNK_SIZE overflows
+  auto size_t_max = (size_t)-1;
+  if (size > size_t_max - alignment - HEAP_CHUNK_SIZE)
+  {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  // Allocate enough to put an aligned chunk into the chunk, and give the rest back
+  heap_arena *arena = lockArena();
+
+  checkOperation(arena);
+
+  remoteDrain(arena);
+
+  decayArena(arena);
+
+  ptr = allocateChunk(arena, size + alignment + HEAP_CHUNK_SIZE);
+  if (ptr != nullptr)
+    ptr = alignChunk(arena, (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE), alignment, size);
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  if (ptr == nullptr)
+    errno = ENOMEM;
+
+  countAlloc(ptr);
+
+  return ptr;
+}
+
+int snp::Memory::posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  // The alignment also has to be a multiple of sizeof(void *), 0 is none
+  if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  void *aligned = memalign(alignment, size);
+  if (aligned == nullptr)
+    return ENOMEM;
+
+  *ptr = aligned;
+  return 0;
+}
+
+void *snp::Memory::aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+size_t snp::Memory::usableSize(void *ptr)
+{
+  if (!ptr)
+    return 0;
+
+  if (isSlab(ptr))
+    return slabSize(ptr);
+
+  // The size of a used chunk is only changed by its owner, no lock needed
+  auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+  heap_arena *arena = arenaOf(chunk);
+  if (arena != nullptr)
+    return DATA_SIZE(getChunk(arena, ptr));
+
+  // Out of memory check, as in unmapChunk
+  if (!isMapped(chunk) && !isGuarded(chunk))
+    exit(-1);
+
+  return DATA_SIZE(chunk);
+}
+
+snp::Memory::heap_arena *snp::Memory::lockArena()
+{
+  heap_arena *arena = thread_arena;
+  if (arena == nullptr || arena_by_cpu || arena_by_node)
+    arena = thread_arena = assignArena();
+
+  if (pthread_mutex_trylock(&arena->mutex) == 0)
+  {
+    arena->lock_count++;
+    return arena;
+  }
+
+  // Contended: take any other arena that is free right now and stay with it.
+  // Not with an arena per node, the memory of the others is on another node.
+  int count = __atomic_load_n(&arena_count, __ATOMIC_RELAXED);
+  for (int i = 0; i < count && !arena_by_node; i++)
+  {
+    heap_arena *other = &arenas[i];
+    if (other != arena && __atomic_load_n(&other->initialized, __ATOMIC_ACQUIRE) &&
+        pthread_mutex_trylock(&other->mutex) == 0)
+    {
+      other->lock_count++;
+      thread_arena = other;
+      return other;
+    }
+  }
+
+  arenaLock(arena);
+  return arena;
+}
+
+void snp::Memory::arenaLock(heap_arena *arena)
+{
+  // The clock is only read if the lock is held by someone else
+  if (pthread_mutex_trylock(&arena->mutex) != 0)
+  {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&arena->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    arena->lock_contended++;
+    arena->lock_wait += (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+  }
+
+  arena->lock_count++;
+}
+
+size_t snp::Memory::arenaCommitted(heap_arena *arena)
+{
+  // The unused memory behind the heap counts until it is trimmed.
+  // Arena 0 starts at the padding of its first chunk, the others at their reserved range.
+  if (arena == &arenas[0])
+    return arena->region_end - (arena->heap_start != nullptr ? arena->heap_base : arena->region_top);
+
+  return (arena->clean > arena->region_top ? arena->clean : arena->region_top) - arena->region_start;
+}
+
+snp::Memory::heap_arena *snp::Memory::assignArena()
+{
+  // Other threads and setOption(ARENA_COUNT) may set the count at the same time
+  int count = __atomic_load_n(&arena_count, __ATOMIC_RELAXED);
+  if (count == 0)
+  {
+    // sysconf may allocate memory itself, that comes from arena 0 then. The count
+    // is only set by one thread, and not if setOption set it in the meantime.
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&arena_count, &expected, 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      int cpu_count = cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : cpus;
+      expected = 1;
+      __atomic_compare_exchange_n(&arena_count, &expected, cpu_count, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    count = __atomic_load_n(&arena_count, __ATOMIC_RELAXED);
+  }
+
+  unsigned int index;
+  if (arena_by_node)
+  {
+    // Arena 0 grows with sbrk and is not bound to a node
+    index = currentNode() + 1;
+  }
+  else if (arena_by_cpu)
+  {
+    int cpu = sched_getcpu();
+    index = cpu < 0 ? 0 : cpu;
+  }
+  else
+    index = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+
+  heap_arena *arena = &arenas[index % count];
+  if (!__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE))
+    initArena(arena);
+
+  return arena;
+}
+
+void snp::Memory::initArena(heap_arena *arena)
+{
+  pthread_mutex_lock(&arena_mutex);
+
+  if (!arena->initialized)
+  {
+    pthread_mutex_init(&arena->mutex, nullptr);
+    arena->fit = fit_policy;
+
+    // Arena 0 uses sbrk, the others grow within their own reserved range.
+    // If the reservation fails, the arena has no space and malloc uses another one.
+    if (arena != &arenas[0])
+    {
+      void *region = mmap(nullptr, ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (region != MAP_FAILED)
+      {
+        arena->region_start = (char*) region;
+        arena->region_top = (char*) region;
+        arena->clean = (char*) region;
+        arena->region_end = (char*) region + ARENA_REGION_SIZE;
+      }
+    }
+
+    bindArena(arena);
+
+    __atomic_store_n(&arena->initialized, 1, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&arena_mutex);
+}
+
+snp::Memory::heap_arena *snp::Memory::arenaOf(heap_chunk *chunk)
+{
+  // The pages of an arena are set as it grows. getChunk still checks that the chunk is in its heap:
+  // the first and last page of arena 0 may be shared with others who call sbrk.
+  uintptr_t owner = pageOwner(chunk);
+  if ((owner & PAGE_KIND_MASK) != PAGE_ARENA)
+    return nullptr;
+
+  return (heap_arena*) (owner & ~(uintptr_t) PAGE_KIND_MASK);
+}
+
+bool snp::Memory::remotePush(heap_arena *arena, heap_chunk *chunk)
+{
+  // The link is stored in the data area of the chunk
+  if (!remote_free || DATA_SIZE(chunk) < sizeof(heap_chunk*))
+    return false;
+
+  auto *link = (heap_chunk**) chunk->data;
+  heap_chunk *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+
+  do
+  {
+    // Double free check: the chunk is still marked as used until the queue is drained
+    if (head == chunk)
+      exit(-1);
+
+    *link = head;
+  }
+  while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, chunk, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  // Nobody has taken the lock for a while, so drain the queue here if that is possible right now
+  if (__atomic_add_fetch(&arena->remote_count, 1, __ATOMIC_RELAXED) >= REMOTE_FREE_LIMIT &&
+      pthread_mutex_trylock(&arena->mutex) == 0)
+  {
+    arena->lock_count++;
+    remoteDrain(arena);
+    pthread_mutex_unlock(&arena->mutex);
+  }
+
+  return true;
+}
+
+void snp::Memory::remoteDrain(heap_arena *arena)
+{
+  // The lock is held: only one thread drains, any number of threads keep pushing
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == nullptr)
+    return;
+
+  heap_chunk *chunk = __atomic_exchange_n(&arena->remote_frees, nullptr, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&arena->remote_count, 0, __ATOMIC_RELAXED);
+
+  while (chunk != nullptr)
+  {
+    // releaseChunk reuses the data area
+    heap_chunk *next = *(heap_chunk**) chunk->data;
+
+    // Double free check: a chunk queued twice shows up again after its release
+    if (chunk->size & CHUNK_AVAILABLE)
+      exit(-1);
+
+    releaseChunk(arena, chunk);
+    chunk = next;
+  }
+}
+
+void *snp::Memory::arenaGrow(heap_arena *arena, intptr_t increment)
+{
+  // Same interface as sbrk: returns the previous end or (void *) -1.
+  // The heap moves within the reserved memory, so only growing beyond it and trimming
+  // more than the threshold need a system call. That avoids one sbrk per page and
+  // the grow/shrink ping-pong of a chunk that is allocated and freed at the top.
+  uintptr_t pagesize = getpagesize();
+  char *top = arena->region_top;
+
+  if (increment < 0)
+  {
+    // Arena 0 keeps its span, the others the pages that may be resident behind the heap
+    arena->region_top = top + increment;
+
+    size_t unused = (arena == &arenas[0] ? arena->region_end : arena->clean) - arena->region_top;
+    if (unused > trim_threshold)
+      arenaTrim(arena, trim_threshold / 2);
+
+    return top;
+  }
+
+  if (arena == &arenas[0])
+  {
+    // Someone else has moved the program break -> the new memory starts at the break and the rest
+    // of the span is left behind. Only whole pages above it are known to be zero.
+    char *current = (char*) sbrk(0);
+    if (current != arena->region_end)
+    {
+      top = current;
+      arena->region_end = current;
+      arena->clean = (char*) (((uintptr_t) current + pagesize - 1) & ~(pagesize - 1));
+    }
+
+    if ((uintptr_t) increment > (uintptr_t) (arena->region_end - top))
+    {
+      if ((uintptr_t) top + increment < (uintptr_t) top)
+        return (void*) -1;
+
+      // Take a whole span, twice as big as the one before, and fall back to the missing bytes alone.
+      // The span ends at a page boundary, so trimming gives back whole pages.
+      size_t next_span = grow_span == 0 ? 0 : arena->next_span < grow_span ? grow_span : arena->next_span;
+      uintptr_t missing = (uintptr_t) top + increment - (uintptr_t) arena->region_end;
+      uintptr_t span_end = (uintptr_t) arena->region_end + (missing > next_span ? missing : next_span);
+      uintptr_t span = ((span_end + pagesize - 1) & ~(pagesize - 1)) - (uintptr_t) arena->region_end;
+
+      // On error, (void *) -1 is returned, and errno is set to ENOMEM
+      if (span < missing || span > (uintptr_t) INTPTR_MAX || sbrk(span) == (void*) -1)
+      {
+        span = missing;
+        if (span > (uintptr_t) INTPTR_MAX || sbrk(span) == (void*) -1)
+          return (void*) -1;
+      }
+
+      arena->region_end += span;
+      arena->next_span = next_span < GROW_SPAN_MAX ? 2 * next_span : next_span;
+    }
+  }
+  else if (increment > arena->region_end - top)
+    return (void*) -1;
+
+  char *end = top + increment;
+
+  // Free finds the arena of the new chunks from their pages
+  if (!pageMapSet(top, end, (uintptr_t) arena | PAGE_ARENA))
+    return (void*) -1;
+
+  // Tell calloc where the zero memory of this growth is. The header at its
+  // start may be merged into the chunk, so it does not count.
+  arena->zero_start = (top > arena->clean ? top : arena->clean) + HEAP_CHUNK_SIZE;
+  arena->zero_end = end;
+  if (end > arena->clean)
+    arena->clean = end;
+
+  arena->region_top = end;
+  return top;
+}
+
+void snp::Memory::arenaTrim(heap_arena *arena, size_t keep)
+{
+  // Gives the memory behind the heap back to the OS, except for the keep bytes behind it.
+  // Whole pages of it, the pages given back read as zero later on.
+  uintptr_t pagesize = getpagesize();
+  char *end = (char*) (((uintptr_t) arena->region_top + keep + pagesize - 1) & ~(pagesize - 1));
+
+  if (arena == &arenas[0])
+  {
+    // Only the end of the program break can be given back
+    if (arena->region_top == nullptr || end >= arena->region_end || sbrk(0) != arena->region_end)
+      return;
+
+    // The pages may be someone else's after the next sbrk
+    pageMapSet(end, arena->region_end, PAGE_NONE);
+
+    // On error, (void *) -1 is returned, and errno is set to ENOMEM
+    if (sbrk(end - arena->region_end) == (void*) -1)
+      exit(-1);
+
+    arena->region_end = end;
+  }
+  else
+  {
+    if (end >= arena->clean)
+      return;
+
+    madvise(end, arena->clean - end, MADV_DONTNEED);
+  }
+
+  if (end < arena->clean)
+    arena->clean = end;
+}
+
+bool snp::Memory::heapAtTop(heap_arena *arena)
+{
+  // The program break is shared with everyone else who calls sbrk,
+  // e.g. the C library malloc in a program that does not preload us.
+  // sbrk(0) does not need a system call.
+  return arena != &arenas[0] || sbrk(0) == arena->region_end;
+}
+
+bool snp::Memory::releaseRange(heap_chunk *chunk, char **start, char **end)
+{
+  // The whole pages of an available chunk behind its links or node and time, and in front of its size at the end
+  uintptr_t pagesize = getpagesize();
+  *start = (char*) (((uintptr_t) chunk->data + sizeof(free_node) + sizeof(uint64_t) + pagesize - 1) & ~(pagesize - 1));
+  *end = (char*) (((uintptr_t) NEXT_CHUNK(chunk) - sizeof(size_t)) & ~(pagesize - 1));
+
+  return *start < *end;
+}
+
+void snp::Memory::releasePages(heap_arena *arena, heap_chunk *chunk)
+{
+  char *start, *end;
+  if ((chunk->size & CHUNK_RELEASED) || !releaseRange(chunk, &start, &end))
+    return;
+
+  // MADV_FREE would keep the pages until the system runs short of memory,
+  // and they would not be known to read as zero afterwards
+  if (madvise(start, end - start, MADV_DONTNEED) != 0)
+    return;
+
+  chunk->size |= CHUNK_RELEASED;
+  arena->released += end - start;
+}
+
+void snp::Memory::decayArena(heap_arena *arena)
+{
+  // Called once per locked operation, the lock is held. The clock is only read every few operations.
+  if (++arena->release_count < RELEASE_CHECK_INTERVAL)
+    return;
+  arena->release_count = 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  arena->release_clock = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+  // Search the bins twice per decay time, so no chunk keeps its pages much longer than that.
+  // Chunks that are used again before do not cost a madvise at all.
+  if (arena->release_sweep == 0)
+    arena->release_sweep = arena->release_clock + release_decay / 2;
+  if (arena->release_clock < arena->release_sweep)
+    return;
+  arena->release_sweep = arena->release_clock + release_decay / 2;
+
+  // The memory kept behind the heap for the next growth is given back as well
+  arenaTrim(arena, 0);
+
+  if (arena->fit == FIT_ADDRESS)
+  {
+    treeRelease(arena, arena->free_tree);
+    return;
+  }
+
+  // Only chunks of more than a page can have whole pages inside
+  for (int index = binIndex(getpagesize()); index <= SMALL_BIN_COUNT; index++)
+  {
+    heap_chunk *chunk = index < SMALL_BIN_COUNT ? arena->small_bins[index] : arena->large_bin;
+
+    for (; chunk != nullptr; chunk = FREE_LINKS(chunk)->next)
+    {
+      char *start, *end;
+      if (!(chunk->size & CHUNK_RELEASED) && releaseRange(chunk, &start, &end) &&
+          arena->release_clock - FREE_TIME(chunk) >= release_decay)
+        releasePages(arena, chunk);
+    }
+  }
+}
+
+void *snp::Memory::allocateChunk(heap_arena *arena, size_t size)
+{
+  void *ptr = nullptr;
+
+  // Prevent that the sum of size + HEAP_CHUNK_SIZE + alignment overflows
+  auto size_t_max = (size_t)-1;
+  if (size > (size_t_max - HEAP_CHUNK_SIZE - MALLOC_ALIGNMENT))
+    exit(-1);
+
+  size = CHUNK_DATA_SIZE(size);
+
+  // If the heap is initialized, try to reuse a free chunk
+  if (arena->heap_start)
+    ptr = findAvailableChunk(arena, size);
+
+  // If there is no chunk available or it is the first allocation.
+  // Returns a nullptr if sbrk fails
+  if (ptr == nullptr)
+    ptr = createChunk(arena, size);
+
+  if (ptr != nullptr)
+    arena->used_count++;
+
+  return ptr;
+}
+
+size_t snp::Memory::allocateRun(heap_arena *arena, size_t size, size_t count, void **ptrs)
+{
+  // Prevent that the sum of size + HEAP_CHUNK_SIZE + alignment overflows
+  auto size_t_max = (size_t)-1;
+  if (size > (size_t_max - HEAP_CHUNK_SIZE - MALLOC_ALIGNMENT))
+    exit(-1);
+
+  size_t chunk_size = HEAP_CHUNK_SIZE + CHUNK_DATA_SIZE(size);
+  size_t done = 0;
+  size_t run = count;
+
+  // Lock is held: take one chunk for a run of chunks and cut it into pieces, e.g.
+  // 3 chunks of 48 bytes are one chunk of 3 * 64 - 16 bytes with 2 headers inside.
+  // If the heap has no room for the run, try again with half as many chunks.
+  while (done < count)
+  {
+    if (run > count - done)
+      run = count - done;
+
+    void *ptr = nullptr;
+    if (run <= (size_t_max - MALLOC_ALIGNMENT) / chunk_size)
+      ptr = allocateChunk(arena, run * chunk_size - HEAP_CHUNK_SIZE);
+
+    if (ptr == nullptr)
+    {
+      if (run == 1)
+        break;
+      run /= 2;
+      continue;
+    }
+
+    // The run is in use, so none of its pieces gets CHUNK_PREV_AVAILABLE.
+    // The last one keeps the bytes that were too few to split off.
+    auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+    size_t rest = CHUNK_SIZE(chunk);
+
+    for (size_t i = 1; i < run; i++)
+    {
+      ptrs[done++] = chunk->data;
+      chunk->size = chunk_size | (chunk->size & CHUNK_FLAGS);
+      rest -= chunk_size;
+
+      chunk = NEXT_CHUNK(chunk);
+      chunk->size = rest;
+    }
+    ptrs[done++] = chunk->data;
+
+    arena->used_count += run - 1;
+  }
+
+  return done;
+}
+
+snp::Memory::heap_chunk *snp::Memory::getChunk(heap_arena *arena, void *ptr)
+{
+  // Get the heap chunk holding ptr
+  auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+
+  // Out of memory check -> prevent that someone frees something that is not allocated
+  if (arena->heap_start == nullptr || chunk < arena->heap_start || chunk >= arena->heap_end)
+    exit(-1);
+
+  // Memory corruption check -> prevent that someone does free(ptr+5)
+  // The given ptr seems valid if it is aligned and the chunk ends within the heap
+  if ((uintptr_t) ptr % MALLOC_ALIGNMENT != 0 || CHUNK_SIZE(chunk) < MALLOC_ALIGNMENT ||
+      CHUNK_SIZE(chunk) > (size_t) ((char*) arena->heap_end - (char*) chunk))
+    exit(-1);
+
+  // Double free check:
+  // free is not possible if the chunk is already marked as available
+  if (chunk->size & CHUNK_AVAILABLE)
+    exit(-1);
+
+  return chunk;
+}
+
+void snp::Memory::releaseChunk(heap_arena *arena, heap_chunk *chunk)
+{
+  if (hardening >= HARDENING_LOCAL)
+    checkChunkIntegrity(arena, chunk);
+
+  arena->used_count--;
+
+  // Merge with the previous and next chunk if they are marked available
+  chunk = mergeChunk(arena, chunk);
+
+  // Try to shrink the heap, unless someone else has moved the program break above it
+  bool trim = NEXT_CHUNK(chunk) == arena->heap_end && heapAtTop(arena);
+
+  if (trim && chunk != arena->heap_start && HeapGrowth::unit() > 1) { // -> there is still > 1 chunks overall
+    // We want to reduce the data size but not the header, e.g.
+    // if 12300 would be the entire allocation size -> 12300 - 3*4096 = 12 bytes
+    int pagesize = HeapGrowth::unit() - HEAP_CHUNK_SIZE;
+
+    // Decrement in multiples of page size, e.g.
+    // 3964  <= 4088 -> don't do anything
+    // 13000 -> 13000 - 3 * 4088 = 736
+    if (DATA_SIZE(chunk) > (size_t) pagesize) {
+      size_t pagesize_multiple = DATA_SIZE(chunk) / pagesize; // int div always does down round
+      // The end of the chunk has to stay where a chunk can start
+      size_t data_size_to_subtract = pagesize_multiple * pagesize & ~(MALLOC_ALIGNMENT - 1);
+
+      chunk->size -= data_size_to_subtract;
+
+      // The end marker moves along
+      arena->heap_end = NEXT_CHUNK(chunk);
+      arena->heap_end->size = 0;
+
+      // On error, (void *) -1 is returned, and errno is set to ENOMEM
+      if (arenaGrow(arena, -data_size_to_subtract) == (void*) -1)
+        exit(-1);
+    }
+  }
+  else if (trim)
+  {
+    //printStatistics("REDUCE sbrk");
+
+    char *top;
+
+    // If there is no more previous chunk, we are just freeing arena->heap_start -> the heap is empty.
+    // Also give back the alignment padding in front of it.
+    if (chunk == arena->heap_start)
+    {
+      arena->heap_start = nullptr;
+      arena->heap_end = nullptr;
+      top = arena->heap_base;
+    }
+    else
+    {
+      // The previous chunk is in use, otherwise both would have been merged.
+      // The chunk becomes the end marker behind it.
+      chunk->size = 0;
+      arena->heap_end = chunk;
+      top = chunk->data;
+    }
+
+    // On error, (void *) -1 is returned, and errno is set to ENOMEM
+    if (arenaGrow(arena, top - arena->region_top) == (void*) -1)
+      exit(-1);
+
+    chunk = nullptr;
+  }
+
+  // The chunk still exists -> make it findable for the next malloc
+  if (chunk != nullptr)
+  {
+    Chunk::markAvailable(chunk);
+    binInsert(arena, chunk);
+  }
+}
+
+void* snp::Memory::createChunk(heap_arena *arena, size_t size)
+{
+  // The size was checked for overflows and rounded up by allocateChunk
+  size_t chunk_size = HEAP_CHUNK_SIZE + size;
+
+  // The new chunk takes the place of the end marker, and a new end marker goes behind it.
+  // The first chunk starts at the first offset with aligned data, and the bytes in front are padding.
+  char *start = nullptr;
+  char *end = arena->region_top;
+  size_t allocation_size = chunk_size + HEAP_CHUNK_SIZE + MALLOC_ALIGNMENT - 1;
+
+  // Someone else has taken the memory behind the heap -> the new chunk starts behind theirs
+  bool gap = arena->heap_end != nullptr && !heapAtTop(arena);
+
+  if (arena->heap_end != nullptr && !gap)
+  {
+    start = (char*) arena->heap_end;
+
+    // If a previous chunk was freed and is marked available at the heap end, let's reuse it.
+    // This also means allocating only the missing size now and then merging the old and the new chunk
+    // in order to get a chunk with the full size
+    if (arena->heap_end->size & CHUNK_PREV_AVAILABLE)
+    {
+      heap_chunk *last = PREV_CHUNK(arena->heap_end);
+
+      if (hardening >= HARDENING_LOCAL)
+        checkChunkIntegrity(arena, last);
+
+      chunk_size = chunk_size > CHUNK_SIZE(last) + MALLOC_ALIGNMENT ? chunk_size - CHUNK_SIZE(last) : MALLOC_ALIGNMENT;
+    }
+
+    // Bytes behind the end marker that were too few for another chunk are there already
+    allocation_size = start + chunk_size + HEAP_CHUNK_SIZE - end;
+  }
+
+  // Allocate in multiples of the growth unit, e.g. memory pages (= 4096 bytes)
+  size_t unit = HeapGrowth::unit();
+  allocation_size = (allocation_size + unit - 1) & ~(unit - 1);
+
+  char *top = (char*) arenaGrow(arena, allocation_size);
+
+  // On error, (void *) -1 is returned, and errno is set to ENOMEM
+  if (top == (char*) -1)
+    return nullptr;
+
+  // The program break was moved by someone else in the meantime -> the memory is not behind the heap
+  if (gap ? top < end : start != nullptr && top != end)
+  {
+    arenaGrow(arena, -allocation_size);
+    return nullptr;
+  }
+
+  if (start == nullptr)
+  {
+    if (!gap)
+      arena->heap_base = top;
+    start = (char*) ((((uintptr_t) top + HEAP_CHUNK_SIZE + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1)) - HEAP_CHUNK_SIZE);
+  }
+
+  auto *chunk = (heap_chunk *) start;
+  size_t flags = 0;
+
+  // First allocation -> we have a new heap start
+  if (arena->heap_start == nullptr)
+    arena->heap_start = chunk;
+  // The old end marker becomes a chunk in use that spans the memory of someone else
+  else if (gap)
+  {
+    arena->heap_end->size = (start - (char*) arena->heap_end) | (arena->heap_end->size & CHUNK_PREV_AVAILABLE);
+    arena->used_count++;
+  }
+  // The new chunk replaces the old end marker, which knows whether the last chunk is available
+  else
+    flags = arena->heap_end->size & CHUNK_PREV_AVAILABLE;
+
+  // Leave the bytes behind the end marker that are too few for another chunk
+  chunk->size = ((arena->region_top - HEAP_CHUNK_SIZE - start) & ~(MALLOC_ALIGNMENT - 1)) | flags;
+
+  arena->heap_end = NEXT_CHUNK(chunk);
+  arena->heap_end->size = 0;
+
+  // Merge with a previous chunk if available
+  chunk = mergeChunk(arena, chunk);
+  Chunk::markUsed(chunk);
+
+  // If we have allocated more than needed, resize the current chunk to the actually
+  // requested size and move the remaining bytes to a new chunk for potential later use
+  if (DATA_SIZE(chunk) > size)
+    splitChunk(arena, chunk, size);
+
+  //printStatistics("AFTER createChunk(arena, )");
+
+  return chunk->data;
+}
+
+void* snp::Memory::mapChunk(size_t size)
+{
+  // Prevent that the sum of MMAP_DATA_OFFSET + size overflows
+  int pagesize = getpagesize();
+  auto size_t_max = (size_t)-1;
+  if (size > (size_t_max - MMAP_DATA_OFFSET - pagesize))
+    exit(-1);
+
+  // Round up to whole pages, the rest of the last page is part of the chunk.
+  // The header comes in front of the data.
+  size_t allocation_size = MMAP_DATA_OFFSET + size;
+  if (allocation_size % pagesize != 0)
+    allocation_size += pagesize - (allocation_size % pagesize);
+
+  void *mapping = mmap(nullptr, allocation_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  auto *chunk = (heap_chunk*) ((char*) mapping + MMAP_DATA_OFFSET - HEAP_CHUNK_SIZE);
+  // The size is a multiple of the alignment as for the other chunks, the last word of the mapping is not used
+  chunk->size = allocation_size - MMAP_DATA_OFFSET;
+
+  // All pages of the mapping point to the header, so free can tell which pointers are ours
+  if (!pageMapSet(mapping, (char*) mapping + allocation_size, (uintptr_t) chunk | PAGE_MAPPED))
+  {
+    munmap(mapping, allocation_size);
+    return nullptr;
+  }
+
+  pthread_mutex_lock(&mmap_mutex);
+
+  mmap_size += allocation_size;
+  mmap_count++;
+
+  pthread_mutex_unlock(&mmap_mutex);
+
+  return chunk->data;
+}
+
+void snp::Memory::unmapChunk(heap_chunk *chunk)
+{
+  // The counts may be flushed under the lock, register first as in allocate
+  cacheRegister();
+
+  // The lock makes the check and clearing the pages one step, so a double free is caught
+  pthread_mutex_lock(&mmap_mutex);
+
+  if (isGuarded(chunk))
+  {
+    guardRelease(chunk);
+    pthread_mutex_unlock(&mmap_mutex);
+    return;
+  }
+
+  // Out of memory check -> only pointers from mapChunk can be outside of the arenas
+  if (!isMapped(chunk))
+    exit(-1);
+
+  countFree(chunk->data, DATA_SIZE(chunk));
+
+  char *mapping = MMAP_START(chunk);
+  size_t mapping_size = MMAP_DATA_OFFSET + CHUNK_SIZE(chunk);
+  pageMapSet(mapping, mapping + mapping_size, PAGE_NONE);
+
+  mmap_size -= mapping_size;
+  mmap_count--;
+
+  pthread_mutex_unlock(&mmap_mutex);
+
+  if (munmap(mapping, mapping_size) != 0)
+    exit(-1);
+}
+
+void* snp::Memory::remapChunk(heap_chunk *chunk, size_t size)
+{
+  // Prevent that the sum of MMAP_DATA_OFFSET + size overflows
+  int pagesize = getpagesize();
+  auto size_t_max = (size_t)-1;
+  if (size > (size_t_max - MMAP_DATA_OFFSET - pagesize))
+    return nullptr;
+
+  size_t allocation_size = MMAP_DATA_OFFSET + size;
+  if (allocation_size % pagesize != 0)
+    allocation_size += pagesize - (allocation_size % pagesize);
+
+  cacheRegister();
+  pthread_mutex_lock(&mmap_mutex);
+
+  // Out of memory check, as in unmapChunk
+  if (!isMapped(chunk))
+    exit(-1);
+
+  // The mapping may move, the pages have to follow. They are cleared while they are still ours:
+  // once moved, the old range may be mapped and set by another thread right away.
+  void *old_ptr = chunk->data;
+  char *old_mapping = MMAP_START(chunk);
+  size_t old_size = MMAP_DATA_OFFSET + CHUNK_SIZE(chunk);
+  pageMapSet(old_mapping, old_mapping + old_size, PAGE_NONE);
+
+  void *mapping = mremap(old_mapping, old_size, allocation_size, MREMAP_MAYMOVE);
+  if (mapping != MAP_FAILED)
+  {
+    mmap_size += allocation_size - old_size;
+    countFree(old_ptr, old_size - MMAP_DATA_OFFSET - HEAP_CHUNK_SIZE);
+
+    chunk = (heap_chunk*) ((char*) mapping + MMAP_DATA_OFFSET - HEAP_CHUNK_SIZE);
+    chunk->size = allocation_size - MMAP_DATA_OFFSET;
+  }
+
+  // The old data is gone if the mapping has moved, so there is nothing to fall back to if the map can't grow
+  if (!pageMapSet(MMAP_START(chunk), MMAP_START(chunk) + MMAP_DATA_OFFSET + CHUNK_SIZE(chunk),
+                  (uintptr_t) chunk | PAGE_MAPPED))
+    exit(-1);
+
+  pthread_mutex_unlock(&mmap_mutex);
+
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  countAlloc(chunk->data);
+
+  return chunk->data;
+}
+
+bool snp::Memory::isMapped(heap_chunk *chunk)
+{
+  // The page of the header points to it, instead of reading the header of an unknown address
+  return pageOwner(chunk) == ((uintptr_t) chunk | PAGE_MAPPED);
+}
+
+void* snp::Memory::guardChunk(size_t size)
+{
+  // Too big for the guard pages around it, the other paths take care of it
+  size_t pagesize = getpagesize();
+  if (size > (size_t)-1 - 4 * pagesize)
+    return nullptr;
+
+  // The data starts offset bytes in front of the guard page behind it, so a write past the end faults.
+  // Whole pages are mapped, the header and what is left of them lie in front of the data.
+  // The data size of a heap chunk keeps the flag bits of the chunk size clear. Where a size of
+  // whole alignment units does so as well, it is taken and the data ends right at the guard page,
+  // on 32-bit it ends a word in front of it.
+  size_t data_size = CHUNK_DATA_SIZE(size);
+  size_t offset = (data_size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+  if (((HEAP_CHUNK_SIZE + offset) & CHUNK_FLAGS) == 0)
+    data_size = offset;
+
+  size_t inner_size = (HEAP_CHUNK_SIZE + offset + pagesize - 1) & ~(pagesize - 1);
+  size_t mapping_size = inner_size + 2 * pagesize;
+
+  auto *mapping = (char*) mmap(nullptr, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+
+  char *inner = mapping + pagesize;
+  if (mprotect(inner, inner_size, PROT_READ | PROT_WRITE) != 0)
+  {
+    munmap(mapping, mapping_size);
+    return nullptr;
+  }
+
+  // The header is a word in front of the data, DATA_SIZE is at least the requested size
+  auto *chunk = (heap_chunk*) (inner + inner_size - offset - HEAP_CHUNK_SIZE);
+  chunk->size = HEAP_CHUNK_SIZE + data_size;
+
+  // The guard pages are not ours, a pointer into them is rejected like any other
+  if (!pageMapSet(inner, inner + inner_size, (uintptr_t) chunk | PAGE_GUARDED))
+  {
+    munmap(mapping, mapping_size);
+    return nullptr;
+  }
+
+  pthread_mutex_lock(&mmap_mutex);
+
+  mmap_size += mapping_size;
+  mmap_count++;
+
+  pthread_mutex_unlock(&mmap_mutex);
+
+  return chunk->data;
+}
+
+void snp::Memory::guardRelease(heap_chunk *chunk)
+{
+  // Called with mmap_mutex held, after isGuarded
+  countFree(chunk->data, DATA_SIZE(chunk));
+
+  // The header lies in the first page between the guard pages, the data ends at the second one
+  size_t pagesize = getpagesize();
+  char *inner = (char*) ((uintptr_t) chunk & ~(uintptr_t) (pagesize - 1));
+  char *inner_end = (char*) (((uintptr_t) chunk->data + DATA_SIZE(chunk) + pagesize - 1) & ~(uintptr_t) (pagesize - 1));
+  pageMapSet(inner, inner_end, PAGE_NONE);
+
+  guard_mapping freed = { inner - pagesize, (size_t) (inner_end - inner) + 2 * pagesize };
+  mmap_size -= freed.size;
+  mmap_count--;
+
+  // A use after free faults as well. The pages are given back, but the range stays reserved,
+  // so mmap does not hand it out again until GUARD_FREED_COUNT more guarded chunks are freed.
+  madvise(inner, inner_end - inner, MADV_DONTNEED);
+  if (mprotect(inner, inner_end - inner, PROT_NONE) != 0)
+    exit(-1);
+
+  guard_mapping *oldest = &guard_freed[guard_freed_next];
+  guard_freed_next = (guard_freed_next + 1) % GUARD_FREED_COUNT;
+
+  if (oldest->start != nullptr)
+    munmap(oldest->start, oldest->size);
+  *oldest = freed;
+}
+
+bool snp::Memory::isGuarded(heap_chunk *chunk)
+{
+  // As isMapped
+  return pageOwner(chunk) == ((uintptr_t) chunk | PAGE_GUARDED);
+}
+
+bool snp::Memory::quarantinePush(void *ptr, size_t size)
+{
+  // Called for a slab slot or heap chunk that was checked to be in use.
+  // Returns false if it is to be freed right away, after it was poisoned.
+  auto *words = (uintptr_t*) ptr;
+
+  if (quarantine_size == 0)
+  {
+    memset(ptr, POISON_BYTE, size);
+    return false;
+  }
+
+  // The first word is left for the mark
+  int poisoned = poison_freed;
+  if (poisoned)
+    memset(words + 1, POISON_BYTE, size - sizeof(uintptr_t));
+
+  pthread_mutex_lock(&quarantine_mutex);
+
+  // Double free check: the chunk is still marked as used in the heap. The mark may also be
+  // program data by chance, so the ring is searched before the program is ended.
+  if (words[0] == QUARANTINE_MARK(ptr))
+  {
+    for (size_t i = 0; i < quarantine_count; i++)
+      if (quarantine[(quarantine_start + i) % QUARANTINE_COUNT].ptr == ptr)
+        exit(-1);
+  }
+
+  // A full ring gives back its oldest chunk first
+  quarantine_entry oldest = {};
+  if (quarantine_count == QUARANTINE_COUNT)
+  {
+    oldest = quarantine[quarantine_start];
+    quarantine_start = (quarantine_start + 1) % QUARANTINE_COUNT;
+    quarantine_count--;
+    quarantine_bytes -= oldest.size;
+  }
+
+  words[0] = QUARANTINE_MARK(ptr);
+  quarantine[(quarantine_start + quarantine_count) % QUARANTINE_COUNT] = { ptr, size, poisoned };
+  quarantine_count++;
+  quarantine_bytes += size;
+
+  pthread_mutex_unlock(&quarantine_mutex);
+
+  if (oldest.ptr != nullptr)
+    quarantineRelease(&oldest);
+
+  quarantineEvict(quarantine_size);
+
+  return true;
+}
+
+void snp::Memory::quarantineEvict(size_t keep)
+{
+  // Oldest first, until at most keep bytes are held back. The lock is not held
+  // while a chunk is freed, that takes the locks of the slabs and arenas.
+  while (true)
+  {
+    pthread_mutex_lock(&quarantine_mutex);
+
+    if (quarantine_count == 0 || quarantine_bytes <= keep)
+    {
+      pthread_mutex_unlock(&quarantine_mutex);
+      return;
+    }
+
+    quarantine_entry oldest = quarantine[quarantine_start];
+    quarantine_start = (quarantine_start + 1) % QUARANTINE_COUNT;
+    quarantine_count--;
+    quarantine_bytes -= oldest.size;
+
+    pthread_mutex_unlock(&quarantine_mutex);
+
+    quarantineRelease(&oldest);
+  }
+}
+
+void snp::Memory::quarantineRelease(quarantine_entry *entry)
+{
+  // Use after free check: the program wrote to the chunk while it was held back
+  auto *words = (uintptr_t*) entry->ptr;
+  if (words[0] != QUARANTINE_MARK(entry->ptr))
+    exit(-1);
+
+  if (entry->poisoned)
+  {
+    for (size_t i = 1; i < entry->size / sizeof(uintptr_t); i++)
+      if (words[i] != POISON_WORD)
+        exit(-1);
+  }
+
+  // Not mistaken for a quarantined chunk when it is freed the next time
+  words[0] = 0;
+
+  if (isSlab(entry->ptr))
+  {
+    deallocateSlot(entry->ptr, entry->size);
+    return;
+  }
+
+  // Memory corruption check: an overflow of the chunk in front changed the size
+  auto *chunk = (heap_chunk*) ((char*) entry->ptr - HEAP_CHUNK_SIZE);
+  heap_arena *arena = arenaOf(chunk);
+  if (arena == nullptr || DATA_SIZE(getChunk(arena, entry->ptr)) != entry->size)
+    exit(-1);
+
+  deallocateChunk(arena, chunk);
+}
+
+void* snp::Memory::findAvailableChunk(heap_arena *arena, size_t size)
+{
+  heap_chunk *chunk = binFind(arena, size);
+
+  if (chunk == nullptr)
+    return nullptr;
+
+  if (hardening >= HARDENING_LOCAL)
+    checkChunkIntegrity(arena, chunk);
+
+  // The pages that were given back read as zero, calloc does not have to clear them
+  bool released = (chunk->size & CHUNK_RELEASED) != 0;
+  if (released)
+    releaseRange(chunk, &arena->zero_start, &arena->zero_end);
+
+  // Take the chunk out of its bin before its size changes
+  binRemove(arena, chunk);
+  Chunk::markUsed(chunk);
+  splitChunk(arena, chunk, size);
+
+  // The whole pages inside the rest have been given back already
+  heap_chunk *rest = NEXT_CHUNK(chunk);
+  char *start, *end;
+  if (released && (rest->size & CHUNK_FLAGS) == CHUNK_AVAILABLE && releaseRange(rest, &start, &end))
+  {
+    rest->size |= CHUNK_RELEASED;
+    arena->released += end - start;
+  }
+
+  return chunk->data;
+}
+
+void snp::Memory::splitChunk(heap_arena *arena, heap_chunk *chunk, size_t size)
+{
+  // The remaining bytes go into the bins, so a later malloc can reuse them
+  arena_index index = {arena};
+  Chunk::splitChunk(index, chunk, size);
+}
+
+bool snp::Memory::resizeChunk(heap_arena *arena, heap_chunk *chunk, size_t size)
+{
+  if (hardening >= HARDENING_LOCAL)
+    checkChunkIntegrity(arena, chunk);
+
+  // Take over the next chunk if it is available and the chunk shrinks, or grows
+  // into it, or grows beyond it at the heap end.
+  // When shrinking, the rest is merged with it that way.
+  heap_chunk *next = NEXT_CHUNK(chunk);
+  if ((next->size & CHUNK_AVAILABLE) &&
+      (size <= DATA_SIZE(chunk) || NEXT_CHUNK(next) == arena->heap_end ||
+       size <= DATA_SIZE(chunk) + CHUNK_SIZE(next)))
+  {
+    mergeNext(arena, chunk);
+    Chunk::markUsed(chunk);
+  }
+
+  // The last chunk can simply grow
+  if (NEXT_CHUNK(chunk) == arena->heap_end && DATA_SIZE(chunk) < size && heapAtTop(arena))
+  {
+    // Prevent that the sum of size + HEAP_CHUNK_SIZE + alignment overflows
+    size_t pagesize = getpagesize();
+    if (size > (size_t)-1 - 2 * HEAP_CHUNK_SIZE - MALLOC_ALIGNMENT - pagesize)
+      return false;
+
+    // The end marker moves behind the grown chunk, the bytes behind it are there already
+    char *end = arena->region_top;
+    size_t increment = (char*) chunk + HEAP_CHUNK_SIZE + CHUNK_DATA_SIZE(size) + HEAP_CHUNK_SIZE - end;
+
+    // Allocate in multiples of the growth unit, e.g. memory pages (= 4096 bytes)
+    size_t unit = HeapGrowth::unit();
+    increment = (increment + unit - 1) & ~(unit - 1);
+
+    char *top = (char*) arenaGrow(arena, increment);
+    if (top == (char*) -1)
+      return false;
+
+    // The program break was moved by someone else -> the memory is not behind the chunk
+    if (top != end)
+    {
+      arenaGrow(arena, -increment);
+      return false;
+    }
+
+    chunk->size = ((arena->region_top - HEAP_CHUNK_SIZE - (char*) chunk) & ~(MALLOC_ALIGNMENT - 1)) |
+                  (chunk->size & CHUNK_FLAGS);
+
+    arena->heap_end = NEXT_CHUNK(chunk);
+    arena->heap_end->size = 0;
+  }
+
+  if (DATA_SIZE(chunk) < size)
+    return false;
+
+  // Give the rest back, if it is big enough for a chunk
+  splitChunk(arena, chunk, size);
+
+  return true;
+}
+
+void *snp::Memory::alignChunk(heap_arena *arena, heap_chunk *chunk, size_t alignment, size_t size)
+{
+  // The chunk has at least size + alignment + HEAP_CHUNK_SIZE bytes
+  if ((uintptr_t) chunk->data % alignment != 0)
+  {
+    // The data is aligned to MALLOC_ALIGNMENT already, so the part in
+    // front is big enough for a chunk of its own
+    uintptr_t data = ((uintptr_t) chunk->data + alignment - 1) & ~(alignment - 1);
+    auto *aligned = (heap_chunk*) (data - HEAP_CHUNK_SIZE);
+
+    aligned->size = (char*) NEXT_CHUNK(chunk) - (char*) aligned;
+    chunk->size = ((char*) aligned - (char*) chunk) | (chunk->size & CHUNK_FLAGS);
+
+    // The part in front is free again
+    arena->used_count++;
+    releaseChunk(arena, chunk);
+
+    chunk = aligned;
+  }
+
+  // The part behind as well, merged with the next chunk if that one is available
+  mergeNext(arena, chunk);
+  Chunk::markUsed(chunk);
+  splitChunk(arena, chunk, size);
+
+  return chunk->data;
+}
+
+void snp::Memory::mergeNext(heap_arena *arena, heap_chunk *chunk)
+{
+  // The chunks spanning someone else's memory are never available either
+  arena_index index = {arena};
+  Chunk::mergeNext(index, chunk);
+}
+
+snp::Memory::heap_chunk* snp::Memory::mergeChunk(heap_arena *arena, heap_chunk *chunk)
+{
+  // Note: the given chunk itself must not be in a bin, but its available
+  // neighbors are -> they have to leave their bins before they get resized
+  arena_index index = {arena};
+  return Chunk::mergeChunk(index, chunk);
+}
+
+int snp::Memory::binIndex(size_t size)
+{
+  // Below 64 bytes, every 8 bytes get their own bin: 0..7
+  if (size < 64)
+    return size / 8;
 
-#define PAGESIZEALLOC 1
+  // Above, each power of two is split into 4 sub-bins: 8..63
+  int log2 = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+  int sub_bin = (size >> (log2 - 2)) & 3;
 
-snp::Memory::heap_chunk* snp::Memory::heap_start = nullptr;
-snp::Memory::heap_chunk* snp::Memory::heap_end = nullptr;
-pthread_mutex_t snp::Memory::mutex = PTHREAD_MUTEX_INITIALIZER;
+  return 8 + (log2 - 6) * 4 + sub_bin;
+}
 
-void *snp::Memory::malloc(size_t size){
-  void *ptr = nullptr;
+void snp::Memory::binInsert(heap_arena *arena, heap_chunk *chunk)
+{
+  // Every available chunk passes here, also those too small for a bin
+  arena->free_size += CHUNK_SIZE(chunk);
+  arena->free_count++;
 
-  pthread_mutex_lock(&mutex);
+  // Too small to hold the links or the node in front of the size at the end
+  if (DATA_SIZE(chunk) < INDEXED_SIZE(arena))
+    return;
 
-  checkHeapIntegrity();
+  // The pages inside are given back once the chunk has stayed available for a while
+  char *start, *end;
+  if (releaseRange(chunk, &start, &end))
+  {
+    FREE_TIME(chunk) = arena->release_clock;
+    if (release_decay == 0)
+      releasePages(arena, chunk);
+  }
 
-  // If the heap is initialized, try to reuse a free chunk
-  if (heap_start)
-    ptr = findAvailableChunk(size);
+  if (arena->fit == FIT_ADDRESS)
+  {
+    arena->free_tree = treeInsert(arena->free_tree, chunk);
+    return;
+  }
 
-  // If there is no chunk available or it is the first allocation.
-  // Returns a nullptr if sbrk fails
-  if (ptr == nullptr)
-    ptr = createChunk(size);
+  free_links *links = FREE_LINKS(chunk);
+  links->prev = nullptr;
+
+  if (DATA_SIZE(chunk) >= LARGE_BIN_SIZE)
+  {
+    // Keep the large bin sorted by size, so the first fit is also the best fit
+    heap_chunk *next = arena->large_bin;
+    while (next != nullptr && DATA_SIZE(next) < DATA_SIZE(chunk))
+    {
+      links->prev = next;
+      next = FREE_LINKS(next)->next;
+    }
 
-  pthread_mutex_unlock(&mutex);
+    links->next = next;
+    if (next != nullptr)
+      FREE_LINKS(next)->prev = chunk;
+    if (links->prev != nullptr)
+      FREE_LINKS(links->prev)->next = chunk;
+    else
+      arena->large_bin = chunk;
 
-  return ptr;
+    return;
+  }
+
+  // Small bins are LIFO
+  int index = binIndex(DATA_SIZE(chunk));
+
+  links->next = arena->small_bins[index];
+  if (links->next != nullptr)
+    FREE_LINKS(links->next)->prev = chunk;
+
+  arena->small_bins[index] = chunk;
+  arena->small_bin_map |= (uint64_t) 1 << index;
 }
 
-void snp::Memory::free(void *ptr)
+void snp::Memory::binRemove(heap_arena *arena, heap_chunk *chunk)
 {
-  // If ptr is NULL, no operation should be performed (POSIX)
-  if (!ptr)
+  arena->free_size -= CHUNK_SIZE(chunk);
+  arena->free_count--;
+
+  // Has never been inserted
+  if (DATA_SIZE(chunk) < INDEXED_SIZE(arena))
     return;
 
-  pthread_mutex_lock(&mutex);
+  // The pages are used again or belong to a merged chunk now, which is given back as a whole later
+  char *start, *end;
+  if ((chunk->size & CHUNK_RELEASED) && releaseRange(chunk, &start, &end))
+  {
+    arena->released -= end - start;
+    chunk->size &= ~(size_t) CHUNK_RELEASED;
+  }
 
-  //printStatistics("BEFORE free()");
+  if (arena->fit == FIT_ADDRESS)
+  {
+    arena->free_tree = treeRemove(arena->free_tree, chunk);
+    return;
+  }
 
-  checkHeapIntegrity();
+  free_links *links = FREE_LINKS(chunk);
 
-  // Get the heap chunk holding ptr
-  auto *chunk = (heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE);
+  if (links->next != nullptr)
+    FREE_LINKS(links->next)->prev = links->prev;
 
-  // Out of memory check -> prevent that someone frees something that is not allocated
-  if (heap_start == nullptr || heap_end == nullptr || chunk < heap_start || chunk > heap_end)
-    exit(-1);
+  if (links->prev != nullptr)
+  {
+    FREE_LINKS(links->prev)->next = links->next;
+    return;
+  }
 
-  // Memory corruption check -> prevent that someone does free(ptr+5)
-  // The given ptr seems valid if we find the special number
-  if (chunk->corruption_check != MEMCHECK_NUMBER)
-    exit(-1);
+  // The chunk was the head of its bin
+  if (DATA_SIZE(chunk) >= LARGE_BIN_SIZE)
+  {
+    arena->large_bin = links->next;
+    return;
+  }
 
-  // Double free check:
-  // free is not possible if the chunk is already marked as available
-  if (chunk->available)
-    exit(-1);
+  int index = binIndex(DATA_SIZE(chunk));
+  arena->small_bins[index] = links->next;
+  if (links->next == nullptr)
+    arena->small_bin_map &= ~((uint64_t) 1 << index);
+}
 
-  chunk->available = 1;
+snp::Memory::heap_chunk *snp::Memory::binFind(heap_arena *arena, size_t size)
+{
+  heap_chunk *chunk;
 
-  // Merge with the previous and next chunk if they are marked available
-  chunk = mergeChunk(chunk);
+  if (arena->fit == FIT_ADDRESS)
+    return treeFind(arena->free_tree, size);
 
-  // Try to reduce the program break
-#if PAGESIZEALLOC == 1
-  if (chunk == heap_end && chunk != heap_start) { // -> there is still > 1 chunks overall
-    // We want to reduce the data size but not the struct, e.g.
-    // if 12300 would be the entire allocation size -> 12300 - 3*4096 = 12 bytes
-    // This will lead to corruption since the header needs 20 bytes
-    int pagesize = getpagesize() - HEAP_CHUNK_SIZE;
+  if (size < LARGE_BIN_SIZE)
+  {
+    int index = binIndex(size);
+
+    // The bin of the requested size also holds chunks that are a bit smaller
+    for (chunk = arena->small_bins[index]; chunk != nullptr; chunk = FREE_LINKS(chunk)->next)
+      if (DATA_SIZE(chunk) >= size)
+        return chunk;
+
+    // Every chunk in one of the following bins is big enough
+    // -> the lowest non-empty one wastes the least
+    uint64_t bigger_bins = arena->small_bin_map & ~(((uint64_t) 2 << index) - 1);
+    if (bigger_bins != 0)
+      return arena->small_bins[__builtin_ctzll(bigger_bins)];
+  }
 
-    // Decrement in multiples of page size, e.g.
-    // 3964  <= 4076 -> don't do anything
-    // 13000 -> 13000 - 3 * 4076 = 772
-    // 12228 -> 12228 - 3 * 4076 = 0 -> 4076
-    if (chunk->data_size > (size_t) pagesize) {
-      size_t pagesize_multiple = chunk->data_size / pagesize; // int div always does down round
-      size_t data_size_to_subtract = pagesize_multiple * pagesize;
+  for (chunk = arena->large_bin; chunk != nullptr; chunk = FREE_LINKS(chunk)->next)
+    if (DATA_SIZE(chunk) >= size)
+      return chunk;
 
-      chunk->data_size -= data_size_to_subtract;
+  return nullptr;
+}
 
-      // On error, (void *) -1 is returned, and errno is set to ENOMEM
-      if ((int) sbrk(-data_size_to_subtract) == -1)
-        exit(-1);
+snp::Memory::heap_chunk *snp::Memory::treeInsert(heap_chunk *root, heap_chunk *chunk)
+{
+  if (root == nullptr)
+  {
+    FREE_NODE(chunk)->left = nullptr;
+    FREE_NODE(chunk)->right = nullptr;
+    FREE_NODE(chunk)->max_size = DATA_SIZE(chunk);
+    return chunk;
+  }
+
+  // Insert below the root, then rotate the chunk up while its priority is higher
+  free_node *node = FREE_NODE(root);
+  if (chunk < root)
+  {
+    node->left = treeInsert(node->left, chunk);
+    if (treePriority(node->left) > treePriority(root))
+    {
+      heap_chunk *left = node->left;
+      node->left = FREE_NODE(left)->right;
+      FREE_NODE(left)->right = root;
+      treeUpdate(root);
+      root = left;
     }
   }
   else
-#endif
-  if (chunk == heap_end)
   {
-    //printStatistics("REDUCE sbrk");
+    node->right = treeInsert(node->right, chunk);
+    if (treePriority(node->right) > treePriority(root))
+    {
+      heap_chunk *right = node->right;
+      node->right = FREE_NODE(right)->left;
+      FREE_NODE(right)->left = root;
+      treeUpdate(root);
+      root = right;
+    }
+  }
 
-    // If there is no more previous chunk, we are just freeing heap_start -> set it null
-    if (chunk->prev == nullptr)
-      heap_start = nullptr;
-    else
-      chunk->prev->next = nullptr;
+  treeUpdate(root);
+  return root;
+}
 
-    // As we are eliminating this chunk, the new heap end is now the previous chunk
-    heap_end = chunk->prev;
+snp::Memory::heap_chunk *snp::Memory::treeRemove(heap_chunk *root, heap_chunk *chunk)
+{
+  // The chunk is in the tree, the search ends at it
+  if (root == chunk)
+    return treeMerge(FREE_NODE(chunk)->left, FREE_NODE(chunk)->right);
 
-    // On error, (void *) -1 is returned, and errno is set to ENOMEM
-    if ((int) sbrk(-(HEAP_CHUNK_SIZE + chunk->data_size)) == -1)
-      exit(-1);
+  free_node *node = FREE_NODE(root);
+  if (chunk < root)
+    node->left = treeRemove(node->left, chunk);
+  else
+    node->right = treeRemove(node->right, chunk);
+
+  treeUpdate(root);
+  return root;
+}
+
+snp::Memory::heap_chunk *snp::Memory::treeMerge(heap_chunk *left, heap_chunk *right)
+{
+  // Every chunk of the left tree lies in front of those of the right one
+  if (left == nullptr)
+    return right;
+  if (right == nullptr)
+    return left;
+
+  if (treePriority(left) > treePriority(right))
+  {
+    FREE_NODE(left)->right = treeMerge(FREE_NODE(left)->right, right);
+    treeUpdate(left);
+    return left;
   }
 
-  //printStatistics("AFTER free()");
+  FREE_NODE(right)->left = treeMerge(left, FREE_NODE(right)->left);
+  treeUpdate(right);
+  return right;
+}
+
+snp::Memory::heap_chunk *snp::Memory::treeFind(heap_chunk *root, size_t size)
+{
+  // Go left whenever a chunk there fits, so the first one that fits has the lowest address
+  heap_chunk *chunk = root;
+  while (chunk != nullptr && FREE_NODE(chunk)->max_size >= size)
+  {
+    heap_chunk *left = FREE_NODE(chunk)->left;
+    if (left != nullptr && FREE_NODE(left)->max_size >= size)
+      chunk = left;
+    else if (DATA_SIZE(chunk) >= size)
+      return chunk;
+    else
+      chunk = FREE_NODE(chunk)->right;
+  }
 
-  pthread_mutex_unlock(&mutex);
+  return nullptr;
 }
 
-void* snp::Memory::createChunk(size_t size)
+void snp::Memory::treeUpdate(heap_chunk *chunk)
 {
-  // Prevent that the sum of HEAP_CHUNK_SIZE + size overflows
-  auto size_t_max = (size_t)-1;
-  if (size > (size_t_max-HEAP_CHUNK_SIZE))
-    exit(-1);
+  free_node *node = FREE_NODE(chunk);
+  size_t max_size = DATA_SIZE(chunk);
 
-  size_t allocation_size = HEAP_CHUNK_SIZE + size;
+  if (node->left != nullptr && FREE_NODE(node->left)->max_size > max_size)
+    max_size = FREE_NODE(node->left)->max_size;
+  if (node->right != nullptr && FREE_NODE(node->right)->max_size > max_size)
+    max_size = FREE_NODE(node->right)->max_size;
 
-#if PAGESIZEALLOC == 1
-  // If a previous chunk was freed and is marked available at the heap end, let's reuse it.
-  // This also means allocating only the missing size now and then merging the old and the new chunk
-  // in order to get a chunk with the full size
-  if (heap_end != nullptr && heap_end->available)
-    allocation_size -= heap_end->data_size;
+  node->max_size = max_size;
+}
 
-  // Always allocate in multiples of memory pages (= 4096 bytes)
-  int pagesize = getpagesize();
+void snp::Memory::treeRelease(heap_arena *arena, heap_chunk *root)
+{
+  // Only chunks of more than a page can have whole pages inside, skip the subtrees without one
+  if (root == nullptr || FREE_NODE(root)->max_size <= (size_t) getpagesize())
+    return;
 
-  // If allocation_size is not already a multiple of page size,
-  // round up to the next page size
-  if (allocation_size % pagesize != 0)
-    allocation_size += pagesize - (allocation_size % pagesize);
-#endif
+  char *start, *end;
+  if (!(root->size & CHUNK_RELEASED) && releaseRange(root, &start, &end) &&
+      arena->release_clock - FREE_TIME(root) >= release_decay)
+    releasePages(arena, root);
 
-  auto *chunk = (heap_chunk *) sbrk(allocation_size);
+  treeRelease(arena, FREE_NODE(root)->left);
+  treeRelease(arena, FREE_NODE(root)->right);
+}
 
-  // On error, (void *) -1 is returned, and errno is set to ENOMEM
-  if ((int) chunk == -1)
+void snp::Memory::binRebuild(heap_arena *arena)
+{
+  // The lock is held: index the available chunks anew for fit_policy
+  for (int i = 0; i < SMALL_BIN_COUNT; i++)
+    arena->small_bins[i] = nullptr;
+  arena->small_bin_map = 0;
+  arena->large_bin = nullptr;
+  arena->free_tree = nullptr;
+  arena->free_size = 0;
+  arena->free_count = 0;
+  arena->fit = fit_policy;
+
+  for (heap_chunk *chunk = arena->heap_start; chunk != arena->heap_end; chunk = NEXT_CHUNK(chunk))
+    if (chunk->size & CHUNK_AVAILABLE)
+      binInsert(arena, chunk);
+}
+
+int snp::Memory::cacheIndex(size_t size)
+{
+  if (thread_cache_size == 0 || size > CACHE_MAX_DATA_SIZE)
+    return -1;
+
+  // Round up: every chunk in this class has at least index * CACHE_CLASS_SIZE bytes
+  int index = (size + CACHE_CLASS_SIZE - 1) / CACHE_CLASS_SIZE;
+
+  // The chunks of this class are too small to hold the cache entry
+  if ((size_t) index * CACHE_CLASS_SIZE < sizeof(cache_entry))
+    return -1;
+
+  return index;
+}
+
+void *snp::Memory::cachePop(int index)
+{
+  auto *entry = cache.entries[index];
+  if (entry == nullptr)
     return nullptr;
 
-  chunk->corruption_check = MEMCHECK_NUMBER;
-#if PAGESIZEALLOC == 1
-  chunk->data_size = allocation_size - HEAP_CHUNK_SIZE;
-#else
-  chunk->data_size = size;
-#endif
-  chunk->available = 0;
-  chunk->prev = heap_end; // null for the first chunk, otherwise the heap end until now
-  chunk->next = NULL;
+  cache.entries[index] = entry->next;
+  cache.length[index]--;
+  cache.size -= index * CACHE_CLASS_SIZE;
 
-  // First allocation -> we have a new heap start
-  if (heap_start == nullptr) {
-    heap_start = chunk;
-  }
+  // Heap overflow: the neighbors may change concurrently, only check the chunk itself.
+  // It is still in use and big enough for its class.
+  auto *chunk = (heap_chunk*) ((char*) entry - HEAP_CHUNK_SIZE);
+  if (hardening >= HARDENING_LOCAL && !isSlab(entry) &&
+      ((chunk->size & CHUNK_AVAILABLE) || DATA_SIZE(chunk) < (size_t) index * CACHE_CLASS_SIZE))
+    exit(-1);
 
-  // Not the first allocation -> append the new memory chunk to the chunk currently being the heap end
-  if (heap_end != nullptr) heap_end->next = chunk;
+  entry->owner = nullptr;
 
-  // The newly allocated mem chunk is now the new heap end
-  heap_end = chunk;
+  return entry;
+}
 
-  // Merge with a previous chunk if available
-  if (heap_end->prev != nullptr && heap_end->prev->available)
+bool snp::Memory::cachePush(void *ptr, size_t size)
+{
+  if (thread_cache_size == 0 || size < sizeof(cache_entry) ||
+      size >= CACHE_CLASS_COUNT * CACHE_CLASS_SIZE)
+    return false;
+
+  // Round down: the chunk has to fit every request of its class
+  int index = size / CACHE_CLASS_SIZE;
+  auto *entry = (cache_entry*) ptr;
+
+  // Double free check for cached chunks: they are still marked as used on the heap.
+  // The owner only matches by accident if the data was never changed after free,
+  // so search the class to be sure.
+  if (entry->owner == &cache)
+    for (auto *cached = cache.entries[index]; cached != nullptr; cached = cached->next)
+      if (cached == entry)
+        exit(-1);
+
+  if (cache.length[index] >= CACHE_CLASS_LENGTH)
+    cacheFlush(&cache, index, CACHE_CLASS_LENGTH / 2);
+
+  // Keep the footprint of the thread bounded
+  if (cache.size + index * CACHE_CLASS_SIZE > thread_cache_size)
+    return false;
+
+  cacheInsert(index, ptr);
+
+  return true;
+}
+
+void snp::Memory::cacheInsert(int index, void *ptr)
+{
+  cacheRegister();
+
+  auto *entry = (cache_entry*) ptr;
+
+  entry->owner = &cache;
+  entry->next = cache.entries[index];
+  cache.entries[index] = entry;
+  cache.length[index]++;
+  cache.size += index * CACHE_CLASS_SIZE;
+}
+
+void *snp::Memory::cacheRefill(heap_arena *arena, int index)
+{
+  size_t size = index * CACHE_CLASS_SIZE;
+
+  // Lock is held: allocate one chunk for the caller and a batch for later
+  void *ptr = allocateChunk(arena, size);
+
+  for (int i = 1; ptr != nullptr && i < CACHE_REFILL_COUNT; i++)
   {
-    //printStatistics("BEFORE malloc merge");
-    chunk = mergeChunk(chunk);
-    chunk->available = 0;
-    //printStatistics("AFTER malloc merge");
-  }
+    if (cache.length[index] >= CACHE_CLASS_LENGTH || cache.size + size > thread_cache_size)
+      break;
 
-  // If we have allocated more than needed, resize the current chunk to the actually
-  // requested size and move the remaining bytes to a new chunk for potential later use
-  if (chunk->data_size > size)
-    splitChunk(chunk, size);
+    void *cached = allocateChunk(arena, size);
+    if (cached == nullptr)
+      break;
 
-  //printStatistics("AFTER createChunk()");
+    // A chunk that was not split may be too big for this class, but it fits every request of it
+    cacheInsert(index, cached);
+  }
 
-  return chunk->data;
+  return ptr;
 }
 
-void* snp::Memory::findAvailableChunk(size_t size)
+void snp::Memory::cacheFlush(thread_cache *owner, int index, unsigned int count)
 {
-  heap_chunk *chunk = heap_start;
+  heap_arena *locked_arena = nullptr;
+  bool slab_locked = false;
 
-  while (chunk != nullptr)
+  // The class may hold both slab slots and heap chunks, take each lock once if needed
+  while (count-- > 0 && owner->entries[index] != nullptr)
   {
-    if (chunk->available && (chunk->data_size >= size))
+    auto *entry = owner->entries[index];
+
+    owner->entries[index] = entry->next;
+    owner->length[index]--;
+    owner->size -= index * CACHE_CLASS_SIZE;
+
+    if (isSlab(entry))
     {
-      splitChunk(chunk, size);
-      chunk->available = 0;
-      return chunk->data;
+      // The slab lock comes before any arena lock
+      if (!slab_locked && locked_arena != nullptr)
+      {
+        pthread_mutex_unlock(&locked_arena->mutex);
+        locked_arena = nullptr;
+      }
+      if (!slab_locked)
+        pthread_mutex_lock(&slab_mutex);
+      slab_locked = true;
+
+      slabFreeSlot(entry);
     }
+    else
+    {
+      // The chunk may come from any arena
+      auto *chunk = (heap_chunk*) ((char*) entry - HEAP_CHUNK_SIZE);
+      heap_arena *arena = arenaOf(chunk);
+
+      // The cache of a thread left behind by fork goes back right away, the child is alone
+      if (arena != thread_arena && owner == &cache && remotePush(arena, chunk))
+        continue;
+
+      if (arena != locked_arena)
+      {
+        if (locked_arena != nullptr)
+          pthread_mutex_unlock(&locked_arena->mutex);
+        arenaLock(arena);
+        locked_arena = arena;
 
-    chunk = chunk->next;
+        remoteDrain(arena);
+      }
+
+      releaseChunk(arena, chunk);
+    }
   }
 
-  return nullptr;
+  if (slab_locked)
+    pthread_mutex_unlock(&slab_mutex);
+  if (locked_arena != nullptr)
+    pthread_mutex_unlock(&locked_arena->mutex);
+}
+
+void snp::Memory::cacheRegister()
+{
+  // Make sure the cached chunks and the counts are handed over once the thread exits
+  if (!cache.registered)
+  {
+    // Set first: pthread_setspecific may allocate memory and get here again. The paths that
+    // cache or count under a lock call this before they take it, the allocation would deadlock.
+    cache.registered = 1;
+    pthread_once(&cache_key_once, cacheCreateKey);
+    pthread_setspecific(cache_key, &cache);
+
+    // Once the exit handler has run, the memory of the cache may soon belong to another thread
+    if (!cache.exited)
+    {
+      cache.counts = &counts;
+
+      pthread_mutex_lock(&cache_mutex);
+      cache.prev = nullptr;
+      cache.next = cache_threads;
+      if (cache_threads != nullptr)
+        cache_threads->prev = &cache;
+      cache_threads = &cache;
+      pthread_mutex_unlock(&cache_mutex);
+    }
+  }
+}
+
+void snp::Memory::cacheCreateKey()
+{
+  pthread_key_create(&cache_key, cacheDestroy);
+}
+
+void snp::Memory::cacheDestroy(void *)
+{
+  // Called on thread exit: give all cached chunks back to the heap
+  for (int index = 0; index < CACHE_CLASS_COUNT; index++)
+    if (cache.entries[index] != nullptr)
+      cacheFlush(&cache, index, CACHE_CLASS_LENGTH);
+
+  countFlush();
+
+  traceExit();
+
+  if (!cache.exited)
+  {
+    pthread_mutex_lock(&cache_mutex);
+    if (cache.prev != nullptr)
+      cache.prev->next = cache.next;
+    else
+      cache_threads = cache.next;
+    if (cache.next != nullptr)
+      cache.next->prev = cache.prev;
+    pthread_mutex_unlock(&cache_mutex);
+
+    cache.exited = 1;
+  }
+
+  // A later free on this thread registers the cache again, so the handler runs once more
+  cache.registered = 0;
 }
 
-void snp::Memory::splitChunk(heap_chunk *chunk, size_t size)
+int snp::Memory::countClass(size_t size)
 {
-  // Building a new chunk only makes sense if there is still space
-  // left for some data to store, so > than just HEAP_CHUNK_SIZE
-  if ((chunk->data_size - size) <= HEAP_CHUNK_SIZE) {
+  // The classes of the bins, everything from the large bin on is one class
+  return size < LARGE_BIN_SIZE ? binIndex(size) : SMALL_BIN_COUNT;
+}
+
+// Always inlined, so the return address is the one of the function that allocates for the program
+__attribute__((always_inline)) inline void snp::Memory::countAlloc(void *ptr)
+{
+  if (ptr == nullptr)
     return;
+
+  // Counted by the usable size, so the allocation and the free of a chunk end up in the same class
+  size_t size = isSlab(ptr) ? slabSize(ptr) : DATA_SIZE((heap_chunk*) ((char*) ptr - HEAP_CHUNK_SIZE));
+
+  counts.allocs[countClass(size)]++;
+  if (++counts.pending >= STATS_FLUSH_INTERVAL)
+    countFlush();
+
+  if (__builtin_expect(profile_rate != 0, 0))
+    profileAlloc(ptr, size, __builtin_return_address(0));
+}
+
+void snp::Memory::countFree(void *ptr, size_t size)
+{
+  counts.frees[countClass(size)]++;
+  if (++counts.pending >= STATS_FLUSH_INTERVAL)
+    countFlush();
+
+  // Sampled chunks stay known until they are freed, also when the profiler is turned off
+  if (__builtin_expect(__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0, 0))
+    profileFree(ptr);
+}
+
+void snp::Memory::countFlush()
+{
+  // The thread counts without any atomics and only adds its counts to the totals now and then
+  for (int i = 0; i < STATS_CLASS_COUNT; i++)
+  {
+    if (counts.allocs[i] != 0)
+      __atomic_fetch_add(&class_allocs[i], counts.allocs[i], __ATOMIC_RELAXED);
+    if (counts.frees[i] != 0)
+      __atomic_fetch_add(&class_frees[i], counts.frees[i], __ATOMIC_RELAXED);
+
+    counts.allocs[i] = 0;
+    counts.frees[i] = 0;
   }
 
-  auto *new_chunk = (heap_chunk *) (chunk->data + size);
+  counts.pending = 0;
+
+  // The counts of the last operations are flushed on thread exit
+  cacheRegister();
+}
+
+void snp::Memory::forkPrepare()
+{
+  // Take every lock, so the child does not inherit one that is held by a thread that
+  // does not exist there. Same order as everywhere else: slab before arena before mmap before profile.
+  pthread_mutex_lock(&arena_mutex);
+  pthread_mutex_lock(&slab_mutex);
+
+  for (int i = 0; i < MAX_ARENAS; i++)
+    if (__atomic_load_n(&arenas[i].initialized, __ATOMIC_ACQUIRE))
+      pthread_mutex_lock(&arenas[i].mutex);
+
+  pthread_mutex_lock(&mmap_mutex);
+  pthread_mutex_lock(&profile_mutex);
+  pthread_mutex_lock(&quarantine_mutex);
+  pthread_mutex_lock(&cache_mutex);
+}
+
+void snp::Memory::forkParent()
+{
+  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&quarantine_mutex);
+  pthread_mutex_unlock(&profile_mutex);
+  pthread_mutex_unlock(&mmap_mutex);
+
+  for (int i = MAX_ARENAS - 1; i >= 0; i--)
+    if (arenas[i].initialized)
+      pthread_mutex_unlock(&arenas[i].mutex);
+
+  pthread_mutex_unlock(&slab_mutex);
+  pthread_mutex_unlock(&arena_mutex);
+}
+
+void snp::Memory::forkChild()
+{
+  // The child has only the forking thread, which holds all the locks.
+  // They are made anew instead of unlocked, as the C library does for its malloc.
+  pthread_mutex_init(&arena_mutex, nullptr);
+  pthread_mutex_init(&slab_mutex, nullptr);
+
+  for (int i = 0; i < MAX_ARENAS; i++)
+    if (arenas[i].initialized)
+      pthread_mutex_init(&arenas[i].mutex, nullptr);
+
+  pthread_mutex_init(&mmap_mutex, nullptr);
+  pthread_mutex_init(&profile_mutex, nullptr);
+  pthread_mutex_init(&quarantine_mutex, nullptr);
+  pthread_mutex_init(&cache_mutex, nullptr);
 
-  new_chunk->corruption_check = MEMCHECK_NUMBER;
-  new_chunk->data_size = chunk->data_size - size - HEAP_CHUNK_SIZE;
-  new_chunk->available = 1;
+  traceFork();
 
-  // Insert the new chunk between the previous and the next one
-  new_chunk->prev = chunk;
-  new_chunk->next = chunk->next;
+  // The other threads are gone, give back the chunks in their caches and add up their counts.
+  // The caches are only changed by their threads without a lock: a thread that was moving
+  // a chunk between its cache and the heap right now only loses that chunk.
+  thread_cache *other = cache_threads;
+  cache_threads = nullptr;
 
-  // Also update the mappings of our neighbors
-  if (chunk->next != nullptr)
-    chunk->next->prev = new_chunk;
+  while (other != nullptr)
+  {
+    thread_cache *next = other->next;
 
-  chunk->next = new_chunk;
+    if (other != &cache)
+    {
+      for (int index = 0; index < CACHE_CLASS_COUNT; index++)
+        cacheFlush(other, index, (unsigned int) -1);
+
+      for (int i = 0; i < STATS_CLASS_COUNT; i++)
+      {
+        class_allocs[i] += other->counts->allocs[i];
+        class_frees[i] += other->counts->frees[i];
+      }
+    }
 
-  // If the chunk that we just have split was the last one, the new one is now the heap end
-  // e.g., if this was the first malloc ever and we have allocated more than needed -> heap_end == chunk
-  if (chunk == heap_end)
-    heap_end = new_chunk;
+    other = next;
+  }
 
-  // The old chunk is now resized
-  chunk->data_size = size;
+  if (cache.registered && !cache.exited)
+  {
+    cache.prev = nullptr;
+    cache.next = nullptr;
+    cache_threads = &cache;
+  }
 }
 
-snp::Memory::heap_chunk* snp::Memory::mergeChunk(heap_chunk *chunk)
+void snp::Memory::setOption(Option option, size_t value)
 {
-  heap_chunk *prev = chunk->prev;
-  heap_chunk *next = chunk->next;
+  switch (option)
+  {
+    case THREAD_CACHE_SIZE:
+      thread_cache_size = value;
+      break;
+
+    case MMAP_THRESHOLD:
+      mmap_threshold = value;
+      break;
+
+    case GROW_SPAN:
+      grow_span = value;
+      break;
+
+    case TRIM_THRESHOLD:
+      trim_threshold = value;
+      break;
+
+    case RELEASE_DECAY:
+      release_decay = value;
+      break;
+
+    case PROFILE_RATE:
+      profile_rate = value;
+      break;
+
+    case SLAB_MAX_SIZE:
+      slab_max_size = value < SLAB_CLASS_COUNT * SLAB_CLASS_SIZE ? value : (SLAB_CLASS_COUNT - 1) * SLAB_CLASS_SIZE;
+      break;
+
+    case ARENA_COUNT:
+      __atomic_store_n(&arena_count, value < 1 ? 1 : value > MAX_ARENAS ? MAX_ARENAS : (int) value, __ATOMIC_RELAXED);
+      break;
+
+    case ARENA_BY_CPU:
+      arena_by_cpu = value != 0;
+      break;
+
+    case ARENA_BY_NODE:
+    case NODE_COUNT:
+      pthread_mutex_lock(&arena_mutex);
+
+      if (option == ARENA_BY_NODE)
+        arena_by_node = value != 0;
+      else
+        node_fake = value < MAX_NODES ? value : MAX_NODES;
+
+      if (arena_by_node)
+      {
+        readTopology();
+
+        // Arenas that were in use before are bound as well, for the pages they touch from now on
+        for (int i = 1; i <= node_count; i++)
+          if (arenas[i].initialized)
+            bindArena(&arenas[i]);
+      }
+
+      pthread_mutex_unlock(&arena_mutex);
+      break;
+
+    case REMOTE_FREE:
+      remote_free = value != 0;
+      break;
+
+    case HARDENING_LEVEL:
+      hardening = value > HARDENING_FULL ? (int) HARDENING_FULL : (int) value;
+      break;
+
+    case HARDENING_INTERVAL:
+      hardening_interval = value < 1 ? 1 : value;
+      break;
+
+    case FIT_POLICY:
+      // The arenas in use index their available chunks anew, new ones start with the policy
+      pthread_mutex_lock(&arena_mutex);
+      fit_policy = value == FIT_ADDRESS ? FIT_ADDRESS : FIT_BINS;
+
+      for (int i = 0; i < MAX_ARENAS; i++)
+      {
+        if (!arenas[i].initialized || arenas[i].fit == fit_policy)
+          continue;
+
+        pthread_mutex_lock(&arenas[i].mutex);
+        binRebuild(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].mutex);
+      }
+
+      pthread_mutex_unlock(&arena_mutex);
+      break;
+
+    case GUARD_RATE:
+      guard_rate = value;
+      break;
+
+    case QUARANTINE_SIZE:
+      // What is held back beyond the new size is freed right away
+      quarantine_size = value;
+      quarantineEvict(value);
+      break;
+
+    case POISON_FREED:
+      poison_freed = value != 0;
+      break;
+  }
+}
 
-  // Merge NEXT heap CHUNK INTO CURRENT one if it is unused
-  if (next != nullptr && next->available)
+void snp::Memory::checkOperation(heap_arena *arena)
+{
+  // Called once per locked operation, the lock is held
+  if (hardening == HARDENING_FULL)
   {
-    // The data size of the current chunk increases by the entire size of the next chunk
-    // FIXME: chunk->data_size will overflow if the resulting sum is > (size_t)-1
-    chunk->data_size += HEAP_CHUNK_SIZE + next->data_size;
+    checkHeapIntegrity(arena);
+  }
+  else if (hardening == HARDENING_SAMPLED && ++arena->operation_count >= hardening_interval)
+  {
+    arena->operation_count = 0;
+    checkHeapIntegrity(arena);
+  }
+}
+
+void snp::Memory::checkChunkIntegrity(heap_arena *arena, heap_chunk *chunk)
+{
+  Chunk::checkChunk(arena->heap_start, arena->heap_end, chunk);
+}
+
+void snp::Memory::checkHeapIntegrity(heap_arena *arena)
+{
+  Chunk::checkHeap(arena->heap_start, arena->heap_end);
+}
+
+snp::Memory::Stats snp::Memory::getStats()
+{
+  Stats stats = {};
 
-    // Also update the mappings of our neighbors
-    chunk->next = next->next;
-    if (chunk->next != nullptr)
-      chunk->next->prev = chunk;
+  // The counts of this thread are added right away, those of the others within a few operations
+  countFlush();
 
-    // If the chunk to merge is the last chunk of the heap,
-    // the current one becomes the new heap end
-    if (next == heap_end)
-      heap_end = chunk;
+  for (int i = 0; i < STATS_CLASS_COUNT; i++)
+  {
+    stats.allocs[i] = __atomic_load_n(&class_allocs[i], __ATOMIC_RELAXED);
+    stats.frees[i] = __atomic_load_n(&class_frees[i], __ATOMIC_RELAXED);
   }
 
-  // Merge CURRENT heap CHUNK INTO PREVIOUS one if it is unused
-  if (prev != nullptr && prev->available)
+  for (int i = 0; i < MAX_ARENAS; i++)
   {
-    // Go back one chunk by making the current heap chunk the next one
-    // and the previous one the new current
-    next = chunk;
-    chunk = prev;
+    heap_arena *arena = &arenas[i];
+    if (!__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE))
+      continue;
+
+    // Not counted as an arena lock, nothing is allocated here
+    pthread_mutex_lock(&arena->mutex);
+
+    // The chunks lie back to back, everything that is not available is in use
+    size_t used = 0;
+    if (arena->heap_start != nullptr)
+      used = (char*) arena->heap_end - (char*) arena->heap_start - arena->free_size;
+
+    stats.used += used;
+    stats.free += arena->free_size;
+    stats.used_chunks += arena->used_count;
+    stats.free_chunks += arena->free_count;
+
+    size_t committed = arenaCommitted(arena);
+    if (i == 0)
+      stats.sbrk += committed;
+    else
+      stats.mmap += committed;
+    stats.resident += committed - arena->released;
 
-    // The data size of the previous chunk increases by the entire size of this chunk
-    // FIXME: chunk->data_size will overflow if the resulting sum is > (size_t)-1
-    chunk->data_size += HEAP_CHUNK_SIZE + next->data_size;
+    // Node n has arena n + 1
+    if (arena_by_node && i >= 1 && i <= node_count)
+    {
+      stats.nodes[i - 1].used = used;
+      stats.nodes[i - 1].free = arena->free_size;
+      stats.nodes[i - 1].resident = committed - arena->released;
+    }
 
-    // Also update the mappings of our neighbors
-    chunk->next = next->next;
-    if (chunk->next != nullptr)
-      chunk->next->prev = chunk;
+    stats.locks += arena->lock_count;
+    stats.lock_contended += arena->lock_contended;
+    stats.lock_wait_ns += arena->lock_wait;
 
-    // If the chunk to merge is the last chunk of the heap,
-    // the previous one becomes the new heap end
-    if (next == heap_end)
-      heap_end = chunk;
+    pthread_mutex_unlock(&arena->mutex);
   }
 
-  return chunk;
+  pthread_mutex_lock(&slab_mutex);
+  stats.slab = slab_runs_used * SLAB_RUN_SIZE;
+  pthread_mutex_unlock(&slab_mutex);
+
+  pthread_mutex_lock(&mmap_mutex);
+  stats.mapped = mmap_size;
+  stats.mapped_chunks = mmap_count;
+  pthread_mutex_unlock(&mmap_mutex);
+
+  pthread_mutex_lock(&quarantine_mutex);
+  stats.quarantined = quarantine_bytes;
+  stats.quarantined_chunks = quarantine_count;
+  pthread_mutex_unlock(&quarantine_mutex);
+
+  stats.mmap += stats.mapped + stats.slab;
+  stats.resident += stats.mapped + stats.slab;
+
+  if (arena_by_node)
+    stats.node_count = node_count;
+
+  return stats;
 }
 
-void snp::Memory::checkHeapIntegrity()
+size_t snp::Memory::statsClassSize(int index)
 {
-  heap_chunk *chunk = heap_start;
+  // The inverse of binIndex
+  if (index < 8)
+    return index < 0 ? 0 : index * 8;
+  if (index >= SMALL_BIN_COUNT)
+    return LARGE_BIN_SIZE;
+
+  int log2 = (index - 8) / 4 + 6;
+  return ((size_t) 1 << log2) + ((size_t) ((index - 8) % 4) << (log2 - 2));
+}
 
-  while (chunk != nullptr)
+void snp::Memory::dumpFlush(dump_writer *writer)
+{
+  size_t written = 0;
+  while (written < writer->length)
   {
-    // Heap overflow: Detect when MEMCHECK_NUMBER was overwritten
-    if (chunk->corruption_check != MEMCHECK_NUMBER)
-      exit(-1);
-
-    // == Prevent manipulation of data_size ==
+    ssize_t count = write(writer->fd, writer->buffer + written, writer->length - written);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      break;
+    written += count;
+  }
 
-    // 1) Ensure that the next chunk starts immediately after the current one ends
-    char *chunk_end = chunk->data + chunk->data_size; // == potential next chunk start
-    if (chunk->next != nullptr && (char*) chunk->next != chunk_end)
-      exit(-1);
+  writer->length = 0;
+}
 
-    // 2) If there is no next chunk, ensure there is not more allocated than what we have requested
-    // FIXME: This would actually be good but we should not use sbrk(0) more than once
-    //  Probably keep the real heap end in an extra variable instead?
-    /*if (chunk->next == nullptr && (sbrk(0) != chunk_end))
-      exit(-1);*/
+void snp::Memory::dumpWrite(dump_writer *writer, const char *format, ...)
+{
+  // No line is longer than this
+  if (sizeof(writer->buffer) - writer->length < 256)
+    dumpFlush(writer);
 
-    // == Prevent manipulation of prev or next pointer ==
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(writer->buffer + writer->length, sizeof(writer->buffer) - writer->length, format, args);
+  va_end(args);
 
-    // 1) prev ptr has to be located between heap_start and the current chunk
-    if (chunk->prev != nullptr && (chunk->prev < heap_start || chunk->prev > chunk))
-      exit(-1);
+  if (length > 0)
+    writer->length += (size_t) length < sizeof(writer->buffer) - writer->length ? length : sizeof(writer->buffer) - writer->length - 1;
+}
 
-    // 2) next ptr has to be located between the current chunk and heap_end
-    if (chunk->next != nullptr && (chunk->next < chunk || chunk->next > heap_end))
-      exit(-1);
+void snp::Memory::dumpStats(int fd, bool json)
+{
+  Stats stats = getStats();
+
+  const char *names[] = {"used", "free", "used_chunks", "free_chunks", "sbrk", "mmap",
+                         "resident", "mapped", "mapped_chunks", "slab", "quarantined", "quarantined_chunks"};
+  size_t values[] = {stats.used, stats.free, stats.used_chunks, stats.free_chunks, stats.sbrk, stats.mmap,
+                     stats.resident, stats.mapped, stats.mapped_chunks, stats.slab, stats.quarantined,
+                     stats.quarantined_chunks};
+
+  // Text: one "name value" per line, "class size allocs frees" for every class that was used
+  // and "node index used free resident" for every node with ARENA_BY_NODE.
+  // JSON: a single object with the same names, a "classes" and a "nodes" array.
+  dump_writer writer;
+  writer.fd = fd;
+  writer.length = 0;
+
+  dumpWrite(&writer, json ? "{" : "");
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    dumpWrite(&writer, json ? "\"%s\":%zu," : "%s %zu\n", names[i], values[i]);
+
+  dumpWrite(&writer, json ? "\"locks\":%llu,\"lock_contended\":%llu,\"lock_wait_ns\":%llu,\"classes\":[" :
+                             "locks %llu\nlock_contended %llu\nlock_wait_ns %llu\n",
+             (unsigned long long) stats.locks, (unsigned long long) stats.lock_contended,
+             (unsigned long long) stats.lock_wait_ns);
+
+  bool first = true;
+  for (int i = 0; i < STATS_CLASS_COUNT; i++)
+  {
+    if (stats.allocs[i] == 0 && stats.frees[i] == 0)
+      continue;
 
-    chunk = chunk->next;
+    dumpWrite(&writer, json ? "%s{\"size\":%zu,\"allocs\":%zu,\"frees\":%zu}" : "%sclass %zu %zu %zu\n",
+               json && !first ? "," : "", statsClassSize(i), stats.allocs[i], stats.frees[i]);
+    first = false;
   }
+
+  dumpWrite(&writer, json ? "],\"nodes\":[" : "");
+  for (int i = 0; i < stats.node_count; i++)
+    dumpWrite(&writer, json ? "%s{\"node\":%d,\"used\":%zu,\"free\":%zu,\"resident\":%zu}" : "%snode %d %zu %zu %zu\n",
+               json && i > 0 ? "," : "", i, stats.nodes[i].used, stats.nodes[i].free, stats.nodes[i].resident);
+
+  dumpWrite(&writer, json ? "]}\n" : "");
+  dumpFlush(&writer);
 }
 
 void snp::Memory::printStatistics(const char *title)
 {
-  printf("================\n");
+  // Takes no arena lock, so it can also be called from within the allocator.
+  // Whatever the program has buffered for stdout comes first.
+  fflush(stdout);
+
+  dump_writer writer;
+  writer.fd = STDOUT_FILENO;
+  writer.length = 0;
+
+  dumpWrite(&writer, "================\n");
   if (title)
-    printf("STATUS    : %s\n", title);
-  printf("HEAP START: %p\n", heap_start);
-  printf("HEAP END  : %p\n", heap_end);
-  printf("sbrk      : %p\n", sbrk(0));
+    dumpWrite(&writer, "STATUS    : %.200s\n", title);
+  dumpWrite(&writer, "sbrk      : %p\n", sbrk(0));
 
-  heap_chunk *chunk = heap_start;
-  while (chunk != nullptr)
+  for (int i = 0; i < MAX_ARENAS; i++)
   {
-    printf("------------\n");
-    printf("%p: corruption_check: %d\n", chunk, chunk->corruption_check);
-    printf("%p: data size: %zu\n", chunk, chunk->data_size);
-    printf("%p: available: %d\n", chunk, chunk->available);
-    printf("%p: prev: %p\n", chunk, chunk->prev);
-    printf("%p: next: %p\n", chunk, chunk->next);
-    printf("%p: data: %p\n", chunk, chunk->data);
+    heap_arena *arena = &arenas[i];
+    if (!arena->initialized)
+      continue;
+
+    // Committed: taken from the OS, resident: without the pages given back inside available chunks
+    size_t committed = arenaCommitted(arena);
+
+    dumpWrite(&writer, "ARENA     : %d\n", i);
+    dumpWrite(&writer, "HEAP START: %p\n", arena->heap_start);
+    dumpWrite(&writer, "HEAP END  : %p\n", arena->heap_end);
+    dumpWrite(&writer, "COMMITTED : %zu\n", committed);
+    dumpWrite(&writer, "RESIDENT  : %zu\n", committed - arena->released);
+    dumpWrite(&writer, "FREE      : %zu in %zu chunks\n", arena->free_size, arena->free_count);
+    dumpWrite(&writer, "LOCKS     : %llu, %llu contended\n",
+               (unsigned long long) arena->lock_count, (unsigned long long) arena->lock_contended);
+
+    // Stops at a broken size, so the statistics can also be printed after a corruption
+    heap_chunk *chunk = arena->heap_start;
+    while (chunk != arena->heap_end)
+    {
+      dumpWrite(&writer, "------------\n");
+      dumpWrite(&writer, "%p: size: %zu\n", chunk, CHUNK_SIZE(chunk));
+      dumpWrite(&writer, "%p: data size: %zu\n", chunk, DATA_SIZE(chunk));
+      dumpWrite(&writer, "%p: available: %d\n", chunk, (chunk->size & CHUNK_AVAILABLE) != 0);
+      dumpWrite(&writer, "%p: prev available: %d\n", chunk, (chunk->size & CHUNK_PREV_AVAILABLE) != 0);
+      dumpWrite(&writer, "%p: released: %d\n", chunk, (chunk->size & CHUNK_RELEASED) != 0);
+      dumpWrite(&writer, "%p: data: %p\n", chunk, chunk->data);
+
+      if (CHUNK_SIZE(chunk) < MALLOC_ALIGNMENT ||
+          CHUNK_SIZE(chunk) > (size_t) ((char*) arena->heap_end - (char*) chunk))
+        break;
+
+      chunk = NEXT_CHUNK(chunk);
+    }
 
-    chunk = chunk->next;
+    dumpWrite(&writer, "------------\n");
   }
 
-  printf("================\n\n");
+  // Mapped chunks are not part of any arena
+  pthread_mutex_lock(&mmap_mutex);
+  dumpWrite(&writer, "MAPPED    : %zu in %zu chunks\n", mmap_size, mmap_count);
+  pthread_mutex_unlock(&mmap_mutex);
+
+  dumpWrite(&writer, "================\n\n");
+  dumpFlush(&writer);
 }
@@ -1,43 +1,658 @@
 #ifndef SNP_MEMORY_H_
 #define SNP_MEMORY_H_
 
+#include <new>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "chunk.h"
 
 namespace snp {
   class Memory
   {
 
   private:
-      typedef struct heap_chunk
-      {
-          int corruption_check;
-          size_t data_size;
-          int available;
-          struct heap_chunk *prev;
-          struct heap_chunk *next;
-          char data[0]; // array of variable size
-      } heap_chunk;
-
-      static heap_chunk *heap_start;
-      static heap_chunk *heap_end;
-      static pthread_mutex_t mutex;
-
-      static void* createChunk(size_t size);
-      static void* findAvailableChunk(size_t size);
-      static void splitChunk(heap_chunk *chunk, size_t size);
-      static heap_chunk *mergeChunk(heap_chunk *chunk);
-      static void checkHeapIntegrity();
+      // The chunks of an arena lie back to back, see chunk.h
+      typedef snp::heap_chunk heap_chunk;
+
+      // Available chunks are additionally linked into size-class bins.
+      // The links are stored in the unused data area of the chunk in front of
+      // the size at its end, so chunks with less data than that are not binned
+      // at all and only become reusable again after being merged with a neighbor.
+      // Available chunks with whole pages inside also store when they became available
+      // behind the links, and those pages are given back to the OS after a while.
+      typedef snp::free_links free_links;
+
+      // With FIT_ADDRESS the available chunks are not binned but form a treap ordered by
+      // address, with a priority hashed from the address. Each node knows the biggest
+      // data size below it, so the lowest chunk that fits is found in O(log n).
+      typedef struct free_node
+      {
+          heap_chunk *left;
+          heap_chunk *right;
+          size_t max_size;
+      } free_node;
+
+      // Small bins: one per 8 bytes below 64 bytes, then 4 sub-bins per power of two
+      static const int SMALL_BIN_COUNT = 64;
+      // Chunks with at least this data size go into the size-sorted large bin
+      static const size_t LARGE_BIN_SIZE = (size_t) 1 << 20;
+
+      // Chunks freed by a thread are kept in a cache of that thread first,
+      // so most malloc/free pairs do not need to take the mutex. The entry is
+      // stored in the data area of the chunk, which is still marked as used
+      // on the heap. Each class holds at most CACHE_CLASS_LENGTH chunks of
+      // CACHE_CLASS_SIZE * index bytes, an empty class is refilled with
+      // CACHE_REFILL_COUNT chunks at once.
+      static const int CACHE_CLASS_COUNT = 65;
+      static const int CACHE_CLASS_SIZE = 16;
+      static const unsigned int CACHE_CLASS_LENGTH = 16;
+      static const int CACHE_REFILL_COUNT = 8;
+
+      struct thread_cache;
+      struct thread_counts;
+
+      typedef struct cache_entry
+      {
+          struct cache_entry *next;
+          struct thread_cache *owner;
+      } cache_entry;
+
+      typedef struct thread_cache
+      {
+          cache_entry *entries[CACHE_CLASS_COUNT];
+          unsigned int length[CACHE_CLASS_COUNT];
+          size_t size; // class sizes of all cached chunks
+          int registered; // the thread exit handler is installed
+          int exited; // the exit handler has run, the cache is no longer listed
+
+          // All caches of threads that have not exited, so the child of a fork
+          // can give back what the threads that did not come along left behind
+          struct thread_cache *prev;
+          struct thread_cache *next;
+          struct thread_counts *counts;
+      } thread_cache;
+
+      // Requests of up to SLAB_MAX_SIZE bytes are served from slab runs: blocks of
+      // SLAB_RUN_SIZE bytes in a reserved region, each split into slots of one
+      // size class. The run descriptors are kept apart from the runs, so the
+      // slots carry no header at all.
+      static const int SLAB_CLASS_SIZE = 16;
+      static const int SLAB_CLASS_COUNT = 17; // 16..256 bytes, class 0 is unused
+      static const size_t SLAB_RUN_SIZE = 4096;
+
+      typedef struct slab_run
+      {
+          struct slab_run *prev; // runs of the same class with free slots, or unused runs
+          struct slab_run *next;
+          unsigned short size_class; // 0 if the run is unused
+          unsigned short free_slots;
+          uint32_t free_map[SLAB_RUN_SIZE / SLAB_CLASS_SIZE / 32]; // bit set -> slot is free
+      } slab_run;
+
+      static char *slab_base;
+      static slab_run *slab_runs;
+      static size_t slab_run_count; // runs handed out so far, the rest is untouched
+      static slab_run *slab_partial[SLAB_CLASS_COUNT];
+      static slab_run *slab_unused;
+      static size_t slab_runs_used;
+      static size_t slab_max_size;
+      static int slab_reserved;
+      static pthread_mutex_t slab_mutex;
+
+      // The heap is split into arenas, each with its own chunk list, bins and lock.
+      // Arena 0 grows with sbrk, the others within an address range reserved with mmap.
+      // Threads are assigned to the arenas round-robin, by the CPU they run on or by its
+      // NUMA node. With ARENA_BY_NODE, node n has arena n + 1, whose range is bound to it.
+      static const int MAX_ARENAS = 16;
+      static const int MAX_CPUS = 1024;
+
+      typedef struct heap_arena
+      {
+          heap_chunk *heap_start;
+          heap_chunk *heap_end; // end marker behind the last chunk: a header of size 0
+          pthread_mutex_t mutex;
+
+          heap_chunk *small_bins[SMALL_BIN_COUNT];
+          uint64_t small_bin_map; // bit i is set if small_bins[i] is not empty
+          heap_chunk *large_bin;
+          heap_chunk *free_tree; // FIT_ADDRESS: root of the treap instead of the bins
+          int fit; // the Fit the chunks are indexed for
+
+          size_t operation_count; // for HARDENING_SAMPLED
+
+          // Chunks freed by threads of other arenas: a lock-free stack that is
+          // linked through the data area and drained by whoever holds the lock
+          heap_chunk *remote_frees;
+          unsigned int remote_count;
+
+          char *heap_base; // start of the memory of the first chunk, in front of its alignment padding
+
+          // Arena 0 takes memory with sbrk in spans that grow geometrically, the others
+          // have a reserved range. The memory behind the heap is used by the next growth,
+          // and is only given back once there is more of it than the trim threshold.
+          char *region_start; // reserved range, unused by arena 0
+          char *region_top; // end of the memory in use
+          char *region_end; // end of the reserved range, the program break set by arena 0
+          size_t next_span; // bytes arena 0 takes with the next sbrk
+
+          char *clean; // the memory from here on is known to be zero
+          char *zero_start; // zero memory of the chunk allocated last, for calloc
+          char *zero_end;
+
+          // Whole pages inside available chunks are given back with madvise once
+          // the chunks have stayed free for RELEASE_DECAY milliseconds
+          size_t released; // bytes given back this way
+          size_t release_count; // operations since the clock was read
+          uint64_t release_clock; // ms, when the clock was read last
+          uint64_t release_sweep; // ms, when the bins are searched for old chunks next
+
+          // Counters for getStats, maintained under the lock
+          size_t free_size; // whole size of the available chunks
+          size_t free_count;
+          size_t used_count; // chunks in use, cached ones included
+          uint64_t lock_count;
+          uint64_t lock_contended; // the lock was held by someone else
+          uint64_t lock_wait; // ns spent waiting for it
+          int initialized;
+      } heap_arena;
+
+      // The bins or tree of an arena as the index of the chunk functions in chunk.h
+      typedef struct arena_index
+      {
+          heap_arena *arena;
+
+          void insert(heap_chunk *chunk) { binInsert(arena, chunk); }
+          void remove(heap_chunk *chunk) { binRemove(arena, chunk); }
+      } arena_index;
+
+      static heap_arena arenas[MAX_ARENAS];
+      static int arena_count; // arenas in use, 0 until the first assignment
+      static int arena_by_cpu;
+      static int arena_by_node;
+      static int remote_free;
+      static unsigned int arena_next;
+      static pthread_mutex_t arena_mutex;
+      static __thread heap_arena *thread_arena;
+
+      // NUMA topology, read from sysfs or faked with NODE_COUNT
+      static int node_count;
+      static int node_fake;
+      static unsigned char cpu_nodes[MAX_CPUS];
+      static __thread int thread_node; // set with setThreadNode, -1: the node of the CPU
+
+      // The owner of every page of the arenas and mapped chunks, so free can tell which
+      // pointers are ours without reading memory in front of them. A radix tree over the
+      // page numbers: only the parts of the address space in use have nodes, which are
+      // never given back. An entry is the owner with its PageKind in the low bits.
+      enum PageKind
+      {
+          PAGE_NONE,
+          PAGE_ARENA, // the heap_arena
+          PAGE_MAPPED, // the header of the mapped chunk
+          PAGE_GUARDED, // the header of the guarded chunk, only the pages between the guard pages
+          PAGE_KIND_MASK = 3
+      };
+      static uintptr_t **page_map[];
+
+      // Chunks served by mmap are not part of any arena
+      static pthread_mutex_t mmap_mutex;
+      static size_t mmap_threshold;
+      static size_t mmap_size; // whole size of the mappings of all mapped chunks
+      static size_t mmap_count;
+
+      static size_t release_decay;
+      static size_t grow_span;
+      static size_t trim_threshold;
+
+      static int hardening;
+      static size_t hardening_interval;
+      static int fit_policy;
+
+      static size_t thread_cache_size;
+      static __thread thread_cache cache;
+      static pthread_key_t cache_key;
+      static pthread_once_t cache_key_once;
+      static thread_cache *cache_threads;
+      static pthread_mutex_t cache_mutex; // taken last, after any other lock
+
+      static heap_arena *lockArena();
+      static void arenaLock(heap_arena *arena);
+      static size_t arenaCommitted(heap_arena *arena);
+      static heap_arena *assignArena();
+      static void initArena(heap_arena *arena);
+      static heap_arena *arenaOf(heap_chunk *chunk);
+      static void readTopology();
+      static int currentNode();
+      static void bindArena(heap_arena *arena);
+      static uintptr_t pageOwner(void *ptr);
+      static bool pageMapSet(void *start, void *end, uintptr_t owner);
+      static void *arenaGrow(heap_arena *arena, intptr_t increment);
+      static void arenaTrim(heap_arena *arena, size_t keep);
+      static bool heapAtTop(heap_arena *arena);
+      static bool releaseRange(heap_chunk *chunk, char **start, char **end);
+      static void releasePages(heap_arena *arena, heap_chunk *chunk);
+      static void decayArena(heap_arena *arena);
+      static bool remotePush(heap_arena *arena, heap_chunk *chunk);
+      static void remoteDrain(heap_arena *arena);
+
+      static void* allocateChunk(heap_arena *arena, size_t size);
+      static size_t allocateRun(heap_arena *arena, size_t size, size_t count, void **ptrs);
+      static heap_chunk *getChunk(heap_arena *arena, void *ptr);
+      static void releaseChunk(heap_arena *arena, heap_chunk *chunk);
+      static void* createChunk(heap_arena *arena, size_t size);
+      static void* mapChunk(size_t size);
+      static void unmapChunk(heap_chunk *chunk);
+      static void* remapChunk(heap_chunk *chunk, size_t size);
+      static bool isMapped(heap_chunk *chunk);
+      static bool resizeChunk(heap_arena *arena, heap_chunk *chunk, size_t size);
+      static void* alignChunk(heap_arena *arena, heap_chunk *chunk, size_t alignment, size_t size);
+      static void* findAvailableChunk(heap_arena *arena, size_t size);
+      static void splitChunk(heap_arena *arena, heap_chunk *chunk, size_t size);
+      static heap_chunk *mergeChunk(heap_arena *arena, heap_chunk *chunk);
+      static void mergeNext(heap_arena *arena, heap_chunk *chunk);
+      static void checkOperation(heap_arena *arena);
+      static void checkChunkIntegrity(heap_arena *arena, heap_chunk *chunk);
+      static void checkHeapIntegrity(heap_arena *arena);
+
+      static heap_chunk *treeInsert(heap_chunk *root, heap_chunk *chunk);
+      static heap_chunk *treeRemove(heap_chunk *root, heap_chunk *chunk);
+      static heap_chunk *treeMerge(heap_chunk *left, heap_chunk *right);
+      static heap_chunk *treeFind(heap_chunk *root, size_t size);
+      static void treeUpdate(heap_chunk *chunk);
+      static void treeRelease(heap_arena *arena, heap_chunk *root);
+      static void binRebuild(heap_arena *arena);
+
+      static int binIndex(size_t size);
+      static void binInsert(heap_arena *arena, heap_chunk *chunk);
+      static void binRemove(heap_arena *arena, heap_chunk *chunk);
+      static heap_chunk *binFind(heap_arena *arena, size_t size);
+
+      static bool slabReserve();
+      static void *slabAllocate(size_t size, int cache_index);
+      static size_t slabAllocateBatch(size_t size, size_t count, void **ptrs);
+      static void *slabAllocateSlot(int size_class);
+      static void slabFree(void *ptr);
+      static void slabFreeSlot(void *ptr);
+      static bool isSlab(void *ptr);
+      static size_t slabSize(void *ptr);
+      static int slabSlot(size_t offset, int size_class);
+
+      static int cacheIndex(size_t size);
+      static void *cachePop(int index);
+      static bool cachePush(void *ptr, size_t size);
+      static void cacheInsert(int index, void *ptr);
+      static void *cacheRefill(heap_arena *arena, int index);
+      static void cacheFlush(thread_cache *owner, int index, unsigned int count);
+      static void cacheRegister();
+      static void cacheCreateKey();
+      static void cacheDestroy(void *);
+
+      static int fork_handlers;
+      static void forkPrepare();
+      static void forkParent();
+      static void forkChild();
+
+      static int countClass(size_t size);
+      static void countAlloc(void *ptr);
+      static void countFree(void *ptr, size_t size);
+      static void countFlush();
+      static void *allocate(size_t size);
+      static void deallocateSlot(void *ptr, size_t size);
+      static void deallocateChunk(heap_arena *arena, heap_chunk *chunk);
 
   public:
+    enum Option
+    {
+      // Maximum number of data bytes each thread keeps cached (default 64 KiB), 0 disables the cache
+      THREAD_CACHE_SIZE,
+      // Number of arenas, at most 16 (default: number of CPUs)
+      ARENA_COUNT,
+      // 1: pick the arena by the CPU the thread runs on, 0: assign arenas round-robin (default)
+      ARENA_BY_CPU,
+      // 1: one arena per NUMA node, threads allocate from the one of the node they run on
+      // and its pages are placed on that node, 0: off (default)
+      ARENA_BY_NODE,
+      // 0: the NUMA topology of the machine (default), n: fake n nodes for testing,
+      // CPU c belongs to node c % n and the pages are not bound to the nodes
+      NODE_COUNT,
+      // 1: frees from threads of other arenas are queued for the owning arena without locking (default), 0: they lock it
+      REMOTE_FREE,
+      // Requests of at least this size get their own mapping (default 128 KiB), 0 disables mmap
+      MMAP_THRESHOLD,
+      // Bytes arena 0 takes with sbrk at least, doubled with every growth up to 8 MiB (default 64 KiB),
+      // 0 only takes the missing pages
+      GROW_SPAN,
+      // Unused bytes at the end of an arena that are kept for the next growth (default 128 KiB),
+      // more are given back to the OS. They are also given back after RELEASE_DECAY.
+      TRIM_THRESHOLD,
+      // Milliseconds an available chunk keeps the pages inside it before they are given back
+      // with madvise (default 1000), 0 gives them back right when the chunk becomes available
+      RELEASE_DECAY,
+      // Average number of allocated bytes between two allocations the heap profiler records
+      // with their stack trace (default 0: off), see dumpProfile
+      PROFILE_RATE,
+      // Requests of up to this size are served from slab runs (default and maximum 256), 0 disables slabs
+      SLAB_MAX_SIZE,
+      // One of Hardening (default HARDENING_FULL, or -DHARDENING=... at compile time),
+      // a value above HARDENING_FULL, e.g. a negative one, is taken as HARDENING_FULL
+      HARDENING_LEVEL,
+      // Number of operations between two full heap walks in HARDENING_SAMPLED (default 1000),
+      // 0 is taken as 1: a walk on every operation, as with HARDENING_FULL
+      HARDENING_INTERVAL,
+      // One of Fit (default FIT_BINS)
+      FIT_POLICY,
+      // Hardened mode, e.g. for a slice of the fleet. Every n-th allocation of a thread gets pages
+      // of its own between two inaccessible guard pages, so an overflow or a use after free of it
+      // faults right away (default 0: off)
+      GUARD_RATE,
+      // Bytes of freed chunks that are held back in the order they were freed before they can be
+      // used again (default 0: off). A write to one of them ends the program when it leaves.
+      QUARANTINE_SIZE,
+      // 1: freed chunks are filled with a pattern, which is checked when they leave the quarantine,
+      // 0: off (default)
+      POISON_FREED,
+    };
+
+    // How an available chunk is picked for a request
+    enum Fit
+    {
+      // Segregated bins by size, the most recently freed chunk of a bin first
+      FIT_BINS,
+      // The chunk with the lowest address that fits, so the chunks at the end of the
+      // heap stay available and the heap can shrink
+      FIT_ADDRESS,
+    };
+
+    // Heap integrity checks done while the lock is held.
+    // The pointer given to free is validated on every level.
+    enum Hardening
+    {
+      // No further checks
+      HARDENING_OFF,
+      // Check the chunks touched by an operation and their direct neighbors
+      HARDENING_LOCAL,
+      // Local checks plus a walk over the entire heap every HARDENING_INTERVAL operations
+      HARDENING_SAMPLED,
+      // Walk over the entire heap on every operation
+      HARDENING_FULL,
+    };
+
+    // Size classes of the allocation counts: one per 8 bytes below 64 bytes,
+    // then 4 per power of two, and the last one for 1 MiB and more
+    static const int STATS_CLASS_COUNT = SMALL_BIN_COUNT + 1;
+
+    // Nodes with an arena of their own with ARENA_BY_NODE
+    static const int MAX_NODES = MAX_ARENAS - 1;
+
+    // Counters of the arena of a NUMA node
+    typedef struct NodeStats
+    {
+        size_t used;
+        size_t free;
+        size_t resident;
+    } NodeStats;
+
+    // Trace written by startTrace: a TraceHeader, then TraceEvents in the byte order of the
+    // machine. The events of one thread are in order, those of different threads are not.
+    enum TraceType
+    {
+      TRACE_MALLOC,
+      TRACE_FREE,
+      TRACE_REALLOC,
+      TRACE_CALLOC,
+      TRACE_MEMALIGN,
+    };
+
+    // 2: the thread takes 32 bits, an event 48 bytes
+    static const uint32_t TRACE_VERSION = 2;
+
+    typedef struct TraceHeader
+    {
+        char magic[8]; // "SNPTRACE"
+        uint32_t version; // TRACE_VERSION
+        uint32_t event_size; // sizeof(TraceEvent)
+    } TraceHeader;
+
+    // A chunk is known by its address while it is allocated. It is given up when the call
+    // starts and handed out when it ends, so ordering by these times also orders the reuse
+    // of an address across threads.
+    typedef struct TraceEvent
+    {
+        uint64_t time; // ns from startTrace to the start of the call
+        uint64_t ptr; // the chunk that was allocated, freed or returned by realloc
+        uint64_t arg; // realloc: the chunk passed in, memalign: the alignment
+        uint64_t size; // requested size, calloc: count * size
+        uint32_t duration; // ns the call took
+        uint32_t thread; // numbered from 1 in the order the threads first allocate
+        uint32_t type; // TraceType
+        uint32_t reserved; // 0
+    } TraceEvent;
+
+    // Counters of the whole allocator. Sizes are in bytes and include the chunk headers.
+    typedef struct Stats
+    {
+        size_t used; // chunks in use in the arenas, also those in thread caches
+        size_t free; // available chunks in the arenas
+        size_t used_chunks;
+        size_t free_chunks;
+        size_t sbrk; // taken with sbrk by arena 0
+        size_t mmap; // taken with mmap by the other arenas, the mapped chunks and the slab runs
+        size_t resident; // sbrk + mmap without the pages given back inside available chunks
+        size_t mapped; // mapped chunks, guarded ones included
+        size_t mapped_chunks;
+        size_t slab; // slab runs in use
+        size_t quarantined; // freed chunks held back by QUARANTINE_SIZE, still counted as used
+        size_t quarantined_chunks;
+
+        // Allocations and frees by the usable size of the chunk, see statsClassSize.
+        // The counts of other threads are added every few operations, so they may lag behind.
+        size_t allocs[STATS_CLASS_COUNT];
+        size_t frees[STATS_CLASS_COUNT];
+
+        // Arena locks
+        uint64_t locks;
+        uint64_t lock_contended; // the lock was held by another thread
+        uint64_t lock_wait_ns; // time spent waiting for those
+
+        // With ARENA_BY_NODE, otherwise node_count is 0
+        int node_count;
+        NodeStats nodes[MAX_NODES];
+    } Stats;
+
+    static void setOption(Option option, size_t value);
+    // With ARENA_BY_NODE, the calling thread allocates from the arena of the given node
+    // instead of the one of the CPU it runs on, -1 goes back to the CPU (default)
+    static void setThreadNode(int node);
+
     static void *malloc(size_t size);
     static void free(void *ptr);
+    // free for a pointer whose requested size is known, as with the sized operator delete.
+    // Only a slab slot saves work: its size follows from the size, not from its run. Heap and
+    // mapped chunks are looked up and read as with free. The size is only checked on levels
+    // other than HARDENING_OFF, a size that does not belong to the chunk ends the program.
+    static void freeSized(void *ptr, size_t size);
+    // Allocates count chunks of size bytes into ptrs and returns how many it got, the rest of
+    // ptrs is set to nullptr. Each lock is taken once, chunks from the heap are cut from one run.
+    static size_t mallocBatch(size_t size, size_t count, void **ptrs);
+    // Frees the count pointers in ptrs, nullptr is skipped. Chunks that follow each other in ptrs
+    // and in the heap are merged before they are released, under one lock per arena.
+    static void freeBatch(void **ptrs, size_t count);
+    static void *realloc(void *ptr, size_t size);
+    static void *calloc(size_t count, size_t size);
+
+    // alignment has to be a power of two, for posix_memalign also a multiple of sizeof(void *)
+    static void *memalign(size_t alignment, size_t size);
+    static int posix_memalign(void **ptr, size_t alignment, size_t size);
+    static void *aligned_alloc(size_t alignment, size_t size);
+
+    // Number of bytes that can be used at ptr, at least the requested size
+    static size_t usableSize(void *ptr);
 
     static void *_new(size_t size);
+    static void *_new(size_t size, size_t alignment);
     static void _delete(void *ptr);
+    static void _delete(void *ptr, size_t size);
+
+    static Stats getStats();
+    // Smallest usable size counted in the given class
+    static size_t statsClassSize(int index);
+    // Writes the counters of getStats as text or JSON, without allocating any memory
+    static void dumpStats(int fd, bool json = false);
 
+    // Writes the allocations sampled with PROFILE_RATE by stack trace in the text format of
+    // gperftools heap profiles, which pprof reads: live and (live + freed) count and bytes per stack
+    static void dumpProfile(int fd);
+
+    // Writes an event for every allocation and free of every thread to fd, until stopTrace.
+    // The threads collect them in buffers of their own, bench/replay runs them again.
+    static void startTrace(int fd);
+    // Writes the events the threads still have, fd stays open
+    static void stopTrace();
+
+    // Writes the counters and every chunk of every arena to stdout, for debugging
     static void printStatistics(const char *title = nullptr);
+
+  private:
+      // Counts of this thread that are not yet added to the totals
+      typedef struct thread_counts
+      {
+          size_t allocs[STATS_CLASS_COUNT];
+          size_t frees[STATS_CLASS_COUNT];
+          unsigned int pending;
+      } thread_counts;
+
+      static __thread thread_counts counts;
+      static size_t class_allocs[STATS_CLASS_COUNT];
+      static size_t class_frees[STATS_CLASS_COUNT];
+
+      // The dumps are formatted into a buffer on the stack and written to a file descriptor,
+      // stdio may allocate
+      typedef struct dump_writer
+      {
+          int fd;
+          size_t length;
+          char buffer[2048];
+      } dump_writer;
+
+      static void dumpWrite(dump_writer *writer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+      static void dumpFlush(dump_writer *writer);
+
+      // Heap profiler: the stack traces of the sampled allocations and the samples that
+      // are still live, in fixed tables. A sample stands for the bytes estimated from the
+      // sampling rate. The filter counts the live samples by hash of their pointer, so
+      // free only takes the lock for pointers that may have been sampled.
+      static const int PROFILE_DEPTH = 32;
+      static const int PROFILE_STACK_COUNT = 1024;
+      static const int PROFILE_SAMPLE_COUNT = 8192; // power of two
+      static const int PROFILE_FILTER_SIZE = 65536; // power of two
+
+      typedef struct profile_stack
+      {
+          int depth; // 0: unused
+          void *frames[PROFILE_DEPTH];
+          size_t live_count;
+          size_t live_size;
+          size_t freed_count;
+          size_t freed_size;
+      } profile_stack;
+
+      typedef struct profile_sample
+      {
+          void *ptr; // nullptr: unused
+          size_t size;
+          int stack;
+      } profile_sample;
+
+      static size_t profile_rate;
+      static size_t profile_live; // samples not freed yet
+      static profile_stack profile_stacks[PROFILE_STACK_COUNT];
+      static profile_sample profile_samples[PROFILE_SAMPLE_COUNT];
+      static unsigned short profile_filter[PROFILE_FILTER_SIZE];
+      static pthread_mutex_t profile_mutex;
+      static __thread intptr_t profile_countdown; // bytes until the next sample of this thread
+      static __thread uint64_t profile_random;
+      static __thread int profile_active; // the thread is taking a sample
+
+      static void profileAlloc(void *ptr, size_t size, void *caller);
+      static void profileFree(void *ptr);
+      static int profileStack(void **frames, int depth);
+
+      // Hardened mode. A guarded chunk has a mapping of its own: a guard page, the header and
+      // the data, which ends right at the second guard page. Freed ones stay inaccessible and
+      // keep their address range until GUARD_FREED_COUNT more have been freed.
+      // The quarantine is a ring of freed heap chunks and slab slots, oldest first. They stay
+      // marked as used and carry a mark in their first word, which a second free finds.
+      static const int GUARD_FREED_COUNT = 256;
+      static const int QUARANTINE_COUNT = 16384;
+
+      typedef struct guard_mapping
+      {
+          char *start; // nullptr: unused
+          size_t size;
+      } guard_mapping;
+
+      typedef struct quarantine_entry
+      {
+          void *ptr;
+          size_t size; // usable size when it was freed
+          int poisoned;
+      } quarantine_entry;
+
+      static size_t guard_rate;
+      static __thread size_t guard_countdown; // allocations until the next guarded one of this thread
+      static guard_mapping guard_freed[GUARD_FREED_COUNT]; // under mmap_mutex
+      static int guard_freed_next;
+      static size_t quarantine_size;
+      static int poison_freed;
+      static quarantine_entry quarantine[QUARANTINE_COUNT];
+      static size_t quarantine_start;
+      static size_t quarantine_count;
+      static size_t quarantine_bytes;
+      static pthread_mutex_t quarantine_mutex; // no other lock is held with it
+
+      static void* guardChunk(size_t size);
+      static void guardRelease(heap_chunk *chunk);
+      static bool isGuarded(heap_chunk *chunk);
+      static bool quarantinePush(void *ptr, size_t size);
+      static void quarantineEvict(size_t keep);
+      static void quarantineRelease(quarantine_entry *entry);
+
+      // Tracing. A thread takes a buffer on its first event and writes it when it is full,
+      // stopTrace writes the rest. The buffers are never given back: a thread that exits
+      // leaves its buffer to the next new one.
+      static const int TRACE_BUFFER_EVENTS = 1024;
+
+      typedef struct trace_buffer
+      {
+          struct trace_buffer *next; // all buffers
+          int busy; // the owner adds an event or stopTrace writes the buffer
+          int owned; // 0: the thread has exited
+          unsigned int count;
+          TraceEvent events[TRACE_BUFFER_EVENTS];
+      } trace_buffer;
+
+      static int trace_fd; // -1: off
+      static uint64_t trace_start;
+      static unsigned int trace_threads;
+      static trace_buffer *trace_buffers;
+      static pthread_mutex_t trace_mutex; // for the list of buffers and for write
+      static __thread trace_buffer *trace_local;
+      static __thread unsigned int trace_thread;
+      static __thread int trace_busy; // in a traced call, the calls it makes are not traced
+
+      static void *traceAllocate(int type, size_t size, size_t arg);
+      static void traceFree(void *ptr);
+      static void *traceRealloc(void *ptr, size_t size);
+      static size_t traceMallocBatch(size_t size, size_t count, void **ptrs);
+      static void traceFreeBatch(void **ptrs, size_t count);
+      static void traceEvent(int type, void *ptr, uint64_t arg, uint64_t size, uint64_t start, uint64_t end);
+      static trace_buffer *traceBuffer();
+      static void traceWrite(trace_buffer *buffer, int fd);
+      static uint64_t traceClock();
+      static void traceExit();
+      static void traceFork();
   };
 }
 
@@ -46,8 +661,24 @@ void* operator new(size_t size);
 
 void operator delete(void *address ) noexcept;
 
+void operator delete(void *address, size_t size) noexcept;
+
 void* operator new[] ( size_t size );
 
 void operator delete[] ( void* address ) noexcept;
 
+void operator delete[](void *address, size_t size) noexcept;
+
+void* operator new(size_t size, std::align_val_t alignment);
+
+void operator delete(void *address, std::align_val_t alignment) noexcept;
+
+void operator delete(void *address, size_t size, std::align_val_t alignment) noexcept;
+
+void* operator new[](size_t size, std::align_val_t alignment);
+
+void operator delete[](void *address, std::align_val_t alignment) noexcept;
+
+void operator delete[](void *address, size_t size, std::align_val_t alignment) noexcept;
+
 #endif /* SNP_MEMORY_H_ */
@@ -12,11 +12,25 @@ void *snp::Memory::_new(size_t size)
   return p;
 }
 
+void *snp::Memory::_new(size_t size, size_t alignment)
+{
+  void *p = memalign(alignment, size);
+  if (!p)
+    throw std::bad_alloc();
+
+  return p;
+}
+
 void snp::Memory::_delete(void * p)
 { 
   return free(p);
 }
 
+void snp::Memory::_delete(void *p, size_t size)
+{
+  return freeSized(p, size);
+}
+
 void* operator new(size_t size)
 {
   return snp::Memory::_new(size);
@@ -27,6 +41,11 @@ void operator delete(void *address ) noexcept
   snp::Memory::_delete(address);
 }
 
+void operator delete(void *address, size_t size) noexcept
+{
+  snp::Memory::_delete(address, size);
+}
+
 void* operator new[] ( size_t size )
 {
   return snp::Memory::_new(size);
@@ -35,4 +54,40 @@ void* operator new[] ( size_t size )
 void operator delete[] ( void* address ) noexcept
 {
   snp::Memory::_delete(address);
-}
\ No newline at end of file
+}
+
+// The size of an array includes what the compiler stores in front of the elements
+void operator delete[](void *address, size_t size) noexcept
+{
+  snp::Memory::_delete(address, size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+  return snp::Memory::_new(size, (size_t) alignment);
+}
+
+void operator delete(void *address, std::align_val_t) noexcept
+{
+  snp::Memory::_delete(address);
+}
+
+void operator delete(void *address, size_t size, std::align_val_t) noexcept
+{
+  snp::Memory::_delete(address, size);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+  return snp::Memory::_new(size, (size_t) alignment);
+}
+
+void operator delete[](void *address, std::align_val_t) noexcept
+{
+  snp::Memory::_delete(address);
+}
+
+void operator delete[](void *address, size_t size, std::align_val_t) noexcept
+{
+  snp::Memory::_delete(address, size);
+}
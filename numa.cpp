@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "memory.h"
+
+int snp::Memory::arena_by_node = 0;
+int snp::Memory::node_count = 0;
+int snp::Memory::node_fake = 0;
+unsigned char snp::Memory::cpu_nodes[MAX_CPUS] = {};
+__thread int snp::Memory::thread_node = -1;
+
+void snp::Memory::readTopology()
+{
+  if (node_fake != 0)
+  {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+      cpu_nodes[cpu] = cpu % node_fake;
+    node_count = node_fake;
+  }
+  else
+  {
+    // Read without allocating: the cpulist of each node holds ranges like "0-3,8-11\n".
+    // The CPUs of nodes without an arena of their own count as node 0.
+    node_count = 1;
+    for (int node = 0; node < MAX_NODES; node++)
+    {
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+
+      char list[4096];
+      ssize_t length = read(fd, list, sizeof(list) - 1);
+      close(fd);
+      if (length <= 0)
+        continue;
+      list[length] = '\0';
+
+      char *position = list;
+      while (*position >= '0' && *position <= '9')
+      {
+        long first = strtol(position, &position, 10);
+        long last = *position == '-' ? strtol(position + 1, &position, 10) : first;
+
+        for (long cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++)
+          cpu_nodes[cpu] = node;
+
+        if (*position == ',')
+          position++;
+      }
+
+      node_count = node + 1;
+    }
+  }
+
+  // Node n has arena n + 1. The count is read without the lock.
+  if (__atomic_load_n(&arena_count, __ATOMIC_RELAXED) < node_count + 1)
+    __atomic_store_n(&arena_count, node_count + 1, __ATOMIC_RELAXED);
+}
+
+int snp::Memory::currentNode()
+{
+  if (thread_node >= 0 && thread_node < node_count)
+    return thread_node;
+
+  int cpu = sched_getcpu();
+  return cpu >= 0 && cpu < MAX_CPUS ? cpu_nodes[cpu] : 0;
+}
+
+void snp::Memory::bindArena(heap_arena *arena)
+{
+  // Only the ranges of the node arenas on a real topology, arena_mutex is held
+  int node = arena - arenas - 1;
+  if (!arena_by_node || node_fake != 0 || node < 0 || node >= node_count || arena->region_start == nullptr)
+    return;
+
+  // The policy applies to the pages that are touched from now on. Preferred instead of bound,
+  // so the pages come from another node once the node is out of memory. If the kernel has no
+  // NUMA support, the pages stay where they are touched first: by the threads of the node.
+  unsigned long mask = 1UL << node;
+  syscall(SYS_mbind, arena->region_start, arena->region_end - arena->region_start,
+          MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+void snp::Memory::setThreadNode(int node)
+{
+  thread_node = node >= 0 && node < MAX_NODES ? node : -1;
+}
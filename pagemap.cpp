@@ -0,0 +1,90 @@
+#include <sys/mman.h>
+#include "memory.h"
+
+// Pages of 4 KiB whatever the page size of the system, the ranges that are set are page aligned.
+// The page number is split into three levels, the root is static and the rest is mapped on first use.
+// 64-bit: 36 bits of page number for 48 bits of address space, 12 bits per level and 32 KiB per node.
+#define PAGE_MAP_SHIFT 12
+#define PAGE_MAP_BITS ((sizeof(void*) == 8 ? 48 : 32) - PAGE_MAP_SHIFT)
+#define PAGE_MAP_LEVEL_BITS ((PAGE_MAP_BITS + 2) / 3)
+#define PAGE_MAP_LEVEL_SIZE ((uintptr_t) 1 << PAGE_MAP_LEVEL_BITS)
+#define PAGE_MAP_ROOT_SIZE ((uintptr_t) 1 << (PAGE_MAP_BITS - 2 * PAGE_MAP_LEVEL_BITS))
+
+uintptr_t **snp::Memory::page_map[PAGE_MAP_ROOT_SIZE] = {};
+
+// The node below slot, mapped if it does not exist yet and create is set.
+// Threads that map the same node at once agree on one, the others unmap theirs.
+static void *pageMapNode(void **slot, size_t size, bool create)
+{
+  void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (node != nullptr || !create)
+    return node;
+
+  node = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (node == MAP_FAILED)
+    return nullptr;
+
+  void *expected = nullptr;
+  if (!__atomic_compare_exchange_n(slot, &expected, node, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    munmap(node, size);
+    node = expected;
+  }
+
+  return node;
+}
+
+uintptr_t snp::Memory::pageOwner(void *ptr)
+{
+  // Lock-free: a pointer that is ours was set before it was handed out, and stays set until it is freed
+  uintptr_t page = (uintptr_t) ptr >> PAGE_MAP_SHIFT;
+  if (page >> PAGE_MAP_BITS != 0)
+    return PAGE_NONE;
+
+  uintptr_t **middle = __atomic_load_n(&page_map[page >> 2 * PAGE_MAP_LEVEL_BITS], __ATOMIC_ACQUIRE);
+  if (middle == nullptr)
+    return PAGE_NONE;
+
+  uintptr_t *leaf = __atomic_load_n(&middle[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)], __ATOMIC_ACQUIRE);
+  if (leaf == nullptr)
+    return PAGE_NONE;
+
+  return __atomic_load_n(&leaf[page & (PAGE_MAP_LEVEL_SIZE - 1)], __ATOMIC_RELAXED);
+}
+
+bool snp::Memory::pageMapSet(void *start, void *end, uintptr_t owner)
+{
+  // Every page that overlaps [start, end). Only the owner of the pages sets them, no lock needed.
+  // Clearing them never maps a node, so only setting them can fail.
+  uintptr_t first = (uintptr_t) start >> PAGE_MAP_SHIFT;
+  uintptr_t last = ((uintptr_t) end - 1) >> PAGE_MAP_SHIFT;
+  if (end <= start || last >> PAGE_MAP_BITS != 0)
+    return end <= start || owner == PAGE_NONE;
+
+  for (uintptr_t page = first; page <= last; page++)
+  {
+    auto **middle = (uintptr_t**) pageMapNode((void**) &page_map[page >> 2 * PAGE_MAP_LEVEL_BITS],
+                                              PAGE_MAP_LEVEL_SIZE * sizeof(uintptr_t*), owner != PAGE_NONE);
+    auto *leaf = middle == nullptr ? nullptr :
+      (uintptr_t*) pageMapNode((void**) &middle[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)],
+                               PAGE_MAP_LEVEL_SIZE * sizeof(uintptr_t), owner != PAGE_NONE);
+
+    if (leaf == nullptr)
+    {
+      if (owner != PAGE_NONE)
+        return false;
+
+      // Nothing is set below the missing node, skip to the next leaf
+      page |= PAGE_MAP_LEVEL_SIZE - 1;
+      continue;
+    }
+
+    // The rest of this leaf at once
+    uintptr_t leaf_end = (page | (PAGE_MAP_LEVEL_SIZE - 1)) < last ? page | (PAGE_MAP_LEVEL_SIZE - 1) : last;
+    for (; page <= leaf_end; page++)
+      __atomic_store_n(&leaf[page & (PAGE_MAP_LEVEL_SIZE - 1)], owner, __ATOMIC_RELAXED);
+    page--;
+  }
+
+  return true;
+}
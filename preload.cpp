@@ -0,0 +1,95 @@
+// Replaces the malloc family of the C library when built into libsnpmalloc.so,
+// so unmodified programs can use the allocator with
+//   LD_PRELOAD=./libsnpmalloc.so program
+// The global operator new and delete come from new.cpp.
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <malloc.h>
+#include "memory.h"
+
+extern "C" {
+
+void *malloc(size_t size) noexcept
+{
+  return snp::Memory::malloc(size);
+}
+
+void free(void *ptr) noexcept
+{
+  snp::Memory::free(ptr);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+  return snp::Memory::calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+  return snp::Memory::realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept
+{
+  return snp::Memory::memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept
+{
+  return snp::Memory::posix_memalign(ptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+  return snp::Memory::aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) noexcept
+{
+  return snp::Memory::memalign(getpagesize(), size);
+}
+
+void *pvalloc(size_t size) noexcept
+{
+  // Round up to whole pages
+  size_t pagesize = getpagesize();
+  if (size > (size_t)-1 - pagesize)
+    return nullptr;
+
+  return snp::Memory::memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void *ptr) noexcept
+{
+  return snp::Memory::usableSize(ptr);
+}
+
+}
+
+// SNPMALLOC_TRACE=path traces the program into path.<pid> from its start to its exit,
+// see snp::Memory::startTrace. Children that exec write traces of their own.
+static int trace_fd = -1;
+
+__attribute__((constructor)) static void startTrace()
+{
+  const char *path = getenv("SNPMALLOC_TRACE");
+  if (path == nullptr || *path == 0)
+    return;
+
+  char name[4096];
+  snprintf(name, sizeof(name), "%s.%d", path, (int) getpid());
+  trace_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd >= 0)
+    snp::Memory::startTrace(trace_fd);
+}
+
+__attribute__((destructor)) static void stopTrace()
+{
+  if (trace_fd < 0)
+    return;
+
+  snp::Memory::stopTrace();
+  close(trace_fd);
+  trace_fd = -1;
+}
@@ -0,0 +1,260 @@
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <fcntl.h>
+#include <unwind.h>
+#include "memory.h"
+
+// Frames unwound per sample: the PROFILE_DEPTH that are kept and those of the allocator that are skipped
+#define PROFILE_UNWIND_DEPTH 48
+
+size_t snp::Memory::profile_rate = 0;
+size_t snp::Memory::profile_live = 0;
+snp::Memory::profile_stack snp::Memory::profile_stacks[PROFILE_STACK_COUNT] = {};
+snp::Memory::profile_sample snp::Memory::profile_samples[PROFILE_SAMPLE_COUNT] = {};
+unsigned short snp::Memory::profile_filter[PROFILE_FILTER_SIZE] = {};
+pthread_mutex_t snp::Memory::profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread intptr_t snp::Memory::profile_countdown = 0;
+__thread uint64_t snp::Memory::profile_random = 0;
+__thread int snp::Memory::profile_active = 0;
+
+typedef struct profile_trace
+{
+  int depth;
+  void *frames[PROFILE_UNWIND_DEPTH];
+} profile_trace;
+
+static _Unwind_Reason_Code profileFrame(struct _Unwind_Context *context, void *arg)
+{
+  auto *trace = (profile_trace*) arg;
+  void *ip = (void*) _Unwind_GetIP(context);
+  if (trace->depth >= PROFILE_UNWIND_DEPTH || ip == nullptr)
+    return _URC_END_OF_STACK;
+
+  trace->frames[trace->depth++] = ip;
+  return _URC_NO_REASON;
+}
+
+static size_t profileHash(void *ptr)
+{
+  // Chunks are aligned, the low bits say nothing
+  uintptr_t value = (uintptr_t) ptr >> 4;
+  return (size_t) (value * 0x9e3779b97f4a7c15ull >> 16);
+}
+
+static intptr_t profileInterval(uint64_t *random, size_t rate)
+{
+  // The sample points are a Poisson process over the allocated bytes: the distance
+  // to the next one is exponentially distributed with the rate as mean.
+  // xorshift64, the uniform value is in (0, 1].
+  *random ^= *random << 13;
+  *random ^= *random >> 7;
+  *random ^= *random << 17;
+  double uniform = ((*random >> 11) + 1) / 9007199254740992.0;
+
+  return (intptr_t) (-log(uniform) * rate) + 1;
+}
+
+void snp::Memory::profileAlloc(void *ptr, size_t size, void *caller)
+{
+  size_t rate = profile_rate;
+  if (profile_random == 0)
+  {
+    profile_random = ((uintptr_t) &profile_random ^ (uint64_t) time(nullptr) << 32) | 1;
+    profile_countdown = profileInterval(&profile_random, rate);
+  }
+
+  profile_countdown -= size;
+  if (profile_countdown > 0 || profile_active)
+    return;
+
+  profile_countdown = profileInterval(&profile_random, rate);
+
+  // Unwinding may allocate in some C libraries, those allocations are not sampled
+  profile_active = 1;
+
+  profile_trace trace;
+  trace.depth = 0;
+  _Unwind_Backtrace(profileFrame, &trace);
+
+  // Skip the frames of the allocator up to the one that called it
+  int first = 0;
+  while (first < trace.depth && trace.frames[first] != caller)
+    first++;
+  if (first == trace.depth)
+    first = 0;
+
+  int depth = trace.depth - first < PROFILE_DEPTH ? trace.depth - first : PROFILE_DEPTH;
+  if (depth == 0)
+  {
+    profile_active = 0;
+    return;
+  }
+
+  // A chunk of this size is sampled with a probability of 1 - exp(-size / rate)
+  double weight = (double) size / -expm1(-(double) size / rate);
+
+  pthread_mutex_lock(&profile_mutex);
+
+  int stack = profileStack(trace.frames + first, depth);
+  size_t index = profileHash(ptr) & (PROFILE_SAMPLE_COUNT - 1);
+
+  // Both tables are full -> the sample is dropped
+  for (int i = 0; stack >= 0 && i < PROFILE_SAMPLE_COUNT; i++, index = (index + 1) & (PROFILE_SAMPLE_COUNT - 1))
+  {
+    profile_sample *sample = &profile_samples[index];
+    if (sample->ptr != nullptr)
+      continue;
+
+    sample->ptr = ptr;
+    sample->size = (size_t) weight;
+    sample->stack = stack;
+
+    profile_stacks[stack].live_count++;
+    profile_stacks[stack].live_size += sample->size;
+
+    __atomic_add_fetch(&profile_filter[profileHash(ptr) & (PROFILE_FILTER_SIZE - 1)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+    break;
+  }
+
+  pthread_mutex_unlock(&profile_mutex);
+
+  profile_active = 0;
+}
+
+void snp::Memory::profileFree(void *ptr)
+{
+  // The filter was counted up before the pointer was handed out, so it is never
+  // seen as 0 for a sampled chunk by the thread that frees it
+  size_t hash = profileHash(ptr);
+  if (__atomic_load_n(&profile_filter[hash & (PROFILE_FILTER_SIZE - 1)], __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock(&profile_mutex);
+
+  size_t index = hash & (PROFILE_SAMPLE_COUNT - 1);
+  for (int i = 0; i < PROFILE_SAMPLE_COUNT && profile_samples[index].ptr != nullptr; i++)
+  {
+    profile_sample *sample = &profile_samples[index];
+    if (sample->ptr != ptr)
+    {
+      index = (index + 1) & (PROFILE_SAMPLE_COUNT - 1);
+      continue;
+    }
+
+    profile_stack *stack = &profile_stacks[sample->stack];
+    stack->live_count--;
+    stack->live_size -= sample->size;
+    stack->freed_count++;
+    stack->freed_size += sample->size;
+
+    __atomic_sub_fetch(&profile_filter[hash & (PROFILE_FILTER_SIZE - 1)], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+
+    // Move the samples behind into the gap, so every sample stays reachable from its hash
+    size_t gap = index;
+    for (size_t next = (gap + 1) & (PROFILE_SAMPLE_COUNT - 1); profile_samples[next].ptr != nullptr;
+         next = (next + 1) & (PROFILE_SAMPLE_COUNT - 1))
+    {
+      size_t home = profileHash(profile_samples[next].ptr) & (PROFILE_SAMPLE_COUNT - 1);
+      if (((next - home) & (PROFILE_SAMPLE_COUNT - 1)) >= ((next - gap) & (PROFILE_SAMPLE_COUNT - 1)))
+      {
+        profile_samples[gap] = profile_samples[next];
+        gap = next;
+      }
+    }
+    profile_samples[gap].ptr = nullptr;
+    break;
+  }
+
+  pthread_mutex_unlock(&profile_mutex);
+}
+
+int snp::Memory::profileStack(void **frames, int depth)
+{
+  // profile_mutex is held. The stacks are found by the hash of their frames.
+  size_t hash = depth;
+  for (int i = 0; i < depth; i++)
+    hash = hash * 31 + profileHash(frames[i]);
+
+  size_t index = hash & (PROFILE_STACK_COUNT - 1);
+  for (int i = 0; i < PROFILE_STACK_COUNT; i++, index = (index + 1) & (PROFILE_STACK_COUNT - 1))
+  {
+    profile_stack *stack = &profile_stacks[index];
+
+    if (stack->depth == 0)
+    {
+      stack->depth = depth;
+      for (int frame = 0; frame < depth; frame++)
+        stack->frames[frame] = frames[frame];
+      return index;
+    }
+
+    if (stack->depth != depth)
+      continue;
+
+    int frame = 0;
+    while (frame < depth && stack->frames[frame] == frames[frame])
+      frame++;
+    if (frame == depth)
+      return index;
+  }
+
+  return -1;
+}
+
+void snp::Memory::dumpProfile(int fd)
+{
+  dump_writer writer;
+  writer.fd = fd;
+  writer.length = 0;
+
+  pthread_mutex_lock(&profile_mutex);
+
+  size_t live_count = 0, live_size = 0, total_count = 0, total_size = 0;
+  for (int i = 0; i < PROFILE_STACK_COUNT; i++)
+  {
+    profile_stack *stack = &profile_stacks[i];
+    live_count += stack->live_count;
+    live_size += stack->live_size;
+    total_count += stack->live_count + stack->freed_count;
+    total_size += stack->live_size + stack->freed_size;
+  }
+
+  // The sizes are estimated from the samples already, so pprof does not have to scale them
+  dumpWrite(&writer, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n", live_count, live_size, total_count, total_size);
+
+  for (int i = 0; i < PROFILE_STACK_COUNT; i++)
+  {
+    profile_stack *stack = &profile_stacks[i];
+    if (stack->depth == 0)
+      continue;
+
+    dumpWrite(&writer, "%zu: %zu [%zu: %zu] @", stack->live_count, stack->live_size,
+              stack->live_count + stack->freed_count, stack->live_size + stack->freed_size);
+    for (int frame = 0; frame < stack->depth; frame++)
+      dumpWrite(&writer, " %p", stack->frames[frame]);
+    dumpWrite(&writer, "\n");
+  }
+
+  pthread_mutex_unlock(&profile_mutex);
+
+  // pprof maps the addresses to the binaries with the memory map of the process
+  dumpWrite(&writer, "\nMAPPED_LIBRARIES:\n");
+  dumpFlush(&writer);
+
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps < 0)
+    return;
+
+  ssize_t count;
+  while ((count = read(maps, writer.buffer, sizeof(writer.buffer))) > 0 ||
+         (count < 0 && errno == EINTR))
+  {
+    writer.length = count > 0 ? count : 0;
+    dumpFlush(&writer);
+  }
+
+  close(maps);
+}
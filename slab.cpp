@@ -0,0 +1,240 @@
+#include <sys/mman.h>
+#include "memory.h"
+
+// Address space reserved for slab runs. Only the runs in use are backed by memory.
+#define SLAB_REGION_SIZE (sizeof(void*) == 8 ? (size_t) 64 << 20 : (size_t) 16 << 20)
+#define SLAB_RUN_COUNT (SLAB_REGION_SIZE / SLAB_RUN_SIZE)
+
+char* snp::Memory::slab_base = nullptr;
+snp::Memory::slab_run* snp::Memory::slab_runs = nullptr;
+size_t snp::Memory::slab_run_count = 0;
+snp::Memory::slab_run* snp::Memory::slab_partial[SLAB_CLASS_COUNT] = {};
+snp::Memory::slab_run* snp::Memory::slab_unused = nullptr;
+size_t snp::Memory::slab_runs_used = 0;
+size_t snp::Memory::slab_max_size = (SLAB_CLASS_COUNT - 1) * SLAB_CLASS_SIZE;
+int snp::Memory::slab_reserved = 0;
+pthread_mutex_t snp::Memory::slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ceil(65536 / size class): unit * this >> 16 is unit / size class for the 16 byte units of a run
+static const unsigned int slab_reciprocals[] = {
+  0, 65536, 32768, 21846, 16384, 13108, 10923, 9363, 8192, 7282, 6554, 5958, 5462, 5042, 4682, 4370, 4096
+};
+
+bool snp::Memory::slabReserve()
+{
+  // Only try once, if it fails all requests go to the heap
+  if (slab_reserved)
+    return slab_base != nullptr;
+  slab_reserved = 1;
+
+  void *region = mmap(nullptr, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED)
+    return false;
+
+  // The descriptors get a mapping of their own, so an overflow of a slot can't reach them
+  void *runs = mmap(nullptr, SLAB_RUN_COUNT * sizeof(slab_run), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (runs == MAP_FAILED)
+  {
+    munmap(region, SLAB_REGION_SIZE);
+    return false;
+  }
+
+  slab_runs = (slab_run*) runs;
+  // Publish the base last: isSlab reads it without the lock
+  __atomic_store_n(&slab_base, (char*) region, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+void *snp::Memory::slabAllocate(size_t size, int cache_index)
+{
+  // malloc(0) still gets a distinct slot
+  int size_class = size == 0 ? 1 : (size + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE;
+
+  pthread_mutex_lock(&slab_mutex);
+
+  void *ptr = nullptr;
+  if (slabReserve())
+    ptr = slabAllocateSlot(size_class);
+
+  // Refill the thread cache while we have the lock. The slot size
+  // of the class equals the size of the cache class.
+  for (int i = 1; ptr != nullptr && cache_index == size_class && i < CACHE_REFILL_COUNT; i++)
+  {
+    size_t class_size = size_class * SLAB_CLASS_SIZE;
+    if (cache.length[cache_index] >= CACHE_CLASS_LENGTH || cache.size + class_size > thread_cache_size)
+      break;
+
+    void *cached = slabAllocateSlot(size_class);
+    if (cached == nullptr)
+      break;
+
+    cacheInsert(cache_index, cached);
+  }
+
+  pthread_mutex_unlock(&slab_mutex);
+
+  return ptr;
+}
+
+size_t snp::Memory::slabAllocateBatch(size_t size, size_t count, void **ptrs)
+{
+  int size_class = size == 0 ? 1 : (size + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE;
+  size_t done = 0;
+
+  // One lock for the whole batch, the slots of a run are next to each other
+  pthread_mutex_lock(&slab_mutex);
+
+  if (slabReserve())
+    while (done < count && (ptrs[done] = slabAllocateSlot(size_class)) != nullptr)
+      done++;
+
+  pthread_mutex_unlock(&slab_mutex);
+
+  return done;
+}
+
+void *snp::Memory::slabAllocateSlot(int size_class)
+{
+  slab_run *run = slab_partial[size_class];
+  size_t slot_size = size_class * SLAB_CLASS_SIZE;
+
+  if (run == nullptr)
+  {
+    // Prefer a run that was used before, otherwise take the next untouched one
+    if (slab_unused != nullptr)
+    {
+      run = slab_unused;
+      slab_unused = run->next;
+    }
+    else if (slab_run_count < SLAB_RUN_COUNT)
+      run = &slab_runs[slab_run_count++];
+    else
+      return nullptr; // the region is exhausted -> use the heap
+
+    run->size_class = size_class;
+    run->free_slots = SLAB_RUN_SIZE / slot_size;
+    slab_runs_used++;
+
+    for (size_t i = 0; i < sizeof(run->free_map) / sizeof(uint32_t); i++)
+    {
+      int bits = run->free_slots - i * 32;
+      run->free_map[i] = bits >= 32 ? ~(uint32_t) 0 : bits > 0 ? ((uint32_t) 1 << bits) - 1 : 0;
+    }
+
+    run->prev = nullptr;
+    run->next = nullptr;
+    slab_partial[size_class] = run;
+  }
+
+  // The run is in the partial list -> there is at least one bit set
+  size_t word = 0;
+  while (run->free_map[word] == 0)
+    word++;
+
+  int slot = word * 32 + __builtin_ctz(run->free_map[word]);
+  run->free_map[word] &= ~((uint32_t) 1 << (slot % 32));
+
+  // Full runs are in no list, slabFreeSlot puts them back
+  if (--run->free_slots == 0)
+  {
+    slab_partial[size_class] = run->next;
+    if (run->next != nullptr)
+      run->next->prev = nullptr;
+  }
+
+  return slab_base + (run - slab_runs) * SLAB_RUN_SIZE + slot * slot_size;
+}
+
+void snp::Memory::slabFree(void *ptr)
+{
+  pthread_mutex_lock(&slab_mutex);
+  slabFreeSlot(ptr);
+  pthread_mutex_unlock(&slab_mutex);
+}
+
+void snp::Memory::slabFreeSlot(void *ptr)
+{
+  size_t offset = (char*) ptr - slab_base;
+  slab_run *run = &slab_runs[offset / SLAB_RUN_SIZE];
+
+  // Out of memory check -> the run has to be in use.
+  // Memory corruption check -> prevent that someone does free(ptr+5)
+  int slot = slabSlot(offset, run->size_class);
+  if (slot < 0)
+    exit(-1);
+
+  size_t slot_size = run->size_class * SLAB_CLASS_SIZE;
+
+  // Double free check
+  uint32_t bit = (uint32_t) 1 << (slot % 32);
+  if (run->free_map[slot / 32] & bit)
+    exit(-1);
+
+  run->free_map[slot / 32] |= bit;
+
+  // The run was full -> it can serve allocations again
+  if (++run->free_slots == 1)
+  {
+    run->prev = nullptr;
+    run->next = slab_partial[run->size_class];
+    if (run->next != nullptr)
+      run->next->prev = run;
+    slab_partial[run->size_class] = run;
+    return;
+  }
+
+  // Give an empty run back to the OS, unless it is the last one of its class
+  if (run->free_slots == SLAB_RUN_SIZE / slot_size && (run->prev != nullptr || run->next != nullptr))
+  {
+    if (run->prev != nullptr)
+      run->prev->next = run->next;
+    else
+      slab_partial[run->size_class] = run->next;
+    if (run->next != nullptr)
+      run->next->prev = run->prev;
+
+    madvise(slab_base + (run - slab_runs) * SLAB_RUN_SIZE, SLAB_RUN_SIZE, MADV_DONTNEED);
+
+    run->size_class = 0;
+    run->prev = nullptr;
+    run->next = slab_unused;
+    slab_unused = run;
+    slab_runs_used--;
+  }
+}
+
+bool snp::Memory::isSlab(void *ptr)
+{
+  char *base = __atomic_load_n(&slab_base, __ATOMIC_ACQUIRE);
+  return base != nullptr && (char*) ptr >= base && (char*) ptr < base + SLAB_REGION_SIZE;
+}
+
+size_t snp::Memory::slabSize(void *ptr)
+{
+  // A valid slot belongs to the caller, so the class of its run can't change
+  size_t offset = (char*) ptr - slab_base;
+  int size_class = slab_runs[offset / SLAB_RUN_SIZE].size_class;
+
+  // Out of memory and memory corruption check, as in slabFreeSlot
+  if (slabSlot(offset, size_class) < 0)
+    exit(-1);
+
+  return size_class * SLAB_CLASS_SIZE;
+}
+
+int snp::Memory::slabSlot(size_t offset, int size_class)
+{
+  // Index of the slot at the offset in its run, -1 if the run is unused or no slot starts there.
+  // The slot sizes are multiples of SLAB_CLASS_SIZE, so this needs no division.
+  size_t unit = offset % SLAB_RUN_SIZE / SLAB_CLASS_SIZE;
+  size_t slot = unit * slab_reciprocals[size_class] >> 16;
+
+  if (size_class == 0 || offset % SLAB_CLASS_SIZE != 0 || slot * size_class != unit ||
+      (slot + 1) * size_class > SLAB_RUN_SIZE / SLAB_CLASS_SIZE)
+    return -1;
+
+  return slot;
+}
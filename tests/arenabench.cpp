@@ -0,0 +1,70 @@
+/*
+ * arenabench.cpp
+ *
+ * Time per object of requests that allocate a few hundred objects of mixed
+ * sizes which all die at the end of the request: with malloc and free of
+ * each object, and with an Arena that is reset after each request.
+ */
+#include "../arena.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+
+#define OBJECTS 300
+#define REQUESTS 20000
+
+static size_t sizes[OBJECTS];
+
+static double measureMemory()
+{
+  static void *objects[OBJECTS];
+
+  double start = now_s();
+  for (int request = 0; request < REQUESTS; request++)
+  {
+    for (int i = 0; i < OBJECTS; i++)
+    {
+      objects[i] = snp::Memory::malloc(sizes[i]);
+      *(char*) objects[i] = 1;
+    }
+    for (int i = 0; i < OBJECTS; i++)
+      snp::Memory::free(objects[i]);
+  }
+
+  return (now_s() - start) / ((double) REQUESTS * OBJECTS) * 1e9;
+}
+
+static double measureArena()
+{
+  snp::Arena arena;
+
+  double start = now_s();
+  for (int request = 0; request < REQUESTS; request++)
+  {
+    for (int i = 0; i < OBJECTS; i++)
+      *(char*) arena.allocate(sizes[i]) = 1;
+    arena.reset();
+  }
+
+  return (now_s() - start) / ((double) REQUESTS * OBJECTS) * 1e9;
+}
+
+int main()
+{
+  // Mostly small objects, some up to 2 KiB
+  srandom(1);
+  for (int i = 0; i < OBJECTS; i++)
+    sizes[i] = i % 10 == 0 ? 256 + random() % 1792 : 1 + random() % 128;
+
+  const char *names[] = { "off", "local", "full" };
+  snp::Memory::Hardening levels[] = { snp::Memory::HARDENING_OFF, snp::Memory::HARDENING_LOCAL, snp::Memory::HARDENING_FULL };
+
+  printf("%10s %18s %18s\n", "hardening", "malloc ns/object", "arena ns/object");
+  for (int level = 0; level < 3; level++)
+  {
+    snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, levels[level]);
+    printf("%10s %18.1f %18.1f\n", names[level], measureMemory(), measureArena());
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * arenatest.cpp
+ *
+ * Arena hands out aligned objects that don't overlap, large ones included.
+ * reset reuses the same blocks without taking new ones, those of the large
+ * objects included, release gives them back to Memory, and std::pmr
+ * containers work on an ArenaResource.
+ */
+#include "../arena.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#define OBJECTS 5000
+
+static void *objects[OBJECTS];
+
+static void fill(snp::Arena &arena)
+{
+  for (int i = 0; i < OBJECTS; i++)
+  {
+    size_t size = i % 7 == 0 ? 20000 : i % 300;
+    size_t alignment = (size_t) 1 << (i % 8);
+    objects[i] = arena.allocate(size, alignment);
+    assert(objects[i] != nullptr && (uintptr_t) objects[i] % alignment == 0);
+    memset(objects[i], i, size);
+  }
+
+  for (int i = 0; i < OBJECTS; i++)
+  {
+    size_t size = i % 7 == 0 ? 20000 : i % 300;
+    for (size_t j = 0; j < size; j++)
+      assert(((unsigned char*) objects[i])[j] == (unsigned char) i);
+  }
+}
+
+int main()
+{
+  snp::Memory::Stats before = snp::Memory::getStats();
+
+  {
+    snp::Arena arena;
+    assert(arena.used() == 0 && arena.footprint() == 0);
+
+    // Without an alignment the objects are aligned like malloc
+    void *first = arena.allocate(10);
+    assert(first != nullptr && (uintptr_t) first % snp::Arena::ALIGNMENT == 0);
+    assert(arena.used() >= 10);
+
+    // A bad alignment fails also when the current block has room
+    assert(arena.allocate(10, 0) == nullptr && arena.allocate(10, 3) == nullptr);
+
+    fill(arena);
+    size_t footprint = arena.footprint();
+    void *large = objects[7];
+
+    // The same blocks serve the next round, the first object is where it was
+    arena.reset();
+    assert(arena.used() == 0);
+    assert(arena.allocate(10) == first);
+
+    for (int round = 0; round < 10; round++)
+    {
+      arena.reset();
+      fill(arena);
+      assert(arena.footprint() == footprint);
+      assert(objects[7] == large);
+    }
+
+    // Large blocks nobody takes again are given back by the reset after the next one
+    arena.reset();
+    arena.allocate(10);
+    arena.reset();
+    assert(arena.footprint() < footprint);
+
+    arena.release();
+    assert(arena.footprint() == 0);
+
+    // Still usable afterwards
+    fill(arena);
+  }
+
+  // Containers allocate from the arena and never free on their own
+  {
+    snp::Arena arena(4096);
+    snp::ArenaResource resource(arena);
+
+    std::pmr::vector<int> numbers(&resource);
+    for (int i = 0; i < 10000; i++)
+      numbers.push_back(i);
+
+    std::pmr::map<int, std::pmr::string> names(&resource);
+    for (int i = 0; i < 1000; i++)
+      names.emplace(i, std::pmr::string(std::to_string(i) + " is a number that needs a long string", &resource));
+
+    for (int i = 0; i < 10000; i++)
+      assert(numbers[i] == i);
+    for (int i = 0; i < 1000; i++)
+      assert(names[i].compare((std::to_string(i) + " is a number that needs a long string").c_str()) == 0);
+    assert(arena.used() >= 10000 * sizeof(int) + 1000 * 40);
+
+    snp::Arena other;
+    snp::ArenaResource same(arena), different(other);
+    assert(resource == same && !(resource == different));
+  }
+
+  // All blocks went back to Memory
+  snp::Memory::Stats after = snp::Memory::getStats();
+  assert(after.used_chunks <= before.used_chunks);
+  assert(after.mapped_chunks == before.mapped_chunks);
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * batchbench.cpp
+ *
+ * Time per object of allocating and freeing batches of same-sized objects,
+ * as a message loop does, with loops of malloc and free and with mallocBatch
+ * and freeBatch, for slab, heap and cached sizes on each hardening level.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define BATCH 256
+#define ROUNDS 2000
+
+static double measure(size_t size, bool batch)
+{
+  static void *ptrs[BATCH];
+
+  // Some chunks that stay, so the heap walks of the hardening have something to do
+  static void *kept[BATCH];
+  snp::Memory::mallocBatch(1000, BATCH, kept);
+
+  double start = now_s();
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    if (batch)
+    {
+      snp::Memory::mallocBatch(size, BATCH, ptrs);
+      snp::Memory::freeBatch(ptrs, BATCH);
+    }
+    else
+    {
+      for (int i = 0; i < BATCH; i++)
+        ptrs[i] = snp::Memory::malloc(size);
+      for (int i = 0; i < BATCH; i++)
+        snp::Memory::free(ptrs[i]);
+    }
+  }
+  double elapsed = now_s() - start;
+
+  snp::Memory::freeBatch(kept, BATCH);
+
+  return elapsed / ((double) ROUNDS * BATCH) * 1e9;
+}
+
+int main()
+{
+  const size_t sizes[] = { 48, 200, 1000, 4000 };
+  const char *names[] = { "off", "local", "sampled", "full" };
+  snp::Memory::Hardening levels[] = {
+    snp::Memory::HARDENING_OFF, snp::Memory::HARDENING_LOCAL, snp::Memory::HARDENING_SAMPLED, snp::Memory::HARDENING_FULL
+  };
+
+  // The freed batches stay below the trim threshold, otherwise both versions would give
+  // the memory back to the OS and fault it in again every round
+  snp::Memory::setOption(snp::Memory::TRIM_THRESHOLD, 4 << 20);
+
+  printf("%10s %8s %18s %18s\n", "hardening", "size", "single ns/object", "batch ns/object");
+  for (int level = 0; level < 4; level++)
+  {
+    snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, levels[level]);
+    for (size_t size : sizes)
+      printf("%10s %8zu %18.1f %18.1f\n", names[level], size, measure(size, false), measure(size, true));
+  }
+
+  return 0;
+}
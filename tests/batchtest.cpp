@@ -0,0 +1,87 @@
+/*
+ * batchtest.cpp
+ *
+ * mallocBatch hands out distinct chunks of slabs, the heap and mmap, and
+ * freeBatch gives them back in any order, with nullptr in between. Chunks
+ * of one run that are freed together end up as one available chunk.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#define COUNT 200
+
+static const size_t sizes[] = { 0, 16, 40, 200, 300, 1000, 5000, 200 * 1024 };
+
+static void allocateAndFree(size_t size, bool reverse)
+{
+  static void *ptrs[COUNT];
+
+  size_t done = snp::Memory::mallocBatch(size, COUNT, ptrs);
+  assert(done == COUNT);
+
+  // Every chunk has room for the size and is not shared with another one
+  for (int i = 0; i < COUNT; i++)
+  {
+    assert(ptrs[i] != nullptr && snp::Memory::usableSize(ptrs[i]) >= size);
+    memset(ptrs[i], i, size);
+  }
+  for (int i = 0; i < COUNT; i++)
+    for (size_t j = 0; j < size; j++)
+      assert(((unsigned char*) ptrs[i])[j] == (unsigned char) i);
+
+  if (reverse)
+    for (int i = 0; i < COUNT / 2; i++)
+    {
+      void *ptr = ptrs[i];
+      ptrs[i] = ptrs[COUNT - 1 - i];
+      ptrs[COUNT - 1 - i] = ptr;
+    }
+
+  // nullptr is skipped, and the chunks around it are still freed
+  void *ptr = ptrs[COUNT / 2];
+  ptrs[COUNT / 2] = nullptr;
+  snp::Memory::freeBatch(ptrs, COUNT);
+  snp::Memory::free(ptr);
+}
+
+int main()
+{
+  for (size_t size : sizes)
+  {
+    allocateAndFree(size, false);
+    allocateAndFree(size, true);
+  }
+
+  // Chunks from different batches and single calls mixed in one freeBatch
+  void *ptrs[3 * COUNT];
+  snp::Memory::mallocBatch(100, COUNT, ptrs);
+  snp::Memory::mallocBatch(2000, COUNT, ptrs + COUNT);
+  for (int i = 2 * COUNT; i < 3 * COUNT; i++)
+    ptrs[i] = snp::Memory::malloc(i);
+  snp::Memory::freeBatch(ptrs, 3 * COUNT);
+
+  // Only the heap: the run of a batch is one chunk again once it is freed as a whole
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+
+  snp::Memory::Stats before = snp::Memory::getStats();
+  snp::Memory::mallocBatch(64, COUNT, ptrs);
+  for (int i = 1; i < COUNT; i++)
+    assert((char*) ptrs[i] - (char*) ptrs[i - 1] == (char*) ptrs[1] - (char*) ptrs[0]);
+
+  snp::Memory::Stats during = snp::Memory::getStats();
+  assert(during.used_chunks == before.used_chunks + COUNT);
+
+  snp::Memory::freeBatch(ptrs, COUNT);
+  snp::Memory::Stats after = snp::Memory::getStats();
+  assert(after.used_chunks == before.used_chunks);
+  assert(after.free_chunks <= before.free_chunks + 1);
+
+  for (int i = 0; i < snp::Memory::STATS_CLASS_COUNT; i++)
+    assert(after.allocs[i] == after.frees[i]);
+
+  printf("Test passed\n");
+  return 0;
+}
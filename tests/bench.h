@@ -0,0 +1,74 @@
+/*
+ * bench.h
+ *
+ * Clock and resident memory for the benchmarks in tests/ and bench/, and
+ * the random replacement of live chunks several of them time.
+ */
+#ifndef SNP_BENCH_H_
+#define SNP_BENCH_H_
+
+#include "../memory.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+
+static inline double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Bytes of the process in memory, 0 if /proc can't be read
+static inline long resident_bytes()
+{
+  // Resident pages are the second field
+  long size = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr)
+    return 0;
+  if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  fclose(statm);
+
+  return resident * getpagesize();
+}
+
+// Operations per second of a free and a malloc of a random chunk out of live_count live
+// ones, so every call works in the middle of the heap. The sizes are below max_size and
+// the same on every call.
+static inline double replace_random(int live_count, int operations, size_t max_size)
+{
+  std::vector<void*> live(live_count);
+
+  srandom(1);
+  for (int i = 0; i < live_count; i++)
+    live[i] = snp::Memory::malloc(random() % max_size);
+
+  double start = now_s();
+  for (int i = 0; i < operations; i++)
+  {
+    int index = random() % live_count;
+    snp::Memory::free(live[index]);
+    live[index] = snp::Memory::malloc(random() % max_size);
+  }
+  double elapsed = now_s() - start;
+
+  for (int i = 0; i < live_count; i++)
+    snp::Memory::free(live[i]);
+
+  // Every iteration is one malloc and one free
+  return 2 * operations / elapsed;
+}
+
+#endif /* SNP_BENCH_H_ */
@@ -36,62 +36,118 @@ int main()
 
 #elif TEST == 5
   // TEST 5a: Heap overflow
-  char *test5a = (char*) snp::Memory::malloc(5);
-  char *test5b = (char*) snp::Memory::malloc(5);
-  strcpy(test5a, "AAAAAA");
+  char *test5a = (char*) snp::Memory::malloc(2000);
+  char *test5b = (char*) snp::Memory::malloc(2000);
+  memset(test5a, 'A', 2000 + 2 * sizeof(size_t));
   snp::Memory::printStatistics();
   snp::Memory::free(test5a);
-  // exit(-1) because strcpy writes AAAAAA\0 -> overwriting corruption_check
+  // exit(-1) because memset writes behind the data -> overwriting the size of test5b
 
 #elif TEST == 6
   // TEST 6: Heap overflow: Same overflow as 5 but with malloc() instead of free()
-  char *test6a = (char *) snp::Memory::malloc(5);
-  char *test6b = (char *) snp::Memory::malloc(5);
+  char *test6a = (char *) snp::Memory::malloc(2000);
+  char *test6b = (char *) snp::Memory::malloc(2000);
   snp::Memory::free(test6a);
-  strcpy(test6a, "AAAAAA");
+  memset(test6a, 'A', 2000 + 2 * sizeof(size_t));
   snp::Memory::printStatistics();
-  test6b = (char *) snp::Memory::malloc(5);
-  // exit(-1) because strcpy writes AAAAAA\0 -> overwriting corruption_check
+  test6b = (char *) snp::Memory::malloc(2000);
+  // exit(-1) because memset writes behind the data -> overwriting the size of test6b
 
 #elif TEST == 7
-  // TEST 7: Memory corruption: data_size is manipulated
-  // when chunk->next != nullptr
-  char *test7a = (char *) snp::Memory::malloc(123);
-  char *test7b = (char *) snp::Memory::malloc(123);
+  // TEST 7: Memory corruption: the size is manipulated
+  // when there is a next chunk
+  char *test7a = (char *) snp::Memory::malloc(2000);
+  char *test7b = (char *) snp::Memory::malloc(2000);
   snp::Memory::printStatistics();
-  *(size_t*) (test7a-0x10) = 5;
+  *(size_t*) (test7a - sizeof(size_t)) = 5;
   snp::Memory::printStatistics();
   snp::Memory::free(test7a);
-  // exit(-1) because the next chunk does not begin after data+data_size
+  // exit(-1) because 5 is less than the smallest chunk
 
 #elif TEST == 8
-  // TEST 8: Memory corruption: data_size is manipulated
-  // when chunk->next == nullptr
-  // FIXME: This can only be detected if we check that: (chunk->next == nullptr && (sbrk(0) != chunk_end)
-  //  but we should not use sbrk(0) more than once
+  // TEST 8: Memory corruption: the size is manipulated
+  // when the chunk is the last one
   char *test8 = (char *) snp::Memory::malloc(4076);
   snp::Memory::printStatistics();
-  *(size_t*) (test8-0x10) = 5;
+  *(size_t*) (test8 - sizeof(size_t)) += 64;
   snp::Memory::printStatistics();
   snp::Memory::free(test8);
-  // exit(-1) because the next chunk does not begin after data+data_size
+  // exit(-1) because the chunk does not end at the end marker anymore
 
 #elif TEST == 9
-  // TEST 9: Memory corruption: prev pointer is invalid
+  // TEST 9: Memory corruption: the previous chunk is claimed to be available
   char *test9 = (char *) snp::Memory::malloc(4076);
-  *(test9-8) = 0x4;
+  *(size_t*) (test9 - sizeof(size_t)) |= 2;
   snp::Memory::printStatistics();
   snp::Memory::free(test9);
-  // exit(-1) because 0x4 is < heap_start
+  // exit(-1) because there is no available chunk in front that ends at test9
 
 #elif TEST == 10
-  // TEST 10: Memory corruption: next pointer == current chunk
+  // TEST 10: Memory corruption: the chunk is marked available while in use
   char *test10 = (char *) snp::Memory::malloc(4076);
-  char *test10_chunk_start = test10-0x14;
-  char *test10_chunk_next = test10-0x4;
-  *(int*) test10_chunk_next = (int) test10_chunk_start;
+  *(size_t*) (test10 - sizeof(size_t)) |= 1;
   snp::Memory::free(test10);
-  // exit(-1) because the fake next chunk does not start where test10 + data_size ends
+  // exit(-1) because the chunk looks as if it was freed already
+
+#elif TEST == 11
+  // TEST 11: Sized free with the size of another slab class
+  char *test11 = (char *) snp::Memory::malloc(16);
+  snp::Memory::freeSized(test11, 100);
+  // exit(-1) because the slot is 16 bytes and not 112
+
+#elif TEST == 12
+  // TEST 12: Sized free with a size the chunk can't hold
+  char *test12 = (char *) snp::Memory::malloc(1000);
+  snp::Memory::freeSized(test12, 4000);
+  // exit(-1) because the chunk has only about 1000 bytes
+
+#elif TEST == 13
+  // TEST 13: Double free within a batch
+  void *test13[4];
+  snp::Memory::mallocBatch(1000, 3, test13);
+  test13[3] = test13[1];
+  snp::Memory::freeBatch(test13, 4);
+  // exit(-1) because test13[1] was merged into the chunk of test13[0] already
+
+#elif TEST == 14
+  // TEST 14: Out of memory: a pointer into a page the allocator never had
+  static char test14[8192];
+  snp::Memory::malloc(200 * 1024);
+  snp::Memory::free(test14 + 4096);
+  // exit(-1) because no arena or mapped chunk owns the page
+
+#elif TEST == 15
+  // TEST 15: Memory corruption: a pointer into the second page of a mapped chunk
+  char *test15 = (char*) snp::Memory::malloc(200 * 1024);
+  snp::Memory::free(test15 + 8192);
+  // exit(-1) because the page belongs to the mapped chunk, but its header is not in front of the pointer
+
+#elif TEST == 16
+  // TEST 16: Double free of a chunk in the quarantine
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, 64 * 1024);
+  char *test16 = (char*) snp::Memory::malloc(64);
+  snp::Memory::free(test16);
+  snp::Memory::free(test16);
+  // exit(-1) because test16 is still held back, even though the heap has it marked as used
+
+#elif TEST == 17
+  // TEST 17: Use after free of a chunk in the quarantine
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, 4096);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 1);
+  char *test17 = (char*) snp::Memory::malloc(2000);
+  snp::Memory::free(test17);
+  test17[1000] = 'A';
+  snp::Memory::free(snp::Memory::malloc(4000));
+  // exit(-1) because test17 is not poisoned anymore when it leaves the quarantine
+
+#elif TEST == 18
+  // TEST 18: Heap overflow into a chunk no operation touches, with a level out of range
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, (size_t) -1);
+  char *test18a = (char*) snp::Memory::malloc(2000);
+  char *test18b = (char*) snp::Memory::malloc(2000);
+  memset(test18a, 'A', 2000 + 2 * sizeof(size_t));
+  snp::Memory::malloc(5000);
+  // exit(-1) because -1 is taken as HARDENING_FULL, whose heap walk finds the size of the chunk behind test18a
 #endif
 
   return 0;
@@ -1,4 +1,5 @@
 #include "unistd.h"
+#include <sys/mman.h>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -11,10 +12,19 @@
 #else
   #define ALLOCATION_SIZE (allocation + HEAP_CHUNK_SIZE)
 #endif
-#define HEAP_CHUNK_SIZE 20
+#define HEAP_CHUNK_SIZE sizeof(size_t)
 
 int main()
 {
+  // The assertions below check how chunks are reused and given back via sbrk,
+  // so bypass the thread cache which would keep freed chunks to itself
+  // and the slab runs which would serve the tiny requests
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  // and the spans taken and kept behind the heap, which would hide where sbrk goes
+  snp::Memory::setOption(snp::Memory::GROW_SPAN, 0);
+  snp::Memory::setOption(snp::Memory::TRIM_THRESHOLD, 0);
+
   char *heap_start = (char*) sbrk(0);
   //printf("HEAP START: %p\n", heap_start);
 
@@ -67,7 +77,7 @@ int main()
   assert (heap_ptr == heap_start);
 
   // TEST 5: when doing malloc(1) 243 times in total only one page should be called via sbrk()
-  // => 147x HEAP_CHUNK_SIZE (20) + 1 byte => 3087 bytes
+  // => 147x HEAP_CHUNK_SIZE (4) + 1 byte, rounded up to 8 => 1176 bytes
   int calls = 147;
   char *ptr[calls];
   allocation = sizeof(char);
@@ -102,5 +112,24 @@ int main()
   heap_ptr = (char*) sbrk(0);
   assert (heap_ptr == heap_start);
 
+  // TEST 7: large allocations get their own mapping and are unmapped on free
+  char *test7 = (char*) snp::Memory::malloc(1024 * 1024);
+  test7[1024 * 1024 - 1] = 7;
+  heap_ptr = (char*) sbrk(0);
+  assert (heap_ptr == heap_start);
+  char *test7_page = (char*) ((size_t) test7 & ~(size_t) (getpagesize() - 1));
+  assert (msync(test7_page, getpagesize(), MS_ASYNC) == 0);
+  snp::Memory::free(test7);
+  assert (msync(test7_page, getpagesize(), MS_ASYNC) == -1);
+
+  // TEST 8: a chunk only adds one word of header, so chunks of one word of data lie two words apart
+  char *test8a = (char*) snp::Memory::malloc(sizeof(size_t));
+  char *test8b = (char*) snp::Memory::malloc(sizeof(size_t));
+  assert (test8b - test8a == 2 * sizeof(size_t));
+  snp::Memory::free(test8b);
+  snp::Memory::free(test8a);
+  heap_ptr = (char*) sbrk(0);
+  assert (heap_ptr == heap_start);
+
   return 0;
 }
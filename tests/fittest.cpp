@@ -0,0 +1,124 @@
+/*
+ * fittest.cpp
+ *
+ * With the address-ordered fit, a chunk is cut from the available chunk
+ * with the lowest address that fits, whatever order they were freed in.
+ * The policy can change while chunks are in use and available: the arenas
+ * index their available chunks anew and the contents and counters stay.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define CHUNKS 20
+#define SLOTS 2000
+#define ROUNDS 100000
+
+static void *slots[SLOTS];
+static size_t slot_sizes[SLOTS];
+
+static void lowestFirst(size_t size)
+{
+  void *chunks[CHUNKS];
+  for (int i = 0; i < CHUNKS; i++)
+    chunks[i] = snp::Memory::malloc(size);
+
+  // Not next to each other, so they are not merged. The bins would hand out chunks[5] first.
+  snp::Memory::free(chunks[2]);
+  snp::Memory::free(chunks[10]);
+  snp::Memory::free(chunks[5]);
+
+  void *lowest = chunks[2];
+  if (chunks[5] < lowest)
+    lowest = chunks[5];
+  if (chunks[10] < lowest)
+    lowest = chunks[10];
+
+  void *ptr = snp::Memory::malloc(size - size / 8);
+  assert(ptr == lowest);
+  snp::Memory::free(ptr);
+
+  for (int i = 0; i < CHUNKS; i++)
+    if (i != 2 && i != 5 && i != 10)
+      snp::Memory::free(chunks[i]);
+}
+
+static void check(int slot)
+{
+  unsigned char *bytes = (unsigned char*) slots[slot];
+  for (size_t i = 0; i < slot_sizes[slot]; i++)
+    assert(bytes[i] == (unsigned char) slot);
+}
+
+static void mixed(int rounds)
+{
+  for (int round = 0; round < rounds; round++)
+  {
+    int slot = random() % SLOTS;
+    if (slots[slot] != nullptr)
+    {
+      check(slot);
+      snp::Memory::free(slots[slot]);
+      slots[slot] = nullptr;
+      continue;
+    }
+
+    slot_sizes[slot] = random() % 8 == 0 ? 1000 + random() % 20000 : 1 + random() % 300;
+    slots[slot] = snp::Memory::malloc(slot_sizes[slot]);
+    assert(slots[slot] != nullptr);
+    memset(slots[slot], slot, slot_sizes[slot]);
+  }
+}
+
+static void switchPolicy(snp::Memory::Fit fit)
+{
+  snp::Memory::Stats before = snp::Memory::getStats();
+  snp::Memory::setOption(snp::Memory::FIT_POLICY, fit);
+  snp::Memory::Stats after = snp::Memory::getStats();
+
+  assert(after.used == before.used);
+  assert(after.free == before.free);
+  assert(after.free_chunks == before.free_chunks);
+
+  for (int i = 0; i < SLOTS; i++)
+    if (slots[i] != nullptr)
+      check(i);
+}
+
+int main()
+{
+  // Every chunk comes from the heap of the arena, with a full check of it
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_FULL);
+  snp::Memory::setOption(snp::Memory::FIT_POLICY, snp::Memory::FIT_ADDRESS);
+
+  lowestFirst(100);
+  lowestFirst(1000);
+  lowestFirst(50000);
+
+  srandom(1);
+  mixed(ROUNDS);
+
+  // Switch with chunks in use and available, the released ones included
+  switchPolicy(snp::Memory::FIT_BINS);
+  mixed(ROUNDS);
+  switchPolicy(snp::Memory::FIT_ADDRESS);
+  mixed(ROUNDS);
+
+  for (int i = 0; i < SLOTS; i++)
+    if (slots[i] != nullptr)
+    {
+      check(i);
+      snp::Memory::free(slots[i]);
+      slots[i] = nullptr;
+    }
+
+  // Everything merged back: lowestFirst can find its chunks again
+  lowestFirst(3000);
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * forktest.cpp
+ *
+ * The main thread forks again and again while worker threads allocate,
+ * reallocate and free chunks of every kind, and exit and start anew. Each
+ * child uses the allocator, from threads of its own as well, without
+ * waiting for a lock that a thread of the parent held. It also gets back
+ * the chunks that the threads which did not come along had in their caches.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 8
+#define SLOTS 256
+#define ROUNDS 10000
+#define FORKS 100
+#define CACHED 16
+#define CACHED_SIZE 1000
+
+static pthread_barrier_t cached, forked;
+
+// Mostly slab slots and heap chunks, a few mapped ones
+static size_t randomSize(unsigned int *seed)
+{
+  int kind = rand_r(seed) % 100;
+  if (kind < 50)
+    return rand_r(seed) % 256 + 1;
+  if (kind < 98)
+    return rand_r(seed) % 8000 + 257;
+  return rand_r(seed) % (64 * 1024) + 32 * 1024;
+}
+
+// Allocates, reallocates and frees the chunks of its slots, the number of corrupted ones is returned
+static size_t work(unsigned int seed, int rounds)
+{
+  char *slots[SLOTS] = {};
+  size_t sizes[SLOTS];
+  size_t errors = 0;
+
+  for (int i = 0; i < rounds; i++)
+  {
+    int slot = rand_r(&seed) % SLOTS;
+    char fill = (char) slot;
+
+    if (slots[slot] == nullptr)
+    {
+      sizes[slot] = randomSize(&seed);
+      slots[slot] = (char*) snp::Memory::malloc(sizes[slot]);
+      memset(slots[slot], fill, sizes[slot]);
+      continue;
+    }
+
+    if (slots[slot][0] != fill || slots[slot][sizes[slot] - 1] != fill)
+      errors++;
+
+    if (rand_r(&seed) % 4 == 0)
+    {
+      size_t size = randomSize(&seed);
+      slots[slot] = (char*) snp::Memory::realloc(slots[slot], size);
+      if (size > sizes[slot])
+        memset(slots[slot] + sizes[slot], fill, size - sizes[slot]);
+      sizes[slot] = size;
+    }
+    else
+    {
+      snp::Memory::free(slots[slot]);
+      slots[slot] = nullptr;
+    }
+  }
+
+  for (int slot = 0; slot < SLOTS; slot++)
+  {
+    if (slots[slot] != nullptr && slots[slot][0] != (char) slot)
+      errors++;
+    snp::Memory::free(slots[slot]);
+  }
+
+  return errors;
+}
+
+static void *worker(void *arg)
+{
+  return (void*) work((unsigned int) (size_t) arg, ROUNDS);
+}
+
+static void *holder(void *)
+{
+  // The chunks stay in the cache of this thread
+  void *chunks[CACHED];
+  for (int i = 0; i < CACHED; i++)
+    chunks[i] = snp::Memory::malloc(CACHED_SIZE);
+  for (int i = 0; i < CACHED; i++)
+    snp::Memory::free(chunks[i]);
+
+  pthread_barrier_wait(&cached);
+  pthread_barrier_wait(&forked);
+  return nullptr;
+}
+
+static void child(int number)
+{
+  // A deadlock fails the test instead of hanging it
+  alarm(30);
+
+  // Every few forks with a walk over the whole heap on each check
+  if (number % 10 == 0)
+    snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_FULL);
+
+  pthread_t thread;
+  void *result;
+  pthread_create(&thread, nullptr, worker, (void*) (size_t) (number + 1000));
+  size_t errors = work(number, ROUNDS / 4);
+  pthread_join(thread, &result);
+  errors += (size_t) result;
+
+  _exit(errors == 0 ? 0 : 1);
+}
+
+static bool succeeded(pid_t pid)
+{
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main()
+{
+  // The chunks cached by a thread of the parent are available in the child
+  pthread_barrier_init(&cached, nullptr, 2);
+  pthread_barrier_init(&forked, nullptr, 2);
+
+  pthread_t thread;
+  pthread_create(&thread, nullptr, holder, nullptr);
+  pthread_barrier_wait(&cached);
+
+  size_t used = snp::Memory::getStats().used;
+  pid_t pid = fork();
+  if (pid == 0)
+    _exit(snp::Memory::getStats().used + CACHED * CACHED_SIZE / 2 <= used ? 0 : 1);
+
+  pthread_barrier_wait(&forked);
+  pthread_join(thread, nullptr);
+  assert(succeeded(pid));
+
+  // Fork while the workers hold locks and caches, and while they start and exit
+  snp::Memory::setOption(snp::Memory::ARENA_COUNT, 4);
+  snp::Memory::setOption(snp::Memory::MMAP_THRESHOLD, 32 * 1024);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  pthread_t threads[THREADS];
+  unsigned int seed = 1;
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], nullptr, worker, (void*) (size_t) seed++);
+
+  size_t errors = 0;
+  for (int i = 0; i < FORKS; i++)
+  {
+    pid = fork();
+    if (pid == 0)
+      child(i);
+    assert(succeeded(pid));
+
+    // Replace the workers that are done
+    for (int j = 0; j < THREADS; j++)
+    {
+      void *result;
+      if (pthread_tryjoin_np(threads[j], &result) == 0)
+      {
+        errors += (size_t) result;
+        pthread_create(&threads[j], nullptr, worker, (void*) (size_t) seed++);
+      }
+    }
+  }
+
+  for (int i = 0; i < THREADS; i++)
+  {
+    void *result;
+    pthread_join(threads[i], &result);
+    errors += (size_t) result;
+  }
+
+  assert(errors == 0);
+
+  printf("Test passed\n");
+  return 0;
+}
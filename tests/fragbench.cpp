@@ -0,0 +1,132 @@
+/*
+ * fragbench.cpp
+ *
+ * External fragmentation of the heap over millions of mixed operations,
+ * with the bins and with the address-ordered fit. The number of live
+ * chunks swings between high and low every phase, while a share of the
+ * chunks lives on for a long time and pins the memory around it. Each
+ * policy runs in a child process of its own, so both start from the same
+ * empty heap.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define OPERATIONS 4000000
+#define PHASE 250000
+#define SLOTS 20000
+#define KEPT 2000
+
+static void *slots[SLOTS];
+static size_t slot_sizes[SLOTS];
+static void *kept[KEPT];
+static size_t kept_sizes[KEPT];
+
+// Mostly small chunks, some of a few KiB and a few big ones below the mmap threshold
+static size_t randomSize()
+{
+  long kind = random() % 100;
+  if (kind < 70)
+    return 16 + random() % 240;
+  if (kind < 95)
+    return 256 + random() % 3840;
+  return 4096 + random() % (60 * 1024);
+}
+
+static void report(long operations, size_t live)
+{
+  snp::Memory::Stats stats = snp::Memory::getStats();
+  size_t heap = stats.used + stats.free;
+
+  // External fragmentation: the share of the heap that is available but not in use
+  printf("%12ld %10.1f %10.1f %10.1f %10.1f %12zu %9.1f%%\n", operations, live / 1048576.0, stats.used / 1048576.0,
+         heap / 1048576.0, stats.resident / 1048576.0, stats.free_chunks, heap != 0 ? 100.0 * stats.free / heap : 0.0);
+}
+
+static void run(snp::Memory::Fit fit, const char *name)
+{
+  // Everything goes through the heap of a single arena
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+  snp::Memory::setOption(snp::Memory::FIT_POLICY, fit);
+
+  printf("%s\n%12s %10s %10s %10s %10s %12s %10s\n", name, "operations", "live MiB", "used MiB", "heap MiB",
+         "rss MiB", "free chunks", "free");
+
+  srandom(1);
+  size_t live = 0;
+  int live_count = 0;
+  int kept_next = 0;
+
+  double start = now_s();
+  double reporting = 0;
+  for (long i = 1; i <= OPERATIONS; i++)
+  {
+    // The live chunks swing between all slots and a quarter of them
+    bool grow = live_count < ((i / PHASE) % 2 == 0 ? SLOTS : SLOTS / 4);
+    int slot = random() % SLOTS;
+
+    if (slots[slot] == nullptr && (grow || random() % 8 == 0))
+    {
+      slot_sizes[slot] = randomSize();
+      slots[slot] = snp::Memory::malloc(slot_sizes[slot]);
+      live += slot_sizes[slot];
+      live_count++;
+
+      // Every 32nd allocation also makes a chunk that lives through many phases
+      if (random() % 32 == 0)
+      {
+        snp::Memory::free(kept[kept_next]);
+        live -= kept_sizes[kept_next];
+        kept_sizes[kept_next] = 16 + random() % 496;
+        kept[kept_next] = snp::Memory::malloc(kept_sizes[kept_next]);
+        live += kept_sizes[kept_next];
+        kept_next = (kept_next + 1) % KEPT;
+      }
+    }
+    else if (slots[slot] != nullptr && (!grow || random() % 8 == 0))
+    {
+      snp::Memory::free(slots[slot]);
+      slots[slot] = nullptr;
+      live -= slot_sizes[slot];
+      live_count--;
+    }
+
+    // At the end of each phase, so the high and the low points are shown
+    if (i % PHASE == PHASE - 1)
+    {
+      double before = now_s();
+      report(i, live);
+      reporting += now_s() - before;
+    }
+  }
+  double elapsed = now_s() - start - reporting;
+
+  printf("%.1f ns per operation\n\n", elapsed / OPERATIONS * 1e9);
+}
+
+int main()
+{
+  // Flushed before fork, so the children don't print it again
+  setvbuf(stdout, nullptr, _IONBF, 0);
+
+  if (fork() == 0)
+  {
+    run(snp::Memory::FIT_BINS, "bins");
+    return 0;
+  }
+  wait(nullptr);
+
+  if (fork() == 0)
+  {
+    run(snp::Memory::FIT_ADDRESS, "address-ordered fit");
+    return 0;
+  }
+  wait(nullptr);
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * freelistbench.cpp
+ *
+ * Measures the malloc latency for a reused chunk while the number of live
+ * chunks in front of it grows. With size-class bins, the lookup only touches
+ * the free chunks of the requested class, so the latency should stay flat.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define ROUNDS 2000
+#define CHUNK_SIZE 32
+
+static double measure(int live_chunks)
+{
+  void **live = (void**) snp::Memory::malloc(live_chunks * sizeof(void*));
+
+  for (int i = 0; i < live_chunks; i++)
+    live[i] = snp::Memory::malloc(CHUNK_SIZE);
+
+  // Punch one hole close to the heap end, behind all the other live chunks
+  snp::Memory::free(live[live_chunks - 2]);
+
+  double malloc_ns = 0;
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    double start = now_ns();
+    void *ptr = snp::Memory::malloc(CHUNK_SIZE);
+    malloc_ns += now_ns() - start;
+
+    snp::Memory::free(ptr);
+  }
+
+  for (int i = 0; i < live_chunks; i++)
+    if (i != live_chunks - 2)
+      snp::Memory::free(live[i]);
+  snp::Memory::free(live);
+
+  return malloc_ns / ROUNDS;
+}
+
+int main()
+{
+  // Measure the lookup in the shared heap: no thread cache in front of it and
+  // no walk over the whole heap on every call
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  int live_chunks[] = { 100, 1000, 5000, 10000, 20000, 50000 };
+
+  printf("%12s %16s\n", "live chunks", "ns per malloc");
+  for (int live : live_chunks)
+    printf("%12d %16.1f\n", live, measure(live));
+
+  return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * guardtest.cpp
+ *
+ * Hardened mode: an overflow of a guarded chunk and a use after free of it
+ * fault, a freed chunk is not handed out again while it is in the quarantine,
+ * and writes to it or a second free end the program. The misuse runs in child
+ * processes. Threads then allocate and free with everything turned on.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define THREADS 4
+#define SLOTS 512
+#define ROUNDS 50000
+#define QUARANTINE (256 * 1024)
+
+// How the child that runs misuse ends: the signal, or 0x100 + its exit status
+static int outcome(void (*misuse)())
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    misuse();
+    _exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) ? WTERMSIG(status) : 0x100 + WEXITSTATUS(status);
+}
+
+static void overflow()
+{
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 1);
+  char *ptr = (char*) snp::Memory::malloc(100);
+  memset(ptr, 'A', snp::Memory::usableSize(ptr));
+  ptr[snp::Memory::usableSize(ptr)] = 'A';
+}
+
+static void useAfterFree()
+{
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 1);
+  volatile char *ptr = (char*) snp::Memory::malloc(5000);
+  ptr[4999] = 'A';
+  snp::Memory::free((void*) ptr);
+  ptr[0] = 'B';
+}
+
+static void guardedDoubleFree()
+{
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 1);
+  void *ptr = snp::Memory::malloc(100);
+  snp::Memory::free(ptr);
+  snp::Memory::free(ptr);
+}
+
+static void quarantinedDoubleFree()
+{
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, QUARANTINE);
+  void *slot = snp::Memory::malloc(32);
+  void *chunk = snp::Memory::malloc(1000);
+  snp::Memory::free(slot);
+  snp::Memory::free(chunk);
+  snp::Memory::free(slot);
+}
+
+static void writeAfterFree()
+{
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, QUARANTINE);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 1);
+  char *ptr = (char*) snp::Memory::malloc(1000);
+  snp::Memory::free(ptr);
+  ptr[500] = 'A';
+
+  // Caught when the chunk leaves the quarantine
+  for (int i = 0; i < 2 * QUARANTINE / 1000; i++)
+    snp::Memory::free(snp::Memory::malloc(1000));
+}
+
+// Guarded chunks behave like any other
+static void guarded()
+{
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 1);
+  snp::Memory::Stats before = snp::Memory::getStats();
+
+  char *ptr = (char*) snp::Memory::malloc(3000);
+  assert(snp::Memory::getStats().mapped_chunks == before.mapped_chunks + 1);
+  assert(snp::Memory::usableSize(ptr) >= 3000);
+  for (int i = 0; i < 3000; i++)
+    ptr[i] = (char) i;
+
+  // Moved to another guarded chunk, also when it shrinks
+  ptr = (char*) snp::Memory::realloc(ptr, 20000);
+  for (int i = 0; i < 3000; i++)
+    assert(ptr[i] == (char) i);
+  ptr = (char*) snp::Memory::realloc(ptr, 10);
+  for (int i = 0; i < 10; i++)
+    assert(ptr[i] == (char) i);
+  snp::Memory::freeSized(ptr, 10);
+
+  ptr = (char*) snp::Memory::calloc(100, 10);
+  for (int i = 0; i < 1000; i++)
+    assert(ptr[i] == 0);
+  snp::Memory::free(ptr);
+
+  // Multiples of 8 but not of 16: a header and whole alignment units do not end on
+  // the guard page on 32-bit, the chunk still has room for all of the request
+  size_t sizes[] = {8, 24, 40, 104, 1000, 4088};
+  for (size_t size : sizes)
+  {
+    ptr = (char*) snp::Memory::malloc(size);
+    assert(snp::Memory::usableSize(ptr) >= size);
+    for (size_t i = 0; i < size; i++)
+      ptr[i] = (char) (i + size);
+
+    ptr = (char*) snp::Memory::realloc(ptr, size + 8);
+    assert(snp::Memory::usableSize(ptr) >= size + 8);
+    ptr = (char*) snp::Memory::realloc(ptr, size);
+    for (size_t i = 0; i < size; i++)
+      assert(ptr[i] == (char) (i + size));
+
+    // A sized free of the request is no mismatch
+    snp::Memory::freeSized(ptr, size);
+  }
+
+  // Every third allocation
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 3);
+  void *ptrs[30];
+  for (int i = 0; i < 30; i++)
+    ptrs[i] = snp::Memory::malloc(64);
+  assert(snp::Memory::getStats().mapped_chunks == before.mapped_chunks + 10);
+  snp::Memory::freeBatch(ptrs, 30);
+
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 0);
+  assert(snp::Memory::getStats().mapped_chunks == before.mapped_chunks);
+}
+
+// A freed chunk comes back only after the quarantine is full
+static void delayedReuse()
+{
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, QUARANTINE);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 1);
+
+  char *first = (char*) snp::Memory::malloc(1000);
+  memset(first, 'A', 1000);
+  snp::Memory::free(first);
+
+  // Poisoned behind the mark
+  for (int i = sizeof(void*); i < 1000; i++)
+    assert((unsigned char) first[i] == 0xdb);
+
+  snp::Memory::Stats stats = snp::Memory::getStats();
+  assert(stats.quarantined >= 1000 && stats.quarantined_chunks == 1);
+
+  bool reused = false;
+  for (int i = 0; i < 4 * QUARANTINE / 1000 && !reused; i++)
+  {
+    void *ptr = snp::Memory::malloc(1000);
+    if (ptr == first)
+    {
+      reused = true;
+      assert(i >= QUARANTINE / 1024);
+    }
+    snp::Memory::free(ptr);
+  }
+  assert(reused);
+
+  // Turning it off gives back what it holds
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, 0);
+  stats = snp::Memory::getStats();
+  assert(stats.quarantined == 0 && stats.quarantined_chunks == 0);
+
+  // Only poisoned, past the links of the thread cache
+  char *ptr = (char*) snp::Memory::malloc(1000);
+  memset(ptr, 'A', 1000);
+  snp::Memory::free(ptr);
+  assert((unsigned char) ptr[500] == 0xdb);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 0);
+}
+
+static void *worker(void *arg)
+{
+  unsigned int seed = (unsigned int) (size_t) arg;
+  char *slots[SLOTS] = {};
+  size_t sizes[SLOTS];
+
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    int slot = rand_r(&seed) % SLOTS;
+    char fill = (char) slot;
+
+    if (slots[slot] != nullptr)
+    {
+      assert(slots[slot][0] == fill && slots[slot][sizes[slot] - 1] == fill);
+
+      if (rand_r(&seed) % 4 == 0)
+      {
+        size_t size = rand_r(&seed) % 4000 + 1;
+        slots[slot] = (char*) snp::Memory::realloc(slots[slot], size);
+        memset(slots[slot], fill, size);
+        sizes[slot] = size;
+      }
+      else
+      {
+        snp::Memory::free(slots[slot]);
+        slots[slot] = nullptr;
+      }
+      continue;
+    }
+
+    sizes[slot] = rand_r(&seed) % 2 == 0 ? rand_r(&seed) % 256 + 1 : rand_r(&seed) % 4000 + 1;
+    slots[slot] = (char*) snp::Memory::malloc(sizes[slot]);
+    memset(slots[slot], fill, sizes[slot]);
+  }
+
+  for (int slot = 0; slot < SLOTS; slot++)
+    snp::Memory::free(slots[slot]);
+
+  return nullptr;
+}
+
+int main()
+{
+  assert(outcome(overflow) == SIGSEGV);
+  assert(outcome(useAfterFree) == SIGSEGV);
+  assert(outcome(guardedDoubleFree) == 0x100 + 255);
+  assert(outcome(quarantinedDoubleFree) == 0x100 + 255);
+  assert(outcome(writeAfterFree) == 0x100 + 255);
+
+  guarded();
+  delayedReuse();
+
+  // Everything on at once, from several threads
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 64);
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, QUARANTINE);
+  snp::Memory::setOption(snp::Memory::POISON_FREED, 1);
+  snp::Memory::setOption(snp::Memory::ARENA_COUNT, 4);
+
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], nullptr, worker, (void*) (size_t) (i + 1));
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], nullptr);
+
+  snp::Memory::setOption(snp::Memory::QUARANTINE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::GUARD_RATE, 0);
+  assert(snp::Memory::getStats().quarantined_chunks == 0);
+
+  printf("Test passed\n");
+  return 0;
+}
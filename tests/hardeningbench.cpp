@@ -0,0 +1,38 @@
+/*
+ * hardeningbench.cpp
+ *
+ * Throughput of random malloc/free operations on a heap with many live
+ * chunks for each hardening level.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define LIVE_CHUNKS 10000
+#define OPERATIONS 10000
+
+static double measure(snp::Memory::Hardening level)
+{
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, level);
+  return replace_random(LIVE_CHUNKS, OPERATIONS, 2048);
+}
+
+int main()
+{
+  // Only measure the shared heap
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+
+  const char *names[] = { "off", "local", "sampled", "full" };
+  snp::Memory::Hardening levels[] = {
+    snp::Memory::HARDENING_OFF,
+    snp::Memory::HARDENING_LOCAL,
+    snp::Memory::HARDENING_SAMPLED,
+    snp::Memory::HARDENING_FULL,
+  };
+
+  printf("%10s %16s\n", "hardening", "ops per second");
+  for (int i = 0; i < 4; i++)
+    printf("%10s %16.0f\n", names[i], measure(levels[i]));
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * heapbench.cpp
+ *
+ * Throughput of random malloc/free operations with many live chunks for
+ * Heap variants side by side, from the checked and locked default down to
+ * the variant of a single-threaded tool without checks and locks, and
+ * Memory for comparison.
+ */
+#include "../heap.h"
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+
+#define LIVE_CHUNKS 1000
+#define OPERATIONS 200000
+
+static char buffer[16 << 20];
+
+template<class Allocator>
+static double measure(Allocator &allocator)
+{
+  static void *live[LIVE_CHUNKS];
+
+  srandom(1);
+  for (int i = 0; i < LIVE_CHUNKS; i++)
+    live[i] = allocator.malloc(random() % 512);
+
+  double start = now_s();
+  for (int i = 0; i < OPERATIONS; i++)
+  {
+    // Replace a random chunk, so every malloc and free works in the middle of the heap
+    int index = random() % LIVE_CHUNKS;
+    allocator.free(live[index]);
+    live[index] = allocator.malloc(random() % 512);
+  }
+  double elapsed = now_s() - start;
+
+  for (int i = 0; i < LIVE_CHUNKS; i++)
+    allocator.free(live[i]);
+
+  // Every iteration is one malloc and one free
+  return 2 * OPERATIONS / elapsed;
+}
+
+// Memory with the same interface as Heap
+struct MemoryAllocator
+{
+    void *malloc(size_t size) { return snp::Memory::malloc(size); }
+    void free(void *ptr) { snp::Memory::free(ptr); }
+};
+
+int main()
+{
+  double results[7];
+
+  {
+    snp::Heap<snp::FirstFit, snp::PageGrowth, snp::FullCheck, snp::MutexLock, snp::MmapSource> heap;
+    results[0] = measure(heap);
+  }
+  {
+    snp::Heap<> heap;
+    results[1] = measure(heap);
+  }
+  {
+    snp::Heap<snp::BestFit> heap;
+    results[2] = measure(heap);
+  }
+  {
+    snp::Heap<snp::FirstFit, snp::PageGrowth, snp::LocalCheck, snp::SpinLock> heap;
+    results[3] = measure(heap);
+  }
+  {
+    snp::Heap<snp::FirstFit, snp::PageGrowth, snp::NoCheck, snp::NoLock, snp::MmapSource> heap;
+    results[4] = measure(heap);
+  }
+  {
+    snp::Heap<snp::FirstFit, snp::ExactGrowth, snp::NoCheck, snp::NoLock, snp::BufferSource> heap(buffer, sizeof(buffer));
+    results[5] = measure(heap);
+  }
+  {
+    // Only the shared heap, like the Heap variants
+    snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+    snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+    snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+    MemoryAllocator memory;
+    results[6] = measure(memory);
+  }
+
+  // Printed at the end, so stdio does not take memory in between
+  const char *names[] = {
+    "first fit, pages, full checks, mutex, mmap",
+    "first fit, pages, local checks, mutex, mmap",
+    "best fit, pages, local checks, mutex, mmap",
+    "first fit, pages, local checks, spin lock, mmap",
+    "first fit, pages, no checks, no lock, mmap",
+    "first fit, exact, no checks, no lock, buffer",
+    "Memory, local checks, no cache and slabs",
+  };
+
+  printf("%-48s %16s\n", "variant", "ops per second");
+  for (int i = 0; i < 7; i++)
+    printf("%-48s %16.0f\n", names[i], results[i]);
+
+  return 0;
+}
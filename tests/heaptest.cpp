@@ -0,0 +1,116 @@
+/*
+ * heaptest.cpp
+ *
+ * Random malloc/realloc/free on Heap with each fit strategy, growth
+ * granularity, check level, lock and source. The data of every chunk has
+ * to survive, the heap walk has to succeed, and an empty heap gives its
+ * memory back.
+ */
+#include "../heap.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define SLOTS 500
+#define OPERATIONS 20000
+
+static char buffer[4 << 20];
+
+template<class HeapType>
+static void exercise(HeapType &heap, const char *name)
+{
+  void *ptrs[SLOTS] = {};
+  size_t sizes[SLOTS] = {};
+
+  srandom(1);
+  for (int i = 0; i < OPERATIONS; i++)
+  {
+    int slot = random() % SLOTS;
+
+    if (ptrs[slot] != nullptr)
+    {
+      // The pattern written when the chunk was allocated is still there
+      for (size_t j = 0; j < sizes[slot]; j++)
+        assert(((unsigned char*) ptrs[slot])[j] == (unsigned char) (slot + j));
+    }
+
+    size_t size = random() % 4 == 0 ? random() % 20000 : random() % 300;
+    int action = random() % 3;
+
+    if (action == 0 && ptrs[slot] != nullptr)
+    {
+      heap.free(ptrs[slot]);
+      ptrs[slot] = nullptr;
+      continue;
+    }
+
+    if (action == 1 && ptrs[slot] != nullptr)
+    {
+      void *ptr = heap.realloc(ptrs[slot], size);
+      assert(ptr != nullptr);
+
+      // The common part was kept
+      size_t kept = size < sizes[slot] ? size : sizes[slot];
+      for (size_t j = 0; j < kept; j++)
+        assert(((unsigned char*) ptr)[j] == (unsigned char) (slot + j));
+      ptrs[slot] = ptr;
+    }
+    else
+    {
+      heap.free(ptrs[slot]);
+      ptrs[slot] = heap.malloc(size);
+      assert(ptrs[slot] != nullptr);
+    }
+
+    assert((uintptr_t) ptrs[slot] % (2 * sizeof(size_t)) == 0);
+    assert(heap.usableSize(ptrs[slot]) >= size);
+
+    sizes[slot] = size;
+    for (size_t j = 0; j < size; j++)
+      ((unsigned char*) ptrs[slot])[j] = (unsigned char) (slot + j);
+
+    if (i % 1000 == 0)
+      heap.checkIntegrity();
+  }
+
+  for (int i = 0; i < SLOTS; i++)
+    heap.free(ptrs[i]);
+  heap.checkIntegrity();
+
+  // Only the end marker and the alignment in front of the first chunk stay
+  size_t footprint = heap.footprint();
+  printf("%-10s footprint after freeing everything: %zu\n", name, footprint);
+  assert(footprint < 4 * sizeof(size_t) + 4096);
+}
+
+int main()
+{
+  {
+    snp::Heap<> heap;
+    exercise(heap, "default");
+  }
+  {
+    snp::Heap<snp::BestFit, snp::PageGrowth, snp::FullCheck, snp::SpinLock> heap;
+    exercise(heap, "best fit");
+  }
+  {
+    snp::Heap<snp::FirstFit, snp::ExactGrowth, snp::NoCheck, snp::NoLock, snp::SbrkSource> heap;
+    exercise(heap, "sbrk");
+  }
+  {
+    snp::Heap<snp::FirstFit, snp::ExactGrowth, snp::NoCheck, snp::NoLock, snp::BufferSource> heap(buffer, sizeof(buffer));
+    exercise(heap, "buffer");
+
+    // The buffer is all there is, and all of it can be used again after the frees
+    assert(heap.malloc(sizeof(buffer)) == nullptr);
+    void *ptr = heap.malloc(sizeof(buffer) - 256);
+    assert(ptr != nullptr);
+    assert(heap.malloc(512) == nullptr);
+    heap.free(ptr);
+    heap.checkIntegrity();
+  }
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * numatest.cpp
+ *
+ * With an arena per node on a faked topology of 4 nodes, each thread
+ * allocates from the arena of its node: chosen with setThreadNode, or by
+ * the CPU it runs on. The stats and the dump break the usage out per node.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define NODES 4
+#define CHUNKS 100
+#define CHUNK_SIZE 3000
+
+static pthread_barrier_t allocated, checked;
+
+static void *work(void *arg)
+{
+  int node = (int) (intptr_t) arg;
+  snp::Memory::setThreadNode(node);
+
+  void *chunks[CHUNKS];
+  for (int i = 0; i < CHUNKS; i++)
+  {
+    chunks[i] = snp::Memory::malloc(CHUNK_SIZE * (node + 1));
+    memset(chunks[i], node, CHUNK_SIZE * (node + 1));
+  }
+
+  pthread_barrier_wait(&allocated);
+  pthread_barrier_wait(&checked);
+
+  for (int i = 0; i < CHUNKS; i++)
+    snp::Memory::free(chunks[i]);
+
+  return nullptr;
+}
+
+int main()
+{
+  snp::Memory::setOption(snp::Memory::NODE_COUNT, NODES);
+  snp::Memory::setOption(snp::Memory::ARENA_BY_NODE, 1);
+
+  snp::Memory::Stats before = snp::Memory::getStats();
+  assert(before.node_count == NODES);
+
+  pthread_barrier_init(&allocated, nullptr, NODES + 1);
+  pthread_barrier_init(&checked, nullptr, NODES + 1);
+
+  pthread_t threads[NODES];
+  for (int i = 0; i < NODES; i++)
+    pthread_create(&threads[i], nullptr, work, (void*) (intptr_t) i);
+
+  // Every node holds the chunks of its own thread
+  pthread_barrier_wait(&allocated);
+  snp::Memory::Stats during = snp::Memory::getStats();
+  for (int i = 0; i < NODES; i++)
+  {
+    size_t size = (size_t) CHUNKS * CHUNK_SIZE * (i + 1);
+    assert(during.nodes[i].used >= before.nodes[i].used + size);
+    assert(during.nodes[i].used < before.nodes[i].used + 2 * size);
+    assert(during.nodes[i].resident >= during.nodes[i].used);
+  }
+
+  char dump[8192];
+  int fds[2];
+  assert(pipe(fds) == 0);
+  snp::Memory::dumpStats(fds[1]);
+  close(fds[1]);
+  ssize_t length = read(fds[0], dump, sizeof(dump) - 1);
+  close(fds[0]);
+  assert(length > 0);
+  dump[length] = '\0';
+  assert(strstr(dump, "\nnode 3 ") != nullptr);
+
+  pthread_barrier_wait(&checked);
+  for (int i = 0; i < NODES; i++)
+    pthread_join(threads[i], nullptr);
+
+  // Without setThreadNode, the node of the CPU: CPU c is on node c % 4
+  int cpu = sched_getcpu();
+  int node = cpu < 0 ? 0 : cpu % NODES;
+  before = snp::Memory::getStats();
+  void *chunk = snp::Memory::malloc(50000);
+  assert(snp::Memory::getStats().nodes[node].used >= before.nodes[node].used + 50000);
+  snp::Memory::free(chunk);
+
+  // Off again: no per-node counters
+  snp::Memory::setOption(snp::Memory::ARENA_BY_NODE, 0);
+  assert(snp::Memory::getStats().node_count == 0);
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * ownerbench.cpp
+ *
+ * Time to find the owner of a pointer with more and more mapped chunks
+ * alive: malloc_usable_size on its own, and a free and malloc pair of a
+ * mapped chunk, which also costs a munmap and an mmap. A chunk in the heap
+ * of arena 0 is the baseline.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define MAX_CHUNKS 4096
+#define LOOKUPS 200000
+#define PAIRS 20000
+
+static void *chunks[MAX_CHUNKS];
+
+static double lookup(int count)
+{
+  size_t total = 0;
+
+  double start = now_s();
+  for (int i = 0; i < LOOKUPS; i++)
+    total += snp::Memory::usableSize(chunks[(unsigned int) i * 7919 % count]);
+  double elapsed = now_s() - start;
+
+  // Keeps the calls from being optimized away
+  if (total == 0)
+    printf("?\n");
+
+  return elapsed / LOOKUPS * 1e9;
+}
+
+static double pair(int count, size_t size)
+{
+  double start = now_s();
+  for (int i = 0; i < PAIRS; i++)
+  {
+    int index = (unsigned int) i * 7919 % count;
+    snp::Memory::free(chunks[index]);
+    chunks[index] = snp::Memory::malloc(size);
+  }
+  double elapsed = now_s() - start;
+
+  return elapsed / PAIRS * 1e9;
+}
+
+int main()
+{
+  // Every chunk of a page or more gets a mapping of its own, the heap chunks neither cached nor in slabs
+  snp::Memory::setOption(snp::Memory::MMAP_THRESHOLD, 4096);
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_OFF);
+
+  void *heap_chunk = snp::Memory::malloc(1000);
+  chunks[0] = heap_chunk;
+  printf("heap chunk: %.1f ns per usable size, %.1f ns per free and malloc\n\n", lookup(1), pair(1, 1000));
+  snp::Memory::free(chunks[0]);
+
+  printf("%14s %20s %24s\n", "mapped chunks", "ns per usable size", "ns per free and malloc");
+  int live = 0;
+  for (int count = 1; count <= MAX_CHUNKS; count *= 8)
+  {
+    for (; live < count; live++)
+      chunks[live] = snp::Memory::malloc(5000);
+
+    printf("%14d %20.1f %24.1f\n", count, lookup(count), pair(count, 5000));
+  }
+
+  for (int i = 0; i < live; i++)
+    snp::Memory::free(chunks[i]);
+
+  return 0;
+}
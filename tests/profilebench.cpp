@@ -0,0 +1,32 @@
+/*
+ * profilebench.cpp
+ *
+ * Throughput of malloc/free pairs of mixed sizes without the heap profiler
+ * and at several sampling rates.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define LIVE_CHUNKS 1000
+#define OPERATIONS 1000000
+
+static double measure(size_t rate)
+{
+  snp::Memory::setOption(snp::Memory::PROFILE_RATE, rate);
+  return replace_random(LIVE_CHUNKS, OPERATIONS, 512);
+}
+
+int main()
+{
+  // The heap walks of the hardening would hide the profiler
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  size_t rates[] = { 0, 4 << 20, 512 << 10, 64 << 10, 4 << 10 };
+
+  printf("%12s %16s\n", "sample rate", "ops per second");
+  for (int i = 0; i < 5; i++)
+    printf("%12zu %16.0f\n", rates[i], measure(rates[i]));
+
+  return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * profiletest.cpp
+ *
+ * With a sampling rate set, the heap profile attributes the sampled bytes
+ * to the call sites that allocated them, as live until they are freed.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define CHUNKS 4000
+#define CHUNK_SIZE 1000
+
+static void *chunks[CHUNKS];
+
+__attribute__((noinline)) static void allocate()
+{
+  for (int i = 0; i < CHUNKS; i++)
+    chunks[i] = snp::Memory::malloc(CHUNK_SIZE);
+}
+
+// Reads the totals in the header of the profile
+static void totals(size_t *live_size, size_t *total_size, char *profile, size_t length)
+{
+  FILE *file = tmpfile();
+  snp::Memory::dumpProfile(fileno(file));
+
+  rewind(file);
+  size_t read = fread(profile, 1, length - 1, file);
+  profile[read] = 0;
+  fclose(file);
+
+  size_t live_count, total_count;
+  assert(sscanf(profile, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile",
+                &live_count, live_size, &total_count, total_size) == 4);
+}
+
+int main()
+{
+  static char profile[1 << 20];
+  size_t live_size, total_size;
+
+  // Nothing is sampled by default
+  allocate();
+  for (int i = 0; i < CHUNKS; i++)
+    snp::Memory::free(chunks[i]);
+
+  totals(&live_size, &total_size, profile, sizeof(profile));
+  assert(live_size == 0 && total_size == 0);
+
+  // About one sample per 16 KiB -> ~250 samples, the estimate is within a few percent
+  snp::Memory::setOption(snp::Memory::PROFILE_RATE, 16 * 1024);
+  allocate();
+
+  totals(&live_size, &total_size, profile, sizeof(profile));
+  assert(live_size > CHUNKS * CHUNK_SIZE / 2 && live_size < CHUNKS * CHUNK_SIZE * 2);
+  assert(total_size == live_size);
+
+  // The stacks start at the call in allocate and come with the memory map
+  char *stack = strstr(profile, "] @ 0x");
+  assert(stack != nullptr);
+  unsigned long address = strtoul(stack + 4, nullptr, 16);
+  assert(address > (unsigned long) (uintptr_t) &allocate && address < (unsigned long) (uintptr_t) &allocate + 1000);
+  assert(strstr(profile, "\nMAPPED_LIBRARIES:\n") != nullptr);
+
+  // Freed samples move from live to freed, also with the profiler off
+  snp::Memory::setOption(snp::Memory::PROFILE_RATE, 0);
+  for (int i = 0; i < CHUNKS; i++)
+    snp::Memory::free(chunks[i]);
+
+  size_t freed_total;
+  totals(&live_size, &freed_total, profile, sizeof(profile));
+  assert(live_size == 0 && freed_total == total_size);
+
+  printf("Test passed\n");
+
+  return 0;
+}
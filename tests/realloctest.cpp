@@ -0,0 +1,122 @@
+/*
+ * realloctest.cpp
+ *
+ * realloc grows and shrinks in place where possible and keeps the data,
+ * calloc returns zeroed memory also for reused chunks, and the aligned
+ * allocation functions return aligned chunks.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+static void fill(char *ptr, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    ptr[i] = (char) i;
+}
+
+static bool check(char *ptr, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    if (ptr[i] != (char) i)
+      return false;
+  return true;
+}
+
+int main()
+{
+  // Keep the chunks on the heap, so where they end up is predictable
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+
+  // Grow at the heap end and into the free chunk behind it
+  char *ptr = (char*) snp::Memory::malloc(2000);
+  fill(ptr, 2000);
+
+  char *grown = (char*) snp::Memory::realloc(ptr, 3000);
+  assert(grown == ptr && check(grown, 2000));
+  fill(grown, 3000);
+
+  grown = (char*) snp::Memory::realloc(grown, 20000);
+  assert(grown == ptr && check(grown, 3000));
+
+  // Shrink in place, the rest can be used again
+  char *shrunk = (char*) snp::Memory::realloc(grown, 1000);
+  assert(shrunk == ptr && check(shrunk, 1000));
+
+  char *behind = (char*) snp::Memory::malloc(500);
+  assert(behind > shrunk && behind < shrunk + 20000);
+
+  // No space behind -> the data is moved
+  char *moved = (char*) snp::Memory::realloc(shrunk, 5000);
+  assert(moved != shrunk && check(moved, 1000));
+
+  snp::Memory::free(behind);
+  snp::Memory::free(moved);
+
+  // Mapped chunks are remapped
+  char *mapped = (char*) snp::Memory::malloc(1 << 20);
+  fill(mapped, 1 << 20);
+  mapped = (char*) snp::Memory::realloc(mapped, 4 << 20);
+  assert(check(mapped, 1 << 20));
+  snp::Memory::free(mapped);
+
+  assert(snp::Memory::realloc(nullptr, 100) != nullptr);
+
+  // calloc clears reused chunks
+  char *dirty = (char*) snp::Memory::malloc(6000);
+  memset(dirty, 0xff, 6000);
+  char *keep = (char*) snp::Memory::malloc(100);
+  snp::Memory::free(dirty);
+
+  char *zero = (char*) snp::Memory::calloc(1000, 6);
+  for (int i = 0; i < 6000; i++)
+    assert(zero[i] == 0);
+
+  // and new memory from the end of the heap
+  char *fresh = (char*) snp::Memory::calloc(10, 1000);
+  for (int i = 0; i < 10000; i++)
+    assert(fresh[i] == 0);
+
+  snp::Memory::free(zero);
+  snp::Memory::free(fresh);
+  snp::Memory::free(keep);
+
+  assert(snp::Memory::calloc((size_t) -1 / 2, 4) == nullptr && errno == ENOMEM);
+
+  // Every chunk is aligned to two words
+  for (size_t size = 0; size < 300; size += 7)
+  {
+    void *plain = snp::Memory::malloc(size);
+    assert((uintptr_t) plain % (2 * sizeof(size_t)) == 0);
+    snp::Memory::free(plain);
+  }
+
+  // Aligned allocations
+  for (size_t alignment = 8; alignment <= 8192; alignment *= 2)
+  {
+    char *aligned = (char*) snp::Memory::memalign(alignment, 300);
+    assert((uintptr_t) aligned % alignment == 0);
+    fill(aligned, 300);
+
+    void *posix = nullptr;
+    assert(snp::Memory::posix_memalign(&posix, alignment, 50) == 0);
+    assert((uintptr_t) posix % alignment == 0);
+
+    assert(check(aligned, 300));
+    snp::Memory::free(aligned);
+    snp::Memory::free(posix);
+  }
+
+  void *invalid = nullptr;
+  assert(snp::Memory::posix_memalign(&invalid, 12, 100) == EINVAL);
+  assert(snp::Memory::posix_memalign(&invalid, 0, 16) == EINVAL);
+  assert(snp::Memory::aligned_alloc(3, 100) == nullptr);
+
+  printf("Test passed\n");
+
+  return 0;
+}
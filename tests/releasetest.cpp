@@ -0,0 +1,85 @@
+/*
+ * releasetest.cpp
+ *
+ * The whole pages inside a free chunk in the middle of the heap are given
+ * back to the OS, right away or after the decay time, and calloc gets
+ * zeroed memory when it reuses them.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+
+// Number of resident pages in [ptr, ptr + size)
+static size_t residentPages(char *ptr, size_t size)
+{
+  size_t pagesize = getpagesize();
+  char *start = (char*) ((uintptr_t) ptr & ~(pagesize - 1));
+  size_t count = (ptr + size - start + pagesize - 1) / pagesize;
+
+  unsigned char pages[count];
+  assert(mincore(start, count * pagesize, pages) == 0);
+
+  size_t resident = 0;
+  for (size_t i = 0; i < count; i++)
+    resident += pages[i] & 1;
+  return resident;
+}
+
+int main()
+{
+  // Keep the chunks on the heap, so where they end up is predictable
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::MMAP_THRESHOLD, 0);
+
+  const size_t size = 64 * 1024;
+
+  // Given back as soon as the chunk is free. The chunk behind keeps it off the heap end.
+  snp::Memory::setOption(snp::Memory::RELEASE_DECAY, 0);
+
+  char *ptr = (char*) snp::Memory::malloc(size);
+  char *keep = (char*) snp::Memory::malloc(100);
+  memset(ptr, 0xff, size);
+  assert(residentPages(ptr, size) >= size / getpagesize());
+
+  snp::Memory::free(ptr);
+  assert(residentPages(ptr, size) <= 2);
+
+  // The same chunk is reused and cleared
+  char *zero = (char*) snp::Memory::calloc(1, size);
+  assert(zero == ptr);
+  for (size_t i = 0; i < size; i++)
+    assert(zero[i] == 0);
+
+  // Kept for the decay time, then given back by one of the next operations
+  snp::Memory::setOption(snp::Memory::RELEASE_DECAY, 50);
+
+  memset(zero, 0xff, size);
+  snp::Memory::free(zero);
+  assert(residentPages(zero, size) >= size / getpagesize() - 2);
+
+  // Operations that leave the free chunk alone
+  for (int round = 0; round < 100 && residentPages(zero, size) > 2; round++)
+  {
+    usleep(10000);
+    for (int i = 0; i < 64; i++)
+      assert(snp::Memory::realloc(keep, 100) == keep);
+  }
+  assert(residentPages(zero, size) <= 2);
+
+  // Only a part of the chunk is used, the rest stays given back
+  char *part = (char*) snp::Memory::calloc(1, size / 2);
+  assert(part == zero);
+  for (size_t i = 0; i < size / 2; i++)
+    assert(part[i] == 0);
+
+  snp::Memory::free(part);
+  snp::Memory::free(keep);
+
+  printf("Test passed\n");
+
+  return 0;
+}
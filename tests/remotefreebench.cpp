@@ -0,0 +1,96 @@
+/*
+ * remotefreebench.cpp
+ *
+ * Producer threads allocate chunks and hand them over a ring to a consumer
+ * thread, which frees them. Every free is a cross-thread free, so without
+ * REMOTE_FREE the consumer competes with the producer for the arena lock.
+ * Prints the throughput with and without the remote free queue.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+
+#define PAIRS 4
+#define CHUNKS 200000
+#define RING_SIZE 1024
+
+typedef struct ring
+{
+  void *slots[RING_SIZE];
+  size_t head; // written by the producer
+  size_t tail; // written by the consumer
+} ring;
+
+static ring rings[PAIRS];
+
+static void *producer(void *arg)
+{
+  ring *r = (ring*) arg;
+  unsigned int seed = r - rings;
+
+  for (size_t i = 0; i < CHUNKS; i++)
+  {
+    // Above the cached sizes and below the mmap threshold -> every chunk comes from the arena
+    size_t size = rand_r(&seed) % 3000 + 1100;
+    char *ptr = (char*) snp::Memory::malloc(size);
+    ptr[0] = 1;
+
+    while (i - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE)
+      sched_yield();
+    r->slots[i % RING_SIZE] = ptr;
+    __atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+  }
+
+  return nullptr;
+}
+
+static void *consumer(void *arg)
+{
+  ring *r = (ring*) arg;
+
+  for (size_t i = 0; i < CHUNKS; i++)
+  {
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == i)
+      sched_yield();
+    snp::Memory::free(r->slots[i % RING_SIZE]);
+    __atomic_store_n(&r->tail, i + 1, __ATOMIC_RELEASE);
+  }
+
+  return nullptr;
+}
+
+static double measure(int remote_free)
+{
+  pthread_t threads[2 * PAIRS];
+
+  snp::Memory::setOption(snp::Memory::REMOTE_FREE, remote_free);
+  memset(rings, 0, sizeof(rings));
+
+  double start = now_s();
+
+  for (int i = 0; i < PAIRS; i++)
+  {
+    pthread_create(&threads[2 * i], nullptr, producer, &rings[i]);
+    pthread_create(&threads[2 * i + 1], nullptr, consumer, &rings[i]);
+  }
+  for (int i = 0; i < 2 * PAIRS; i++)
+    pthread_join(threads[i], nullptr);
+
+  return PAIRS * CHUNKS / (now_s() - start);
+}
+
+int main()
+{
+  // One arena per producer, the consumers never allocate and so own no arena
+  snp::Memory::setOption(snp::Memory::ARENA_COUNT, PAIRS);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  printf("%12s %20s\n", "remote free", "malloc/free per s");
+  printf("%12s %20.0f\n", "off", measure(0));
+  printf("%12s %20.0f\n", "on", measure(1));
+
+  return 0;
+}
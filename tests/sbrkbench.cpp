@@ -0,0 +1,92 @@
+/*
+ * sbrkbench.cpp
+ *
+ * Number of sbrk calls and throughput for a chunk that is allocated and
+ * freed at the top of the heap over and over, and for a heap that grows
+ * chunk by chunk. Once with the heap growing by the missing pages and
+ * shrinking right away, and once with the default spans and trim threshold.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#define TOP_ITERATIONS 100000
+#define GROW_CHUNKS 20000
+
+extern "C" void *__sbrk(intptr_t increment);
+
+static size_t sbrk_calls = 0;
+
+// Replaces the one of the C library for the allocator, sbrk(0) only reads the break
+extern "C" void *sbrk(intptr_t increment) noexcept
+{
+  if (increment != 0)
+    sbrk_calls++;
+  return __sbrk(increment);
+}
+
+typedef struct result
+{
+    size_t top_calls;
+    double top_ops;
+    size_t grow_calls;
+    double grow_ops;
+} result;
+
+static result measure()
+{
+  static void *chunks[GROW_CHUNKS];
+  result r;
+
+  // A chunk at the top of the heap, of 1 to 64 KiB
+  srandom(1);
+  sbrk_calls = 0;
+  double start = now_s();
+  for (int i = 0; i < TOP_ITERATIONS; i++)
+  {
+    void *ptr = snp::Memory::malloc(1024 + random() % (63 * 1024));
+    snp::Memory::free(ptr);
+  }
+  r.top_ops = 2 * TOP_ITERATIONS / (now_s() - start);
+  r.top_calls = sbrk_calls;
+
+  // The heap grows by 1 KiB at a time and is freed again
+  sbrk_calls = 0;
+  start = now_s();
+  for (int i = 0; i < GROW_CHUNKS; i++)
+    chunks[i] = snp::Memory::malloc(1024);
+  for (int i = GROW_CHUNKS - 1; i >= 0; i--)
+    snp::Memory::free(chunks[i]);
+  r.grow_ops = 2 * GROW_CHUNKS / (now_s() - start);
+  r.grow_calls = sbrk_calls;
+
+  return r;
+}
+
+int main()
+{
+  // Only the heap of arena 0, which is the one of the first thread
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::MMAP_THRESHOLD, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  snp::Memory::setOption(snp::Memory::GROW_SPAN, 0);
+  snp::Memory::setOption(snp::Memory::TRIM_THRESHOLD, 0);
+  result exact = measure();
+
+  snp::Memory::setOption(snp::Memory::GROW_SPAN, 64 * 1024);
+  snp::Memory::setOption(snp::Memory::TRIM_THRESHOLD, 128 * 1024);
+  result spans = measure();
+
+  // Printed at the end, stdio takes memory with sbrk of its own
+  printf("%-24s %12s %16s %12s %16s\n", "", "top sbrk", "top ops/s", "grow sbrk", "grow ops/s");
+  printf("%-24s %12zu %16.0f %12zu %16.0f\n", "pages, trim right away",
+         exact.top_calls, exact.top_ops, exact.grow_calls, exact.grow_ops);
+  printf("%-24s %12zu %16.0f %12zu %16.0f\n", "spans, trim threshold",
+         spans.top_calls, spans.top_ops, spans.grow_calls, spans.grow_ops);
+
+  return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * sizedbench.cpp
+ *
+ * Time of a malloc and free pair with free and with freeSized, as used by
+ * the sized operator delete, for small and medium objects on the cached
+ * fast path, without and with local hardening.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define LIVE_OBJECTS 64
+#define OPERATIONS 5000000
+
+static double measure(size_t size, bool sized)
+{
+  void *live[LIVE_OBJECTS];
+  for (int i = 0; i < LIVE_OBJECTS; i++)
+    live[i] = snp::Memory::malloc(size);
+
+  double start = now_s();
+  for (int i = 0; i < OPERATIONS; i++)
+  {
+    int index = i % LIVE_OBJECTS;
+    if (sized)
+      snp::Memory::freeSized(live[index], size);
+    else
+      snp::Memory::free(live[index]);
+    live[index] = snp::Memory::malloc(size);
+  }
+  double elapsed = now_s() - start;
+
+  for (int i = 0; i < LIVE_OBJECTS; i++)
+    snp::Memory::free(live[i]);
+
+  return elapsed / OPERATIONS * 1e9;
+}
+
+int main()
+{
+  const size_t sizes[] = { 24, 48, 200, 1000 };
+  const char *names[] = { "off", "local" };
+  snp::Memory::Hardening levels[] = { snp::Memory::HARDENING_OFF, snp::Memory::HARDENING_LOCAL };
+
+  printf("%10s %8s %16s %16s\n", "hardening", "size", "free ns/pair", "sized ns/pair");
+  for (int level = 0; level < 2; level++)
+  {
+    snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, levels[level]);
+    for (size_t size : sizes)
+      printf("%10s %8zu %16.1f %16.1f\n", names[level], size, measure(size, false), measure(size, true));
+  }
+
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * sizedtest.cpp
+ *
+ * freeSized gives slab slots, heap chunks, mapped chunks and aligned chunks
+ * back like free, with and without hardening, and they are counted in the
+ * same classes as their allocations.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+static const size_t sizes[] = { 0, 1, 16, 17, 100, 256, 257, 1000, 5000, 200 * 1024 };
+static const int SIZE_COUNT = sizeof(sizes) / sizeof(sizes[0]);
+
+static void allocateAndFree()
+{
+  void *ptrs[SIZE_COUNT * 20];
+
+  for (int round = 0; round < 20; round++)
+    for (int i = 0; i < SIZE_COUNT; i++)
+    {
+      void *ptr = snp::Memory::malloc(sizes[i]);
+      assert(ptr != nullptr);
+      memset(ptr, 0x5a, sizes[i]);
+      ptrs[round * SIZE_COUNT + i] = ptr;
+    }
+
+  for (int round = 0; round < 20; round++)
+    for (int i = 0; i < SIZE_COUNT; i++)
+      snp::Memory::freeSized(ptrs[round * SIZE_COUNT + i], sizes[i]);
+
+  // Aligned chunks are freed with the size that was asked for as well
+  for (int i = 0; i < SIZE_COUNT; i++)
+  {
+    void *ptr = snp::Memory::memalign(64, sizes[i]);
+    assert(ptr != nullptr && (uintptr_t) ptr % 64 == 0);
+    snp::Memory::freeSized(ptr, sizes[i]);
+  }
+
+  // Freed slots and chunks are used again
+  for (int i = 0; i < SIZE_COUNT; i++)
+  {
+    void *ptr = snp::Memory::malloc(sizes[i]);
+    memset(ptr, 0xa5, sizes[i]);
+    snp::Memory::freeSized(ptr, sizes[i]);
+  }
+}
+
+int main()
+{
+  allocateAndFree();
+
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_OFF);
+  allocateAndFree();
+
+  // Without the thread cache, so the chunks go back to the slab runs and arenas right away.
+  // The chunks cached before stay in use.
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_FULL);
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::Stats before = snp::Memory::getStats();
+  allocateAndFree();
+
+  snp::Memory::Stats stats = snp::Memory::getStats();
+  for (int i = 0; i < snp::Memory::STATS_CLASS_COUNT; i++)
+    assert(stats.allocs[i] == stats.frees[i]);
+  assert(stats.used_chunks == before.used_chunks);
+  assert(stats.slab <= before.slab);
+  assert(stats.mapped_chunks == 0);
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * slabbench.cpp
+ *
+ * Memory used per small object, once with slab runs and once with every
+ * object in its own heap chunk.
+ */
+#include "../memory.h"
+#include "bench.h"
+#include <cstdio>
+
+#define OBJECTS 100000
+
+static double measure(size_t object_size)
+{
+  static void *objects[OBJECTS];
+
+  long before = resident_bytes();
+  for (int i = 0; i < OBJECTS; i++)
+    objects[i] = snp::Memory::malloc(object_size);
+
+  // Touch every object, so all used pages are resident
+  for (int i = 0; i < OBJECTS; i++)
+    *(char*) objects[i] = 1;
+  long after = resident_bytes();
+
+  for (int i = 0; i < OBJECTS; i++)
+    snp::Memory::free(objects[i]);
+
+  return (double) (after - before) / OBJECTS;
+}
+
+int main()
+{
+  size_t sizes[] = { 8, 16, 24, 32, 64, 128, 256 };
+
+  // Only compare the slots with the chunks, not the thread cache
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  printf("%12s %18s %18s\n", "object size", "bytes/obj (slab)", "bytes/obj (chunk)");
+  for (size_t size : sizes)
+  {
+    snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 256);
+    double slab = measure(size);
+
+    snp::Memory::setOption(snp::Memory::SLAB_MAX_SIZE, 0);
+    double chunk = measure(size);
+
+    printf("%12zu %18.1f %18.1f\n", size, slab, chunk);
+  }
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * statstest.cpp
+ *
+ * getStats follows allocations and frees per size class and the bytes in
+ * use, and dumpStats writes the counters as text and JSON.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+static snp::Memory::Stats stats()
+{
+  return snp::Memory::getStats();
+}
+
+// Index of the class counting chunks with the given usable size
+static int classOf(size_t size)
+{
+  int index = 0;
+  while (index + 1 < snp::Memory::STATS_CLASS_COUNT && snp::Memory::statsClassSize(index + 1) <= size)
+    index++;
+  return index;
+}
+
+int main()
+{
+  snp::Memory::setOption(snp::Memory::THREAD_CACHE_SIZE, 0);
+
+  // Counted by the usable size, once the chunk is freed it has the same class
+  snp::Memory::Stats before = stats();
+  void *ptr = snp::Memory::malloc(3000);
+  int index = classOf(snp::Memory::usableSize(ptr));
+
+  snp::Memory::Stats during = stats();
+  assert(during.allocs[index] == before.allocs[index] + 1);
+  assert(during.used >= before.used + 3000);
+  assert(during.used_chunks == before.used_chunks + 1);
+  assert(during.sbrk + during.mmap >= during.used + during.free);
+
+  snp::Memory::free(ptr);
+  snp::Memory::Stats after = stats();
+  assert(after.frees[index] == before.frees[index] + 1);
+  assert(after.used_chunks == before.used_chunks);
+
+  // Slab slots and mapped chunks
+  void *slot = snp::Memory::malloc(40);
+  void *mapped = snp::Memory::malloc(1 << 20);
+  during = stats();
+  assert(during.slab > 0);
+  assert(during.mapped >= 1 << 20 && during.mapped_chunks == after.mapped_chunks + 1);
+  assert(during.allocs[snp::Memory::STATS_CLASS_COUNT - 1] == after.allocs[snp::Memory::STATS_CLASS_COUNT - 1] + 1);
+
+  snp::Memory::free(mapped);
+  snp::Memory::free(slot);
+  assert(stats().mapped_chunks == after.mapped_chunks);
+
+  // memalign counts one allocation, also when its first try is not aligned and given back
+  before = stats();
+  void *aligned[10];
+  for (int i = 0; i < 10; i++)
+    aligned[i] = snp::Memory::memalign(4096, 100);
+  during = stats();
+
+  size_t allocs = 0, frees = 0;
+  for (int i = 0; i < snp::Memory::STATS_CLASS_COUNT; i++)
+  {
+    allocs += during.allocs[i] - before.allocs[i];
+    frees += during.frees[i] - before.frees[i];
+  }
+  assert(allocs == 10 && frees == 0);
+
+  for (int i = 0; i < 10; i++)
+    snp::Memory::free(aligned[i]);
+
+  // Every locked operation takes an arena lock
+  assert(stats().locks > 0);
+
+  // The dumps end up in a file, without allocating
+  FILE *file = tmpfile();
+  snp::Memory::dumpStats(fileno(file), false);
+  snp::Memory::dumpStats(fileno(file), true);
+
+  char buffer[8192] = {};
+  rewind(file);
+  fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+
+  assert(strncmp(buffer, "used ", 5) == 0);
+  assert(strstr(buffer, "\nlock_wait_ns ") != nullptr);
+  assert(strstr(buffer, "\nclass ") != nullptr);
+
+  char *json = strchr(buffer, '{');
+  assert(json != nullptr && strncmp(json, "{\"used\":", 8) == 0);
+  assert(strstr(json, "\"classes\":[{\"size\":") != nullptr);
+  assert(strcmp(json + strlen(json) - 3, "]}\n") == 0);
+
+  printf("Test passed\n");
+
+  return 0;
+}
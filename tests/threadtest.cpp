@@ -0,0 +1,72 @@
+/*
+ * threadtest.cpp
+ *
+ * Several threads allocate from their arenas, then free the chunks of
+ * another thread, so every chunk has to find its way back to its arena.
+ */
+#include "../memory.h"
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+
+#define THREADS 8
+#define CHUNKS 2000
+
+static char *chunks[THREADS][CHUNKS];
+static pthread_barrier_t barrier;
+
+static void *worker(void *arg)
+{
+  int id = (int) (size_t) arg;
+  unsigned int seed = id;
+
+  for (int i = 0; i < CHUNKS; i++)
+  {
+    size_t size = rand_r(&seed) % 4000 + 1;
+    chunks[id][i] = (char*) snp::Memory::malloc(size);
+    memset(chunks[id][i], id, size);
+    chunks[id][i][0] = (char) id;
+  }
+
+  pthread_barrier_wait(&barrier);
+
+  // Free the chunks of the neighbor
+  int other = (id + 1) % THREADS;
+  int errors = 0;
+  for (int i = 0; i < CHUNKS; i++)
+  {
+    if (chunks[other][i][0] != (char) other)
+      errors++;
+    snp::Memory::free(chunks[other][i]);
+  }
+
+  return (void*) (size_t) errors;
+}
+
+int main()
+{
+  pthread_t threads[THREADS];
+  size_t errors = 0;
+
+  snp::Memory::setOption(snp::Memory::ARENA_COUNT, 4);
+  snp::Memory::setOption(snp::Memory::HARDENING_LEVEL, snp::Memory::HARDENING_LOCAL);
+
+  pthread_barrier_init(&barrier, nullptr, THREADS);
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], nullptr, worker, (void*) (size_t) i);
+
+  for (int i = 0; i < THREADS; i++)
+  {
+    void *result;
+    pthread_join(threads[i], &result);
+    errors += (size_t) result;
+  }
+
+  if (errors == 0)
+  {
+    printf("Test passed\n");
+    return 0;
+  }
+  printf("Test failed: %zu chunks corrupted\n", errors);
+  return 1;
+}
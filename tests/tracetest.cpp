@@ -0,0 +1,170 @@
+/*
+ * tracetest.cpp
+ *
+ * The trace has an event for each call of the program, from every thread,
+ * and none for the calls the allocator makes itself, e.g. the malloc and free
+ * of a realloc that moves the chunk. Threads that exit leave their events,
+ * the child of a fork and the calls after stopTrace leave none. More threads
+ * than fit in 16 bits keep ids of their own.
+ */
+#include "../memory.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <set>
+#include <sys/wait.h>
+#include <vector>
+
+#define THREADS 4
+#define ROUNDS 3000
+#define SHORT_THREADS 70000
+
+typedef snp::Memory::TraceEvent TraceEvent;
+
+// Each round: malloc, realloc twice (in place and moved), free, and calloc and free
+static void *worker(void *)
+{
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    char *ptr = (char*) snp::Memory::malloc(i % 500 + 1);
+    ptr = (char*) snp::Memory::realloc(ptr, i % 500 + 2);
+    ptr = (char*) snp::Memory::realloc(ptr, 100000);
+    snp::Memory::free(ptr);
+    snp::Memory::free(snp::Memory::calloc(10, 10));
+  }
+
+  return nullptr;
+}
+
+static void *shortWorker(void *)
+{
+  snp::Memory::free(snp::Memory::malloc(100));
+  return nullptr;
+}
+
+static std::vector<TraceEvent> readTrace(FILE *file)
+{
+  fflush(file);
+  rewind(file);
+
+  snp::Memory::TraceHeader header;
+  assert(fread(&header, sizeof(header), 1, file) == 1);
+  assert(memcmp(header.magic, "SNPTRACE", 8) == 0 && header.version == snp::Memory::TRACE_VERSION && header.event_size == sizeof(TraceEvent));
+
+  std::vector<TraceEvent> events;
+  TraceEvent event;
+  while (fread(&event, sizeof(event), 1, file) == 1)
+    events.push_back(event);
+
+  return events;
+}
+
+int main()
+{
+  FILE *file = tmpfile();
+  snp::Memory::startTrace(fileno(file));
+
+  // The main thread: every kind of call once
+  void *ptr = snp::Memory::malloc(100);
+  void *aligned = snp::Memory::memalign(4096, 100);
+  void *batch[8];
+  size_t count = snp::Memory::mallocBatch(64, 8, batch);
+  assert(count == 8);
+  snp::Memory::freeBatch(batch, 8);
+  snp::Memory::freeSized(ptr, 100);
+  snp::Memory::free(aligned);
+  snp::Memory::free(nullptr);
+
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], nullptr, worker, nullptr);
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], nullptr);
+
+  // The child has nothing to write
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    for (int i = 0; i < 5000; i++)
+      snp::Memory::free(snp::Memory::malloc(100));
+    snp::Memory::stopTrace();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  snp::Memory::stopTrace();
+  snp::Memory::free(snp::Memory::malloc(100));
+
+  std::vector<TraceEvent> events = readTrace(file);
+  assert(events.size() == 20 + THREADS * ROUNDS * 6);
+
+  size_t types[5] = {};
+  uint64_t last_time[65536] = {};
+  int threads_seen = 0;
+  for (const TraceEvent &event : events)
+  {
+    types[event.type]++;
+
+    // The events of a thread are in order, and only those of other threads come between them
+    assert(event.thread != 0);
+    if (last_time[event.thread] == 0)
+      threads_seen++;
+    assert(event.time + 1 >= last_time[event.thread]);
+    last_time[event.thread] = event.time + 1;
+
+    if (event.type == snp::Memory::TRACE_MEMALIGN)
+      assert(event.arg == 4096 && event.ptr % 4096 == 0);
+    if (event.type == snp::Memory::TRACE_CALLOC)
+      assert(event.size == 100);
+  }
+
+  assert(threads_seen == THREADS + 1);
+  assert(types[snp::Memory::TRACE_MALLOC] == 9 + THREADS * ROUNDS);
+  assert(types[snp::Memory::TRACE_FREE] == 10 + THREADS * ROUNDS * 2);
+  assert(types[snp::Memory::TRACE_REALLOC] == THREADS * ROUNDS * 2);
+  assert(types[snp::Memory::TRACE_CALLOC] == THREADS * ROUNDS);
+  assert(types[snp::Memory::TRACE_MEMALIGN] == 1);
+
+  // A realloc names the chunk it got, and the next event of its thread is about that chunk
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    if (events[i].type != snp::Memory::TRACE_REALLOC)
+      continue;
+
+    for (size_t j = i + 1; j < events.size(); j++)
+    {
+      if (events[j].thread != events[i].thread)
+        continue;
+      assert(events[j].type == snp::Memory::TRACE_REALLOC ? events[j].arg == events[i].ptr : events[j].ptr == events[i].ptr);
+      break;
+    }
+  }
+
+  fclose(file);
+
+  // The ids of threads only grow, one at a time
+  file = tmpfile();
+  snp::Memory::startTrace(fileno(file));
+  for (int i = 0; i < SHORT_THREADS; i++)
+  {
+    pthread_t thread;
+    pthread_create(&thread, nullptr, shortWorker, nullptr);
+    pthread_join(thread, nullptr);
+  }
+  snp::Memory::stopTrace();
+
+  events = readTrace(file);
+  assert(events.size() == 2 * SHORT_THREADS);
+
+  std::set<uint32_t> ids;
+  for (const TraceEvent &event : events)
+    ids.insert(event.thread);
+  assert(ids.size() == SHORT_THREADS && *ids.rbegin() > 65535);
+
+  fclose(file);
+
+  printf("Test passed\n");
+  return 0;
+}
@@ -0,0 +1,271 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sched.h>
+#include <sys/mman.h>
+#include "memory.h"
+
+int snp::Memory::trace_fd = -1;
+uint64_t snp::Memory::trace_start = 0;
+unsigned int snp::Memory::trace_threads = 0;
+snp::Memory::trace_buffer *snp::Memory::trace_buffers = nullptr;
+pthread_mutex_t snp::Memory::trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread snp::Memory::trace_buffer *snp::Memory::trace_local = nullptr;
+__thread unsigned int snp::Memory::trace_thread = 0;
+__thread int snp::Memory::trace_busy = 0;
+
+void *snp::Memory::traceAllocate(int type, size_t size, size_t arg)
+{
+  uint64_t start = traceClock();
+
+  trace_busy = 1;
+  void *ptr;
+  if (type == TRACE_CALLOC)
+    ptr = calloc(1, size);
+  else if (type == TRACE_MEMALIGN)
+    ptr = memalign(arg, size);
+  else
+    ptr = malloc(size);
+  trace_busy = 0;
+
+  // A failed call changes nothing
+  if (ptr != nullptr)
+    traceEvent(type, ptr, arg, size, start, traceClock());
+
+  return ptr;
+}
+
+void snp::Memory::traceFree(void *ptr)
+{
+  uint64_t start = traceClock();
+
+  trace_busy = 1;
+  free(ptr);
+  trace_busy = 0;
+
+  traceEvent(TRACE_FREE, ptr, 0, 0, start, traceClock());
+}
+
+void *snp::Memory::traceRealloc(void *ptr, size_t size)
+{
+  uint64_t start = traceClock();
+
+  trace_busy = 1;
+  void *new_ptr = realloc(ptr, size);
+  trace_busy = 0;
+
+  // The old chunk stays if it fails, a size of 0 frees it
+  if (new_ptr != nullptr || size == 0)
+    traceEvent(TRACE_REALLOC, new_ptr, (uintptr_t) ptr, size, start, traceClock());
+
+  return new_ptr;
+}
+
+size_t snp::Memory::traceMallocBatch(size_t size, size_t count, void **ptrs)
+{
+  uint64_t start = traceClock();
+
+  trace_busy = 1;
+  size_t done = mallocBatch(size, count, ptrs);
+  trace_busy = 0;
+
+  // A malloc of each chunk, they all took the time of the batch
+  uint64_t end = traceClock();
+  for (size_t i = 0; i < done; i++)
+    traceEvent(TRACE_MALLOC, ptrs[i], 0, size, start, end);
+
+  return done;
+}
+
+void snp::Memory::traceFreeBatch(void **ptrs, size_t count)
+{
+  uint64_t start = traceClock();
+
+  trace_busy = 1;
+  freeBatch(ptrs, count);
+  trace_busy = 0;
+
+  uint64_t end = traceClock();
+  for (size_t i = 0; i < count; i++)
+    if (ptrs[i] != nullptr)
+      traceEvent(TRACE_FREE, ptrs[i], 0, 0, start, end);
+}
+
+void snp::Memory::traceEvent(int type, void *ptr, uint64_t arg, uint64_t size, uint64_t start, uint64_t end)
+{
+  // Taking a buffer may allocate, which is not traced
+  trace_busy = 1;
+
+  trace_buffer *buffer = trace_local != nullptr ? trace_local : traceBuffer();
+  if (buffer == nullptr)
+  {
+    trace_busy = 0;
+    return;
+  }
+
+  // The owner and stopTrace take turns. Once stopTrace has switched the trace off
+  // and had its turn, the owner sees that the trace is off.
+  while (__atomic_exchange_n(&buffer->busy, 1, __ATOMIC_SEQ_CST))
+    sched_yield();
+
+  int fd = __atomic_load_n(&trace_fd, __ATOMIC_SEQ_CST);
+  if (fd >= 0)
+  {
+    TraceEvent *event = &buffer->events[buffer->count];
+    event->time = start - trace_start;
+    event->ptr = (uintptr_t) ptr;
+    event->arg = arg;
+    event->size = size;
+    event->duration = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t) (end - start);
+    event->thread = trace_thread;
+    event->type = type;
+    event->reserved = 0;
+
+    if (++buffer->count == TRACE_BUFFER_EVENTS)
+      traceWrite(buffer, fd);
+  }
+
+  __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+  trace_busy = 0;
+}
+
+snp::Memory::trace_buffer *snp::Memory::traceBuffer()
+{
+  // The buffer of a thread that has exited, or a new one
+  pthread_mutex_lock(&trace_mutex);
+
+  trace_buffer *buffer = trace_buffers;
+  while (buffer != nullptr && buffer->owned)
+    buffer = buffer->next;
+
+  if (buffer != nullptr)
+    buffer->owned = 1;
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  if (buffer == nullptr)
+  {
+    void *mapping = mmap(nullptr, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+      return nullptr;
+
+    buffer = (trace_buffer*) mapping;
+    buffer->owned = 1;
+
+    pthread_mutex_lock(&trace_mutex);
+    buffer->next = trace_buffers;
+    __atomic_store_n(&trace_buffers, buffer, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_mutex);
+  }
+
+  trace_local = buffer;
+  trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+
+  // The exit handler gives the buffer up
+  cacheRegister();
+
+  return buffer;
+}
+
+void snp::Memory::traceWrite(trace_buffer *buffer, int fd)
+{
+  // Called by whoever has the turn on the buffer. Whole buffers are written
+  // under the lock, so the events of two threads are never mixed up.
+  pthread_mutex_lock(&trace_mutex);
+
+  size_t length = buffer->count * sizeof(TraceEvent);
+  size_t written = 0;
+  while (written < length)
+  {
+    ssize_t count = write(fd, (char*) buffer->events + written, length - written);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      break;
+    written += count;
+  }
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  buffer->count = 0;
+}
+
+uint64_t snp::Memory::traceClock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void snp::Memory::startTrace(int fd)
+{
+  // A trace that is running ends first
+  stopTrace();
+
+  TraceHeader header = {};
+  memcpy(header.magic, "SNPTRACE", sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.event_size = sizeof(TraceEvent);
+
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    return;
+
+  trace_start = traceClock();
+  __atomic_store_n(&trace_fd, fd, __ATOMIC_SEQ_CST);
+}
+
+void snp::Memory::stopTrace()
+{
+  int fd = __atomic_exchange_n(&trace_fd, -1, __ATOMIC_SEQ_CST);
+  if (fd < 0)
+    return;
+
+  // New buffers are put in front, they have nothing to write yet
+  for (trace_buffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != nullptr; buffer = buffer->next)
+  {
+    while (__atomic_exchange_n(&buffer->busy, 1, __ATOMIC_SEQ_CST))
+      sched_yield();
+
+    if (buffer->count != 0)
+      traceWrite(buffer, fd);
+
+    __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void snp::Memory::traceExit()
+{
+  // Called on thread exit: write what is left and leave the buffer to the next thread
+  trace_buffer *buffer = trace_local;
+  if (buffer == nullptr)
+    return;
+
+  while (__atomic_exchange_n(&buffer->busy, 1, __ATOMIC_SEQ_CST))
+    sched_yield();
+
+  int fd = __atomic_load_n(&trace_fd, __ATOMIC_SEQ_CST);
+  if (fd >= 0 && buffer->count != 0)
+    traceWrite(buffer, fd);
+
+  pthread_mutex_lock(&trace_mutex);
+  buffer->owned = 0;
+  pthread_mutex_unlock(&trace_mutex);
+
+  __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+  trace_local = nullptr;
+}
+
+void snp::Memory::traceFork()
+{
+  // The child does not trace: the file belongs to the parent, which writes the events
+  // that were buffered at the fork itself. The buffers of the other threads are free.
+  trace_fd = -1;
+  pthread_mutex_init(&trace_mutex, nullptr);
+
+  for (trace_buffer *buffer = trace_buffers; buffer != nullptr; buffer = buffer->next)
+  {
+    buffer->busy = 0;
+    buffer->count = 0;
+    buffer->owned = buffer == trace_local;
+  }
+}